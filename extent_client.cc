@@ -55,4 +55,97 @@ extent_client::remove(extent_protocol::extentid_t eid)
   return ret;
 }
 
+extent_protocol::status
+extent_client::snapshot(int &sid)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  ret = es->snapshot(0, sid);
+  return ret;
+}
+
+extent_protocol::status
+extent_client::snap_get(uint32_t sid, extent_protocol::extentid_t eid,
+                        std::string &buf)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  ret = es->snap_get(sid, eid, buf);
+  return ret;
+}
+
+extent_protocol::status
+extent_client::snap_getattr(uint32_t sid, extent_protocol::extentid_t eid,
+                            extent_protocol::attr &attr)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  ret = es->snap_getattr(sid, eid, attr);
+  return ret;
+}
+
+extent_protocol::status
+extent_client::snap_delete(uint32_t sid)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  int r;
+  ret = es->snap_delete(sid, r);
+  return ret;
+}
+
+extent_protocol::status
+extent_client::scrub(int &problems)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  ret = es->scrub(0, problems);
+  return ret;
+}
+
+extent_protocol::status
+extent_client::read_range(extent_protocol::extentid_t eid,
+                          unsigned long long off, unsigned int len,
+                          std::string &buf)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  ret = es->read_range(eid, off, len, buf);
+  return ret;
+}
+
+extent_protocol::status
+extent_client::write_range(extent_protocol::extentid_t eid,
+                           unsigned long long off, std::string buf,
+                           unsigned long long *old_size)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  unsigned long long r = 0;
+  ret = es->write_range(eid, off, buf, r);
+  if (old_size != NULL)
+    *old_size = r;
+  return ret;
+}
 
+extent_protocol::status
+extent_client::truncate(extent_protocol::extentid_t eid,
+                        unsigned long long size)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  int r;
+  ret = es->truncate(eid, size, r);
+  return ret;
+}
+
+extent_protocol::status
+extent_client::fallocate(extent_protocol::extentid_t eid,
+                         unsigned long long off, unsigned long long len)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  int r;
+  ret = es->fallocate(eid, off, len, r);
+  return ret;
+}
+
+extent_protocol::status
+extent_client::sync()
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  int r;
+  ret = es->sync(0, r);
+  return ret;
+}
@@ -21,6 +21,37 @@ class extent_client {
 				                          extent_protocol::attr &a);
   extent_protocol::status put(extent_protocol::extentid_t eid, std::string buf);
   extent_protocol::status remove(extent_protocol::extentid_t eid);
+  extent_protocol::status snapshot(int &sid);
+  extent_protocol::status snap_get(uint32_t sid, extent_protocol::extentid_t eid,
+                                   std::string &buf);
+  extent_protocol::status snap_getattr(uint32_t sid,
+                                       extent_protocol::extentid_t eid,
+                                       extent_protocol::attr &a);
+  // Delete a snapshot, freeing the blocks it alone holds.
+  extent_protocol::status snap_delete(uint32_t sid);
+  extent_protocol::status scrub(int &problems);
+  // Read or write part of a file: only the blocks of the range are
+  // touched. A read past the end returns fewer bytes; a write past it
+  // grows the file, leaving any gap a hole that reads as zeros, and
+  // gives the size the file had before in *old_size if asked.
+  extent_protocol::status read_range(extent_protocol::extentid_t eid,
+                                     unsigned long long off, unsigned int len,
+                                     std::string &buf);
+  extent_protocol::status write_range(extent_protocol::extentid_t eid,
+                                      unsigned long long off, std::string buf,
+                                      unsigned long long *old_size = NULL);
+  // Change the size of a file, freeing blocks at its end or growing it
+  // by a hole, and allocate the blocks of a range, growing the file
+  // over it.
+  extent_protocol::status truncate(extent_protocol::extentid_t eid,
+                                   unsigned long long size);
+  extent_protocol::status fallocate(extent_protocol::extentid_t eid,
+                                    unsigned long long off,
+                                    unsigned long long len);
+  // Write everything back to disk. IOERR if file data written earlier
+  // could not be given blocks after all, which is then still held in
+  // memory.
+  extent_protocol::status sync();
 };
 
 #endif 
@@ -14,7 +14,17 @@ class extent_protocol {
     put = 0x6001,
     get,
     getattr,
-    remove
+    remove,
+    snapshot,
+    snap_get,
+    snap_getattr,
+    scrub,
+    read_range,
+    write_range,
+    truncate,
+    fallocate,
+    sync,
+    snap_delete
   };
 
   enum types {
@@ -28,7 +38,7 @@ class extent_protocol {
     unsigned int atime;
     unsigned int mtime;
     unsigned int ctime;
-    unsigned int size;
+    unsigned long long size;
   };
 };
 
@@ -12,6 +12,8 @@
 extent_server::extent_server() 
 {
   im = new inode_manager();
+  pthread_mutex_init(&snaps_lock, NULL);
+  pthread_rwlock_init(&views_rw, NULL);
 }
 
 int extent_server::create(uint32_t type, extent_protocol::extentid_t &id)
@@ -78,3 +80,194 @@ int extent_server::remove(extent_protocol::extentid_t id, int &)
   return extent_protocol::OK;
 }
 
+int extent_server::snapshot(int, int &sid)
+{
+  printf("extent_server: snapshot\n");
+
+  sid = im->snapshot();
+  if (sid < 0)
+    return extent_protocol::IOERR;
+  return extent_protocol::OK;
+}
+
+inode_manager *extent_server::snap_im(uint32_t sid)
+{
+  ScopedLock ml(&snaps_lock);
+  std::map<uint32_t, inode_manager *>::iterator it = snaps.find(sid);
+  if (it != snaps.end())
+    return it->second;
+  if (!im->has_snapshot(sid))
+    return NULL;
+  return snaps[sid] = new inode_manager(im, sid);
+}
+
+int extent_server::snap_get(uint32_t sid, extent_protocol::extentid_t id,
+                            std::string &buf)
+{
+  printf("extent_server: snap_get %u %lld\n", sid, id);
+
+  id &= 0x7fffffff;
+  VERIFY(pthread_rwlock_rdlock(&views_rw) == 0);
+  inode_manager *sim = snap_im(sid);
+  if (sim == NULL) {
+    VERIFY(pthread_rwlock_unlock(&views_rw) == 0);
+    return extent_protocol::NOENT;
+  }
+
+  int size = 0;
+  char *cbuf = NULL;
+
+  sim->read_file(id, &cbuf, &size);
+  VERIFY(pthread_rwlock_unlock(&views_rw) == 0);
+  if (size == 0)
+    buf = "";
+  else {
+    buf.assign(cbuf, size);
+    free(cbuf);
+  }
+
+  return extent_protocol::OK;
+}
+
+int extent_server::snap_getattr(uint32_t sid, extent_protocol::extentid_t id,
+                                extent_protocol::attr &a)
+{
+  printf("extent_server: snap_getattr %u %lld\n", sid, id);
+
+  id &= 0x7fffffff;
+  VERIFY(pthread_rwlock_rdlock(&views_rw) == 0);
+  inode_manager *sim = snap_im(sid);
+  if (sim == NULL) {
+    VERIFY(pthread_rwlock_unlock(&views_rw) == 0);
+    return extent_protocol::NOENT;
+  }
+
+  extent_protocol::attr attr;
+  memset(&attr, 0, sizeof(attr));
+  sim->getattr(id, attr);
+  VERIFY(pthread_rwlock_unlock(&views_rw) == 0);
+  a = attr;
+
+  return extent_protocol::OK;
+}
+
+// Check the live filesystem in the background of the other requests;
+// see FSCK_ONLINE.
+int extent_server::scrub(int, int &problems)
+{
+  printf("extent_server: scrub\n");
+
+  fsck_report r;
+  im->check(1, FSCK_ONLINE, r);
+  problems = r.problems();
+
+  return extent_protocol::OK;
+}
+
+int extent_server::read_range(extent_protocol::extentid_t id,
+                              unsigned long long off, unsigned int len,
+                              std::string &buf)
+{
+  printf("extent_server: read_range %lld %llu %u\n", id, off, len);
+
+  id &= 0x7fffffff;
+  // len comes from the client: never allocate more than the file holds
+  // past off
+  extent_protocol::attr a;
+  memset(&a, 0, sizeof(a));
+  im->getattr(id, a);
+  if (a.type == 0) {
+    buf = "";
+    return extent_protocol::NOENT;
+  }
+  if (off >= a.size)
+    len = 0;
+  else if (len > a.size - off)
+    len = a.size - off;
+  buf.resize(len);
+  int n = len > 0 ? im->read_range(id, off, len, &buf[0]) : 0;
+  if (n < 0) {
+    buf = "";
+    return extent_protocol::NOENT;
+  }
+  buf.resize(n);
+
+  return extent_protocol::OK;
+}
+
+// Replies with the size the file had before the write, read under the
+// same inode lock as the write itself.
+int extent_server::write_range(extent_protocol::extentid_t id,
+                               unsigned long long off, std::string buf,
+                               unsigned long long &old_size)
+{
+  printf("extent_server: write_range %lld %llu %zu\n", id, off, buf.size());
+
+  id &= 0x7fffffff;
+  uint64_t size = 0;
+  if (im->write_range(id, off, buf.size(), buf.data(), &size) < 0)
+    return extent_protocol::IOERR;
+  old_size = size;
+
+  return extent_protocol::OK;
+}
+
+int extent_server::truncate(extent_protocol::extentid_t id,
+                            unsigned long long size, int &)
+{
+  printf("extent_server: truncate %lld %llu\n", id, size);
+
+  id &= 0x7fffffff;
+  if (im->truncate(id, size) < 0)
+    return extent_protocol::IOERR;
+
+  return extent_protocol::OK;
+}
+
+int extent_server::fallocate(extent_protocol::extentid_t id,
+                             unsigned long long off, unsigned long long len,
+                             int &)
+{
+  printf("extent_server: fallocate %lld %llu %llu\n", id, off, len);
+
+  id &= 0x7fffffff;
+  if (im->fallocate(id, off, len) < 0)
+    return extent_protocol::IOERR;
+
+  return extent_protocol::OK;
+}
+
+// Write everything back; fails if delayed file data could not be
+// given blocks, now or since the last sync.
+int extent_server::sync(int, int &)
+{
+  printf("extent_server: sync\n");
+
+  if (im->flush() < 0)
+    return extent_protocol::IOERR;
+
+  return extent_protocol::OK;
+}
+
+// Drop the view of snapshot sid, once no request reads a view, and
+// free its blocks.
+int extent_server::snap_delete(uint32_t sid, int &)
+{
+  printf("extent_server: snap_delete %u\n", sid);
+
+  VERIFY(pthread_rwlock_wrlock(&views_rw) == 0);
+  {
+    ScopedLock ml(&snaps_lock);
+    std::map<uint32_t, inode_manager *>::iterator it = snaps.find(sid);
+    if (it != snaps.end()) {
+      delete it->second;
+      snaps.erase(it);
+    }
+  }
+  bool ok = im->delete_snapshot(sid);
+  VERIFY(pthread_rwlock_unlock(&views_rw) == 0);
+  if (!ok)
+    return extent_protocol::NOENT;
+
+  return extent_protocol::OK;
+}
@@ -18,6 +18,15 @@ class extent_server {
   std::map <extent_protocol::extentid_t, extent_t> extents;
 #endif
   inode_manager *im;
+  // read-only views of the snapshots, opened on first use; the
+  // requests run on several threads, each inode_manager locking the
+  // inodes it works on. A request reading a view holds views_rw
+  // shared, so that deleting a snapshot, which holds it exclusively,
+  // never frees a view in use
+  std::map<uint32_t, inode_manager *> snaps;
+  pthread_mutex_t snaps_lock;
+  pthread_rwlock_t views_rw;
+  inode_manager *snap_im(uint32_t sid);
 
  public:
   extent_server();
@@ -27,6 +36,20 @@ class extent_server {
   int get(extent_protocol::extentid_t id, std::string &);
   int getattr(extent_protocol::extentid_t id, extent_protocol::attr &);
   int remove(extent_protocol::extentid_t id, int &);
+  int snapshot(int, int &sid);
+  int snap_get(uint32_t sid, extent_protocol::extentid_t id, std::string &);
+  int snap_getattr(uint32_t sid, extent_protocol::extentid_t id,
+                   extent_protocol::attr &);
+  int scrub(int, int &problems);
+  int read_range(extent_protocol::extentid_t id, unsigned long long off,
+                 unsigned int len, std::string &);
+  int write_range(extent_protocol::extentid_t id, unsigned long long off,
+                  std::string, unsigned long long &old_size);
+  int truncate(extent_protocol::extentid_t id, unsigned long long size, int &);
+  int fallocate(extent_protocol::extentid_t id, unsigned long long off,
+                unsigned long long len, int &);
+  int sync(int, int &);
+  int snap_delete(uint32_t sid, int &);
 };
 
 #endif 
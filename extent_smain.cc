@@ -2,6 +2,7 @@
 #include <arpa/inet.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <unistd.h>
 #include "extent_server.h"
 
 // Main loop of extent server
@@ -30,6 +31,16 @@ main(int argc, char *argv[])
   server.reg(extent_protocol::getattr, &ls, &extent_server::getattr);
   server.reg(extent_protocol::put, &ls, &extent_server::put);
   server.reg(extent_protocol::remove, &ls, &extent_server::remove);
+  server.reg(extent_protocol::snapshot, &ls, &extent_server::snapshot);
+  server.reg(extent_protocol::snap_get, &ls, &extent_server::snap_get);
+  server.reg(extent_protocol::snap_getattr, &ls, &extent_server::snap_getattr);
+  server.reg(extent_protocol::snap_delete, &ls, &extent_server::snap_delete);
+  server.reg(extent_protocol::scrub, &ls, &extent_server::scrub);
+  server.reg(extent_protocol::read_range, &ls, &extent_server::read_range);
+  server.reg(extent_protocol::write_range, &ls, &extent_server::write_range);
+  server.reg(extent_protocol::truncate, &ls, &extent_server::truncate);
+  server.reg(extent_protocol::fallocate, &ls, &extent_server::fallocate);
+  server.reg(extent_protocol::sync, &ls, &extent_server::sync);
 
   while(1)
     sleep(1000);
@@ -155,6 +155,35 @@ fuseserver_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
     }
 }
 
+#if FUSE_VERSION >= 29
+//
+// Allocate the blocks of @length bytes from @offset in file @ino, so
+// that writing them later cannot run out of space. The file grows to
+// cover the range if it is shorter.
+//
+// Only the default @mode is supported; keeping the size and punching
+// holes are not.
+//
+void
+fuseserver_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
+        off_t offset, off_t length, struct fuse_file_info *fi)
+{
+    if (mode != 0) {
+        fuse_reply_err(req, EOPNOTSUPP);
+        return;
+    }
+    if (offset < 0 || length <= 0) {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+    if (yfs->fallocate(ino, offset, length) == yfs_client::OK) {
+        fuse_reply_err(req, 0);
+    } else {
+        fuse_reply_err(req, ENOSPC);
+    }
+}
+#endif
+
 //
 // Read up to @size bytes starting at byte offset @off in file @ino.
 //
@@ -543,6 +572,9 @@ main(int argc, char *argv[])
     fuseserver_oper.read       = fuseserver_read;
     fuseserver_oper.write      = fuseserver_write;
     fuseserver_oper.setattr    = fuseserver_setattr;
+#if FUSE_VERSION >= 29
+    fuseserver_oper.fallocate  = fuseserver_fallocate;
+#endif
     fuseserver_oper.unlink     = fuseserver_unlink;
     fuseserver_oper.mkdir      = fuseserver_mkdir;
     fuseserver_oper.readlink   = fuseserver_readlink;
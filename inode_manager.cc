@@ -1,410 +1,4594 @@
 #include "inode_manager.h"
 #include "time.h" 
 #include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <aio.h>
+#include <sched.h>
+#include <errno.h>
+#include <vector>
+#include <algorithm>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define MIN(a,b) ((a)<(b) ? (a) : (b))
+#define MAX(a,b) ((a)>(b) ? (a) : (b))
+
+// Bytes of zeros written at a time to the blocks a file grows by.
+#define ZERO_CHUNK (256*1024)
+// Bytes of delayed file data copied out to a write at a time.
+#define DELAY_CHUNK (256*1024)
 
 // disk layer -----------------------------------------
 
-disk::disk()
+// With an image path the file is grown (sparsely) to the disk size and
+// mapped shared, so writes land in the file and a restart sees them.
+// Without one, an anonymous mapping gives zero-filled pages on demand.
+mmap_disk::mmap_disk(const char *image, uint32_t bsize, blockid_t nblocks)
+  : disk(bsize, nblocks)
+{
+  size_t size = (size_t)bsize * nblocks;
+  void *p;
+
+  fd = -1;
+  if (image != NULL && image[0] != '\0') {
+    struct stat st;
+    fd = open(image, O_RDWR | O_CREAT, 0644);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+      printf("\tdisk: error! cannot open image %s\n", image);
+      exit(0);
+    }
+    if ((size_t)st.st_size < size && ftruncate(fd, size) < 0) {
+      printf("\tdisk: error! cannot resize image %s\n", image);
+      exit(0);
+    }
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  } else {
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  }
+  if (p == MAP_FAILED) {
+    printf("\tdisk: error! mmap failed\n");
+    exit(0);
+  }
+  blocks = (unsigned char *)p;
+}
+
+mmap_disk::~mmap_disk()
 {
-  bzero(blocks, sizeof(blocks));
+  flush();
+  munmap(blocks, (size_t)bsize * nblocks);
+  if (fd >= 0)
+    close(fd);
 }
 
+// Force written blocks out to the image file.
 void
-disk::read_block(blockid_t id, char *buf)
+mmap_disk::flush()
 {
-  memcpy(buf, blocks[id], BLOCK_SIZE);
+  if (fd >= 0)
+    msync(blocks, (size_t)bsize * nblocks, MS_SYNC);
 }
 
 void
-disk::write_block(blockid_t id, const char *buf)
+mmap_disk::read_block(blockid_t id, char *buf)
 {
-  memcpy(blocks[id], buf, BLOCK_SIZE);
+  memcpy(buf, blocks + (size_t)id * bsize, bsize);
 }
 
-// block layer -----------------------------------------
+void
+mmap_disk::write_block(blockid_t id, const char *buf)
+{
+  memcpy(blocks + (size_t)id * bsize, buf, bsize);
+}
 
-// Allocate a free disk block.
-blockid_t
-block_manager::alloc_block()
+void
+mmap_disk::readv_blocks(blockid_t start, const struct iovec *iov, int iovcnt)
 {
-  /*
-   * your code goes here.
-   * note: you should mark the corresponding bit in block bitmap when alloc.
-   * you need to think about which block you can start to be allocated.
-   */
-  uint reserve_block_num = (sb.nblocks)/BPB + 2 + INODE_NUM*IPB;
-  char bitblock[BLOCK_SIZE];
-  for(int i=0; i<BLOCK_NUM/BPB; i++){
-    read_block(i+2,bitblock);
-    for(int j=0; j<BLOCK_SIZE; j++){
-      if(bitblock[j] != -1){
-        int offset = 0;
-        uint temp = (uint)bitblock[j];
-        //We can't alloc the reserved blocks
-        while(offset<8 && (temp%2!=0 || BPB*i + j*8 + offset < reserve_block_num)){
-          offset++;
-          temp = temp/2;
-        }
-        if(BPB*i + j*8 + offset < reserve_block_num || offset == 8){
-          continue;
-        }
-        //Mark the offset and write back
-        bitblock[j] |= (1<<offset);
-        printf("block offset：%d, j:%d,i:%d,bitblock:%x\n",offset,j,i,bitblock[j]);
-        write_block(2,bitblock);
-        return BPB*i + j*8 + offset;
-      }
-    }
+  unsigned char *p = blocks + (size_t)start * bsize;
+
+  for (int i = 0; i < iovcnt; i++) {
+    memcpy(iov[i].iov_base, p, iov[i].iov_len);
+    p += iov[i].iov_len;
   }
-  return 0;
 }
 
 void
-block_manager::free_block(uint32_t id)
+mmap_disk::writev_blocks(blockid_t start, const struct iovec *iov, int iovcnt)
 {
-  /* 
-   * your code goes here.
-   * note: you should unmark the corresponding bit in the block bitmap when free.
-   */
-  char block[BLOCK_SIZE];
-  read_block(BBLOCK(id),block);
-  int index = (id % BPB)/8;
-  int offset = (id % BPB)%8;
-  block[index] &= ~((char)(1<<offset));
-  write_block(BBLOCK(id),block);
-  return;
+  unsigned char *p = blocks + (size_t)start * bsize;
+
+  for (int i = 0; i < iovcnt; i++) {
+    memcpy(p, iov[i].iov_base, iov[i].iov_len);
+    p += iov[i].iov_len;
+  }
 }
 
-// The layout of disk should be like this:
-// |<-sb->|<-free block bitmap->|<-inode table->|<-data->|
-block_manager::block_manager()
+void
+disk::readv_blocks(blockid_t start, const struct iovec *iov, int iovcnt)
+{
+  for (int i = 0; i < iovcnt; i++) {
+    for (size_t off = 0; off < iov[i].iov_len; off += bsize)
+      read_block(start++, (char *)iov[i].iov_base + off);
+  }
+}
+
+void
+disk::writev_blocks(blockid_t start, const struct iovec *iov, int iovcnt)
+{
+  for (int i = 0; i < iovcnt; i++) {
+    for (size_t off = 0; off < iov[i].iov_len; off += bsize)
+      write_block(start++, (const char *)iov[i].iov_base + off);
+  }
+}
+
+int
+disk::submit_read(blockid_t id, char *buf)
+{
+  read_block(id, buf);
+  return 0;
+}
+
+int
+disk::submit_write(blockid_t id, const char *buf)
+{
+  write_block(id, buf);
+  return 0;
+}
+
+int
+disk::submit_readv(blockid_t start, const struct iovec *iov, int iovcnt)
+{
+  readv_blocks(start, iov, iovcnt);
+  return 0;
+}
+
+int
+disk::submit_writev(blockid_t start, const struct iovec *iov, int iovcnt)
+{
+  writev_blocks(start, iov, iovcnt);
+  return 0;
+}
+
+sparse_disk::sparse_disk(uint32_t bsize, blockid_t nblocks)
+  : disk(bsize, nblocks)
+{
+  uint64_t nchunks = ((uint64_t)bsize * nblocks + CHUNK_SIZE - 1) / CHUNK_SIZE;
+
+  ndir = (nchunks + L2_ENTRIES - 1) / L2_ENTRIES;
+  dir = (char ***)calloc(ndir, sizeof(char **));
+  pthread_mutex_init(&lock, NULL);
+}
+
+sparse_disk::~sparse_disk()
 {
-  d = new disk();
+  for (uint32_t i = 0; i < ndir; i++) {
+    if (dir[i] == NULL)
+      continue;
+    for (int j = 0; j < L2_ENTRIES; j++)
+      free(dir[i][j]);
+    free(dir[i]);
+  }
+  free(dir);
+  pthread_mutex_destroy(&lock);
+}
 
-  // format the disk
-  sb.size = BLOCK_SIZE * BLOCK_NUM;
-  sb.nblocks = BLOCK_NUM;
-  sb.ninodes = INODE_NUM;
+// Memory of block id, materializing its chunk if alloc is set.
+// Returns NULL for a block that was never written. Called with lock
+// held.
+char *
+sparse_disk::chunk(blockid_t id, bool alloc)
+{
+  uint64_t off = (uint64_t)id * bsize;
+  uint64_t c = off / CHUNK_SIZE;
+  char **l2 = dir[c / L2_ENTRIES];
 
+  if (l2 == NULL) {
+    if (!alloc)
+      return NULL;
+    l2 = dir[c / L2_ENTRIES] = (char **)calloc(L2_ENTRIES, sizeof(char *));
+  }
+  if (l2[c % L2_ENTRIES] == NULL) {
+    if (!alloc)
+      return NULL;
+    l2[c % L2_ENTRIES] = (char *)calloc(1, CHUNK_SIZE);
+  }
+  return l2[c % L2_ENTRIES] + off % CHUNK_SIZE;
 }
 
 void
-block_manager::read_block(uint32_t id, char *buf)
+sparse_disk::read_block(blockid_t id, char *buf)
 {
-  d->read_block(id, buf);
+  ScopedLock ml(&lock);
+  char *p = chunk(id, false);
+
+  if (p == NULL)
+    memset(buf, 0, bsize);
+  else
+    memcpy(buf, p, bsize);
 }
 
+// Writing zeros over a block that was never written changes nothing.
 void
-block_manager::write_block(uint32_t id, const char *buf)
+sparse_disk::write_block(blockid_t id, const char *buf)
 {
-  d->write_block(id, buf);
+  ScopedLock ml(&lock);
+  char *p = chunk(id, false);
+
+  if (p == NULL) {
+    uint32_t i = 0;
+    while (i < bsize && buf[i] == 0)
+      i++;
+    if (i == bsize)
+      return;
+    p = chunk(id, true);
+  }
+  memcpy(p, buf, bsize);
 }
 
-// inode layer -----------------------------------------
+struct aio_disk::aio_slot {
+  struct aiocb cb;
+  int tag;          // 0 when the slot is idle
+};
 
-inode_manager::inode_manager()
+aio_disk::aio_disk(const char *image, uint32_t bsize, blockid_t nblocks,
+                   int depth)
+  : disk(bsize, nblocks)
 {
-  bm = new block_manager();
-  uint32_t root_dir = alloc_inode(extent_protocol::T_DIR);
-  if (root_dir != 1) {
-    printf("\tim: error! alloc first inode %d, should be 1\n", root_dir);
+  off_t size = (off_t)bsize * nblocks;
+  struct stat st;
+
+  if (image == NULL || image[0] == '\0') {
+    printf("\tdisk: error! aio backend needs %s\n", DISK_IMAGE_ENV);
+    exit(0);
+  }
+  fd = open(image, O_RDWR | O_CREAT, 0644);
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    printf("\tdisk: error! cannot open image %s\n", image);
+    exit(0);
+  }
+  // a loop or block device already has its size
+  if (S_ISREG(st.st_mode) && st.st_size < size
+      && ftruncate(fd, size) < 0) {
+    printf("\tdisk: error! cannot resize image %s\n", image);
     exit(0);
   }
+
+  qdepth = depth > 0 ? depth : 1;
+  slots = new aio_slot[qdepth];
+  for (int i = 0; i < qdepth; i++)
+    slots[i].tag = 0;
+  next_tag = 1;
+  pthread_mutex_init(&lock, NULL);
 }
 
-/* Create a new file.
- * Return its inum. */
-uint32_t
-inode_manager::alloc_inode(uint32_t type)
+aio_disk::~aio_disk()
 {
-  /* 
-   * your code goes here.
-   * note: the normal inode block should begin from the 2nd inode block.
-   * the 1st is used for root_dir, see inode_manager::inode_manager().
-   */
-  time_t rawtime;
-  struct inode* inode;
-  uint32_t num = 1;
-  //Find free inode number
-  for(; num<INODE_NUM; num++){
-    inode = get_inode(num);
-    if(inode == NULL){
-      break;
-    }
-    free(inode);
+  flush();
+  delete[] slots;
+  close(fd);
+  pthread_mutex_destroy(&lock);
+}
+
+// Wait for the request in slot s and free the slot. The helpers up to
+// submit are called with lock held.
+void
+aio_disk::reap(struct aio_slot *s)
+{
+  const struct aiocb *list[1] = { &s->cb };
+
+  while (aio_error(&s->cb) == EINPROGRESS)
+    aio_suspend(list, 1, NULL);
+  if (aio_return(&s->cb) != (ssize_t)s->cb.aio_nbytes) {
+    printf("\tdisk: error! async i/o at offset %lld failed\n",
+           (long long)s->cb.aio_offset);
   }
-  //If there is no residual inode.
-  if(num == INODE_NUM){
-    printf("\tim: error! There is no inode left!\n");
-    exit(0);
+  s->tag = 0;
+}
+
+// Find an idle slot, completing the oldest request if the queue is full.
+struct aio_disk::aio_slot *
+aio_disk::get_slot()
+{
+  struct aio_slot *oldest = NULL;
+
+  for (int i = 0; i < qdepth; i++) {
+    if (slots[i].tag == 0)
+      return &slots[i];
+    if (oldest == NULL || slots[i].tag < oldest->tag)
+      oldest = &slots[i];
   }
-  inode = (struct inode*)malloc(sizeof(struct inode));
-  inode->size = 0;
-  inode->type = type;
-  inode->ctime = time(&rawtime);
-  inode->mtime = time(&rawtime);
-  inode->atime = time(&rawtime);
-  put_inode(num,inode);
-  return num;
+  reap(oldest);
+  return oldest;
 }
 
 void
-inode_manager::free_inode(uint32_t inum)
+aio_disk::drain_locked()
 {
-  /* 
-   * your code goes here.
-   * note: you need to check if the inode is already a freed one;
-   * if not, clear it, and remember to write back to disk.
-   */
-  struct inode* old_inode = get_inode(inum);
-  if(old_inode == NULL){
-    printf("\tThis block has been freed.\n");
-    return;
+  for (int i = 0; i < qdepth; i++) {
+    if (slots[i].tag != 0)
+      reap(&slots[i]);
   }
-  struct inode* blank_inode = (struct inode*)malloc(sizeof(struct inode));
-  blank_inode->size = 0;
-  blank_inode->type = 0;
-  put_inode(inum,blank_inode);
-  free(old_inode);
-  free(blank_inode);
-  return;
 }
 
+// Synchronous I/O drains first so it is ordered after any request
+// still in flight on the same block.
+void
+aio_disk::sync_io(blockid_t start, const struct iovec *iov, int iovcnt,
+                  bool write)
+{
+  ssize_t len = 0;
+  ssize_t r;
 
-/* Return an inode structure by inum, NULL otherwise.
- * Caller should release the memory. */
-struct inode* 
-inode_manager::get_inode(uint32_t inum)
+  drain_locked();
+  for (int i = 0; i < iovcnt; i++)
+    len += iov[i].iov_len;
+  if (write)
+    r = pwritev(fd, iov, iovcnt, (off_t)start * bsize);
+  else
+    r = preadv(fd, iov, iovcnt, (off_t)start * bsize);
+  if (r != len)
+    printf("\tdisk: error! %s of blocks at %u failed\n",
+           write ? "write" : "read", start);
+}
+
+int
+aio_disk::submit(blockid_t start, const struct iovec *iov, int iovcnt,
+                 bool write)
 {
-  struct inode *ino, *ino_disk;
-  char buf[BLOCK_SIZE];
+  ScopedLock ml(&lock);
+  struct aio_slot *s;
+  int r;
 
-  printf("\tim: get_inode %d\n", inum);
+  if (iovcnt != 1) {
+    sync_io(start, iov, iovcnt, write);
+    return 0;
+  }
 
-  if (inum <= 0 || inum > INODE_NUM) {                                    //modified
-    printf("\tim: inum out of range\n");
-    return NULL;
+  s = get_slot();
+  memset(&s->cb, 0, sizeof(s->cb));
+  s->cb.aio_fildes = fd;
+  s->cb.aio_offset = (off_t)start * bsize;
+  s->cb.aio_buf = iov[0].iov_base;
+  s->cb.aio_nbytes = iov[0].iov_len;
+  r = write ? aio_write(&s->cb) : aio_read(&s->cb);
+  if (r < 0) {
+    // out of aio resources: do it synchronously instead
+    sync_io(start, iov, iovcnt, write);
+    return 0;
   }
+  if (next_tag == 0x7fffffff) {
+    drain_locked();
+    next_tag = 1;
+  }
+  s->tag = next_tag++;
+  return s->tag;
+}
 
-  bm->read_block(IBLOCK(inum, bm->sb.nblocks), buf);
-  // printf("%s:%d\n", __FILE__, __LINE__);
+int
+aio_disk::submit_read(blockid_t id, char *buf)
+{
+  struct iovec iov = { buf, bsize };
+  return submit(id, &iov, 1, false);
+}
 
-  ino_disk = (struct inode*)buf + inum%IPB;
-  if (ino_disk->type == 0) {
-    printf("\tim: inode not exist\n");
-    return NULL;
-  }
+int
+aio_disk::submit_write(blockid_t id, const char *buf)
+{
+  struct iovec iov = { (char *)buf, bsize };
+  return submit(id, &iov, 1, true);
+}
 
-  ino = (struct inode*)malloc(sizeof(struct inode));
-  *ino = *ino_disk;
+int
+aio_disk::submit_readv(blockid_t start, const struct iovec *iov, int iovcnt)
+{
+  return submit(start, iov, iovcnt, false);
+}
 
-  return ino;
+int
+aio_disk::submit_writev(blockid_t start, const struct iovec *iov, int iovcnt)
+{
+  return submit(start, iov, iovcnt, true);
 }
 
 void
-inode_manager::put_inode(uint32_t inum, struct inode *ino)
+aio_disk::wait(int tag)
 {
-  char buf[BLOCK_SIZE];
-  struct inode *ino_disk;
+  ScopedLock ml(&lock);
 
-  printf("\tim: put_inode %d\n", inum);
-  if (ino == NULL)
+  if (tag <= 0)
     return;
+  for (int i = 0; i < qdepth; i++) {
+    if (slots[i].tag == tag) {
+      reap(&slots[i]);
+      return;
+    }
+  }
+}
 
-  bm->read_block(IBLOCK(inum, bm->sb.nblocks), buf);
-  ino_disk = (struct inode*)buf + inum%IPB;
-  *ino_disk = *ino;
-  bm->write_block(IBLOCK(inum, bm->sb.nblocks), buf);
+void
+aio_disk::drain()
+{
+  ScopedLock ml(&lock);
+  drain_locked();
 }
 
-#define MIN(a,b) ((a)<(b) ? (a) : (b))
+void
+aio_disk::read_block(blockid_t id, char *buf)
+{
+  ScopedLock ml(&lock);
+  struct iovec iov = { buf, bsize };
+  sync_io(id, &iov, 1, false);
+}
 
-/* Get all the data of a file by inum. 
- * Return alloced data, should be freed by caller. */
 void
-inode_manager::read_file(uint32_t inum, char **buf_out, int *size)
+aio_disk::write_block(blockid_t id, const char *buf)
 {
-  /*
-   * your code goes here.
-   * note: read blocks related to inode number inum,
-   * and copy them to buf_Out
-   */
-  time_t rawtime;
-  struct inode* inode = get_inode(inum);
-  if(inode == NULL) return;
-  uint node_size = inode->size;
-  if(node_size == 0) return;
-  *size = node_size;
-  uint block_num = node_size%BLOCK_SIZE==0?(node_size/BLOCK_SIZE):(node_size/BLOCK_SIZE+1);
-  //buf_out = (char**)malloc(block_num);
-  uint max_index = MIN(NDIRECT,block_num); 
+  ScopedLock ml(&lock);
+  struct iovec iov = { (char *)buf, bsize };
+  sync_io(id, &iov, 1, true);
+}
+
+void
+aio_disk::readv_blocks(blockid_t start, const struct iovec *iov, int iovcnt)
+{
+  ScopedLock ml(&lock);
+  sync_io(start, iov, iovcnt, false);
+}
+
+void
+aio_disk::writev_blocks(blockid_t start, const struct iovec *iov, int iovcnt)
+{
+  ScopedLock ml(&lock);
+  sync_io(start, iov, iovcnt, true);
+}
 
-  char* block_data = (char*)malloc(block_num*BLOCK_SIZE);
-  //Read direct block data
-  for(int i=0; i<max_index; i++){
-    blockid_t block_id = inode->blocks[i];
-    bm->read_block(block_id,(block_data+i*BLOCK_SIZE));
+void
+aio_disk::flush()
+{
+  ScopedLock ml(&lock);
+  drain_locked();
+  fsync(fd);
+}
+
+// block layer -----------------------------------------
+
+// First word at or after i that is not all ones, or n. SSE2 lets
+// full stretches of the bitmap go by four words at a time.
+static size_t
+skip_full_words(const uint64_t *w, size_t i, size_t n)
+{
+#ifdef __SSE2__
+  const __m128i ones = _mm_set1_epi32(-1);
+  for (; i + 4 <= n; i += 4) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(w + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(w + i + 2));
+    __m128i full = _mm_and_si128(_mm_cmpeq_epi32(a, ones),
+                                 _mm_cmpeq_epi32(b, ones));
+    if (_mm_movemask_epi8(full) != 0xffff)
+      break;
   }
+#endif
+  while (i < n && w[i] == ~0ULL)
+    i++;
+  return i;
+}
+
+// Each thread sticks to one group, handed out round robin.
+uint32_t
+block_manager::my_group()
+{
+  static uint32_t next_group = 0;
+  static __thread int group = -1;
+
+  if (group < 0)
+    group = __sync_fetch_and_add(&next_group, 1);
+  return group % groups.size();
+}
+
+// Allocate a free block of g, or return 0. Caller holds g->lock.
+// The search starts at the group's hint, so allocation is O(1)
+// amortized rather than a rescan from the group start on every call.
+blockid_t
+block_manager::group_alloc_block(alloc_group *g)
+{
+  size_t first = g->start / 64, nwords = (g->end - g->start + 63) / 64;
+  size_t start = (g->hint - g->start) / 64;
 
-  //Read indirect block data
-  if(max_index != block_num){
-    char inblock[BLOCK_SIZE];
-    bm->read_block(inode->blocks[NDIRECT],inblock);
-    for(int i=0; i<(block_num - max_index); i++){
-      blockid_t block_id = ((blockid_t*)inblock)[i];
-      char* inblock_data = (char*)malloc(BLOCK_SIZE);
-      bm->read_block(block_id,(block_data+(i+max_index)*BLOCK_SIZE));
+  if (g->nfree == 0)
+    return 0;
+  for (size_t n = 0; n < nwords; ) {
+    size_t w = (start + n) % nwords;
+    size_t next = skip_full_words(&used[first], w, nwords);
+    if (next != w) {
+      n += next - w;
+      continue;
     }
+    int bit = __builtin_ctzll(~used[first + w]);
+    blockid_t id = (first + w) * 64 + bit;
+    set_bitmap_run(id, 1, true);
+    take_free_extent(g, id, 1);
+    g->hint = id + 1 < g->end ? id + 1 : g->start;
+    return id;
   }
-  *buf_out = block_data;
-  printf("\tread result:%s,size = %d;\n",(block_data+8*BLOCK_SIZE),node_size);
-  //Update inode metadata
-  inode->atime = time(&rawtime);
-  put_inode(inum, inode);
-  free(inode);
-  return;
+  return 0;
 }
 
-/* alloc/free blocks if needed */
-void
-inode_manager::write_file(uint32_t inum, const char *buf, int size)
+// Allocate a free disk block.
+blockid_t
+block_manager::alloc_block()
 {
   /*
    * your code goes here.
-   * note: write buf to blocks of inode inum.
-   * you need to consider the situation when the size of buf 
-   * is larger or smaller than the size of original inode
+   * note: you should mark the corresponding bit in block bitmap when alloc.
+   * you need to think about which block you can start to be allocated.
    */
-  printf("\tinode_manager-write_file:%d\n",size);
-  time_t rawtime;
-  struct inode* inode = get_inode(inum);
-  if(inode == NULL) return;
-  uint old_num = inode->size%BLOCK_SIZE==0?(inode->size/BLOCK_SIZE):(inode->size/BLOCK_SIZE+1);
-  uint new_num = size%BLOCK_SIZE==0?(size/BLOCK_SIZE):(size/BLOCK_SIZE+1);
-  if(old_num > new_num){
-    int i=0;
-    if(old_num > NDIRECT && new_num > NDIRECT){
-      for(; i<NDIRECT; i++){
-        bm->write_block(inode->blocks[i],(buf+i*BLOCK_SIZE));
-      }
-      char inblock[BLOCK_SIZE];
-      bm->read_block(inode->blocks[NINDIRECT],inblock);
-      for(i=0; i<(new_num-NDIRECT); i++){
-        blockid_t block_id = ((blockid_t*)inblock)[i];
-        bm->write_block(block_id,(buf+(i+NDIRECT)*BLOCK_SIZE));
-      }
-      for(; i<(old_num-NDIRECT); i++){
-        blockid_t block_id = ((blockid_t*)inblock)[i];
-        bm->free_block(block_id);
-      }
-    }else if(old_num > NDIRECT && new_num <= NDIRECT){
-      for(; i<new_num; i++){
-        bm->write_block(inode->blocks[i],(buf+i*BLOCK_SIZE));
-      }
-      for(; i<NDIRECT; i++){
-        bm->free_block(inode->blocks[i]);
-      }
-      char inblock[BLOCK_SIZE];
-      bm->read_block(inode->blocks[NINDIRECT],inblock);
-      for(i=0; i<(old_num-NDIRECT); i++){
-        blockid_t block_id = ((blockid_t*)inblock)[i];
-        bm->free_block(block_id);
-      }
-    }else{// node_size/BLOCK_SIZE <= NDIRECT
-      for(; i<new_num; i++){
-        bm->write_block(inode->blocks[i],(buf+i*BLOCK_SIZE));
-      }
-      for(; i<old_num; i++){
-        bm->free_block(inode->blocks[i]);
-      }
-    }
-  }else if(old_num < new_num){
-    int i = 0;
-    if(new_num > NDIRECT && old_num > NDIRECT){
-      for(; i<NDIRECT; i++){
-        bm->write_block(inode->blocks[i],(buf+i*BLOCK_SIZE));
-      }
-      char inblock[BLOCK_SIZE];
-      bm->read_block(inode->blocks[NDIRECT],inblock);
-      for(; i<old_num; i++){
-        bm->write_block(((uint*)inblock)[i-NDIRECT],(buf+i*BLOCK_SIZE));
-      }
-      for(; i<new_num; i++){
-        ((uint*)inblock)[i-NDIRECT] = bm->alloc_block();
-        bm->write_block(((uint*)inblock)[i-NDIRECT],(buf+i*BLOCK_SIZE));
-      }
-      bm->write_block(inode->blocks[NDIRECT],inblock);
-    }else if(new_num > NDIRECT && old_num <= NDIRECT){
-      for(; i<old_num; i++){
-        bm->write_block(inode->blocks[i],(buf+i*BLOCK_SIZE));
-      }
-      for(; i<NDIRECT; i++){
-        inode->blocks[i] = bm->alloc_block();
-        bm->write_block(inode->blocks[i],(buf+i*BLOCK_SIZE));
-      }
-      inode->blocks[NDIRECT] = bm->alloc_block();
-      char inblock[BLOCK_SIZE];
-      bm->read_block(inode->blocks[NDIRECT],inblock);
-      for(; i<new_num; i++){
-        ((uint*)inblock)[i-NDIRECT] = bm->alloc_block();
-        bm->write_block(((uint*)inblock)[i-NDIRECT],(buf+i*BLOCK_SIZE));
-      }
-      bm->write_block(inode->blocks[NDIRECT],inblock);
-    }else{// size/BLOCK_SIZE < NDIRECT
-      for(; i<old_num; i++){
-        bm->write_block(inode->blocks[i],(buf+i*BLOCK_SIZE));
-      }
-      for(; i<new_num; i++){
-        inode->blocks[i] = bm->alloc_block();
-        bm->write_block(inode->blocks[i],(buf+i*BLOCK_SIZE));
-        char new_data[BLOCK_SIZE];
-        bm->read_block(inode->blocks[i],new_data);
-        printf("\tnew_data:%s\n",new_data);
-      }
-    }
-  }else{ //node_size/BLOCK_SIZE == size/BLOCK_SIZE
-    int i = 0;
-    if(old_num > NDIRECT){
-      for(; i<NDIRECT; i++){
-        bm->write_block(inode->blocks[i],(buf+i*BLOCK_SIZE));
-      }
-      char inblock[BLOCK_SIZE];
-      bm->read_block(inode->blocks[NDIRECT],inblock);
-      for(; i<old_num; i++){
-        bm->write_block(((uint*)inblock)[i-NDIRECT],(buf+i*BLOCK_SIZE));
-      }
-    }else{
-      for(; i<old_num; i++){
-        bm->write_block(inode->blocks[i],(buf+i*BLOCK_SIZE));
-      }
+  uint32_t mine = my_group();
+
+  // a full disk first takes back the blocks whose frees are pending
+  if (!take_spare(1)) {
+    printf("\tbm: error! no free block left\n");
+    return 0;
+  }
+  // as in alloc_blocks, a pass may miss the block
+  for (int pass = 0; pass < 16; pass++) {
+    if (pass > 0)
+      sched_yield();
+    for (uint32_t i = 0; i < groups.size(); i++) {
+      alloc_group *g = groups[(mine + i) % groups.size()];
+      ScopedLock ml(&g->lock);
+      blockid_t id = group_alloc_block(g);
+      if (id != 0)
+        return id;
     }
   }
-  //Update inode metadata
-  inode->size = size;
-  inode->mtime = time(&rawtime);
-  inode->atime = time(&rawtime);
-  inode->ctime = time(&rawtime);
-  put_inode(inum,inode);
-  free(inode);
-  return;
+  unreserve_blocks(1);
+  printf("\tbm: error! free block count is off by 1\n");
+  return 0;
 }
 
 void
-inode_manager::getattr(uint32_t inum, extent_protocol::attr &a)
+block_manager::free_block(uint32_t id)
 {
-  /*
+  /* 
    * your code goes here.
-   * note: get the attributes of inode inum.
-   * you can refer to "struct attr" in extent_protocol.h
+   * note: you should unmark the corresponding bit in the block bitmap when free.
    */
-  struct inode* inode = get_inode(inum);
-  if(inode!=NULL){
-    a.type = inode->type;
-    a.size = inode->size;
-    a.ctime = inode->ctime;
-    a.mtime = inode->mtime;
-    a.atime = inode->atime;
-    free(inode);
+  if (id < sb.data_start || id >= sb.nblocks)
+    return;
+  alloc_group *g = group_of(id);
+  ScopedLock ml(&g->lock);
+  if (!(used[id / 64] & (1ULL << (id % 64)))) {
+    printf("\tbm: error! freeing free block %u\n", id);
+    return;
+  }
+  set_bitmap_run(id, 1, false);
+  if (sb.log_slots != 0) {
+    ScopedLock pl(&pending_lock);
+    block_run_t r = { id, 1 };
+    pending_frees.push_back(r);
+    return;
+  }
+  add_free_extent(g, id, 1);
+  if (id < g->hint)
+    g->hint = id;
+  return;
+}
+
+bool
+block_manager::in_use(blockid_t id)
+{
+  if (id >= sb.nblocks)
+    return false;
+  alloc_group *g = group_of(id);
+  ScopedLock ml(&g->lock);
+  return (used[id / 64] & (1ULL << (id % 64))) != 0;
+}
+
+void
+block_manager::set_used(blockid_t id)
+{
+  if (id < sb.data_start || id >= sb.nblocks)
+    return;
+  alloc_group *g = group_of(id);
+  ScopedLock ml(&g->lock);
+  if (!(used[id / 64] & (1ULL << (id % 64)))) {
+    // the block was never free: spare goes short if it was promised
+    take_free_extent(g, id, 1);
+    __sync_fetch_and_sub(&spare, 1);
+  }
+  set_bitmap_run(id, 1, true);
+}
+
+// Take up to n blocks from g, appending them to runs; return how many.
+// Caller holds g->lock.
+uint32_t
+block_manager::group_alloc_blocks(alloc_group *g, uint32_t n, blockid_t goal,
+                                  std::vector<block_run_t> &runs)
+{
+  std::map<blockid_t, uint32_t>::iterator it;
+  uint32_t left = n;
+
+  while (left > 0 && g->nfree > 0) {
+    blockid_t start;
+    uint32_t len;
+
+    it = g->free_by_start.upper_bound(goal);
+    if (goal >= g->start && goal < g->end && it != g->free_by_start.begin()
+        && (--it)->first + it->second > goal) {
+      // extend in place from the goal
+      start = goal;
+      len = MIN(left, it->first + it->second - goal);
+    } else {
+      std::set<std::pair<uint32_t, blockid_t> >::iterator f;
+      f = g->free_by_size.lower_bound(std::make_pair(left, (blockid_t)0));
+      if (f == g->free_by_size.end())
+        --f;
+      start = f->second;
+      len = MIN(left, f->first);
+    }
+
+    take_free_extent(g, start, len);
+    set_bitmap_run(start, len, true);
+    if (!runs.empty() && runs.back().start + runs.back().len == start) {
+      runs.back().len += len;
+    } else {
+      block_run_t r = { start, len };
+      runs.push_back(r);
+    }
+    left -= len;
+    goal = start + len;
+  }
+  return n - left;
+}
+
+// Blocks taken out of spare, by the caller or ahead of time, are in
+// the groups' free extents. A pass over the groups can still miss
+// them, if they were freed into a group already passed while another
+// thread took those it was counting on, so the passes go on while
+// they find any.
+bool
+block_manager::alloc_blocks(uint32_t n, std::vector<block_run_t> &runs,
+                            blockid_t goal, bool reserved)
+{
+  size_t first_run = runs.size();
+  uint32_t ngroups = groups.size();
+  uint32_t mine = my_group();
+  uint32_t left = n;
+
+  if (!reserved && !take_spare(n))
+    return false;
+  if (goal < sb.data_start || goal >= sb.nblocks)
+    goal = 0;
+  // spare promises the blocks exist, but threads freeing and taking
+  // blocks behind us can keep them out of the groups we look at, so go
+  // round again a few times before giving up
+  for (int idle = 0; left > 0 && idle < 16; ) {
+    uint32_t before = left;
+    for (int i = -1; left > 0 && i < (int)ngroups; i++) {
+      // the goal's group first, then ours, then the others
+      alloc_group *g;
+      if (i < 0) {
+        if (goal == 0)
+          continue;
+        g = group_of(goal);
+      } else {
+        g = groups[(mine + i) % ngroups];
+        if (goal != 0 && g == group_of(goal))
+          continue;
+      }
+      ScopedLock ml(&g->lock);
+      left -= group_alloc_blocks(g, left, goal, runs);
+    }
+    if (left < before) {
+      idle = 0;
+    } else {
+      idle++;
+      sched_yield();
+    }
+  }
+  if (left == 0)
+    return true;
+  // spare was wrong: give back what we took
+  printf("\tbm: error! free block count is off by %u\n", left);
+  for (size_t r = first_run; r < runs.size(); r++)
+    free_blocks(runs[r].start, runs[r].len);
+  runs.resize(first_run);
+  return false;
+}
+
+void
+block_manager::free_blocks(blockid_t start, uint32_t len)
+{
+  blockid_t end = start + len;
+
+  if (start < sb.data_start || end > sb.nblocks || end < start)
+    return;
+  while (start < end) {
+    alloc_group *g = group_of(start);
+    uint32_t n = MIN(end, g->end) - start;
+    ScopedLock ml(&g->lock);
+    set_bitmap_run(start, n, false);
+    if (sb.log_slots != 0) {
+      ScopedLock pl(&pending_lock);
+      block_run_t r = { start, n };
+      pending_frees.push_back(r);
+    } else {
+      add_free_extent(g, start, n);
+      if (start < g->hint)
+        g->hint = start;
+    }
+    start += n;
+  }
+}
+
+// Take n blocks out of spare, first handing back the blocks whose
+// frees are pending if there are too few.
+bool
+block_manager::take_spare(uint64_t n)
+{
+  for (int pass = 0; pass < 2; pass++) {
+    int64_t s = __atomic_load_n(&spare, __ATOMIC_RELAXED);
+    while (s >= (int64_t)n) {
+      if (__sync_bool_compare_and_swap(&spare, s, s - (int64_t)n))
+        return true;
+      s = __atomic_load_n(&spare, __ATOMIC_RELAXED);
+    }
+    if (pass > 0 || !release_frees(false))
+      break;
+  }
+  return false;
+}
+
+bool
+block_manager::reserve_blocks(uint64_t n)
+{
+  return n == 0 || take_spare(n);
+}
+
+void
+block_manager::unreserve_blocks(uint64_t n)
+{
+  __sync_fetch_and_add(&spare, (int64_t)n);
+}
+
+// Set or clear the bits of a run, in memory and on disk, pinning each
+// bitmap block once. With a journal a freed block stays in use in
+// memory until release_frees. Caller holds the lock of every group
+// involved.
+void
+block_manager::set_bitmap_run(blockid_t start, uint32_t len, bool inuse)
+{
+  blockid_t b = start, end = start + len;
+
+  while (b < end) {
+    blockid_t bnum = BBLOCK(b, sb);
+    char *block = get_block_rw(bnum);
+    for (; b < end && BBLOCK(b, sb) == bnum; b++) {
+      int index = (b % BPB(sb))/8;
+      int offset = (b % BPB(sb))%8;
+      if (inuse) {
+        block[index] |= (char)(1<<offset);
+        used[b / 64] |= 1ULL << (b % 64);
+      } else {
+        block[index] &= ~((char)(1<<offset));
+        if (sb.log_slots == 0)
+          used[b / 64] &= ~(1ULL << (b % 64));
+      }
+    }
+    mark_dirty(bnum);
+    put_block(bnum);
+  }
+}
+
+// Add [start, start+len) to the free extent index of g, merging it
+// with the free extents on either side.
+void
+block_manager::add_free_extent(alloc_group *g, blockid_t start, uint32_t len)
+{
+  std::map<blockid_t, uint32_t>::iterator next, prev;
+
+  g->nfree += len;
+  __sync_fetch_and_add(&spare, (int64_t)len);
+  next = g->free_by_start.lower_bound(start);
+  if (next != g->free_by_start.end() && start + len == next->first) {
+    len += next->second;
+    g->free_by_size.erase(std::make_pair(next->second, next->first));
+    g->free_by_start.erase(next++);
+  }
+  if (next != g->free_by_start.begin()) {
+    prev = next;
+    --prev;
+    if (prev->first + prev->second == start) {
+      g->free_by_size.erase(std::make_pair(prev->second, prev->first));
+      start = prev->first;
+      len += prev->second;
+      g->free_by_start.erase(prev);
+    }
+  }
+  g->free_by_start[start] = len;
+  g->free_by_size.insert(std::make_pair(len, start));
+}
+
+// Remove [start, start+len), which lies inside one free extent of g,
+// from the index, keeping whatever is left on either side. The caller
+// has taken the blocks out of spare.
+void
+block_manager::take_free_extent(alloc_group *g, blockid_t start, uint32_t len)
+{
+  std::map<blockid_t, uint32_t>::iterator it = g->free_by_start.upper_bound(start);
+  blockid_t fstart;
+  uint32_t flen;
+
+  if (it == g->free_by_start.begin()) {
+    printf("\tbm: error! block %u not in a free extent\n", start);
+    return;
+  }
+  --it;
+  fstart = it->first;
+  flen = it->second;
+  if (start + len > fstart + flen) {
+    printf("\tbm: error! block %u not in a free extent\n", start);
+    return;
+  }
+  g->nfree -= len;
+  g->free_by_size.erase(std::make_pair(flen, fstart));
+  g->free_by_start.erase(it);
+  if (start > fstart) {
+    g->free_by_start[fstart] = start - fstart;
+    g->free_by_size.insert(std::make_pair(start - fstart, fstart));
+  }
+  if (start + len < fstart + flen) {
+    uint32_t rest = fstart + flen - (start + len);
+    g->free_by_start[start + len] = rest;
+    g->free_by_size.insert(std::make_pair(rest, start + len));
+  }
+}
+
+// Set the bits that the on-disk bitmap leaves clear but that are never
+// free: the metadata before data_start and the tail past nblocks.
+void
+block_manager::mark_reserved(std::vector<uint64_t> &bits)
+{
+  for (blockid_t b = 0; b < sb.data_start; b++)
+    bits[b / 64] |= 1ULL << (b % 64);
+  for (size_t b = sb.nblocks; b < bits.size() * 64; b++)
+    bits[b / 64] |= 1ULL << (b % 64);
+}
+
+// Build the in-memory bitmap from the bitmap blocks, and the groups'
+// free extents from it. Bit b of a bitmap byte is block 8*byte+b,
+// which is the same bit of a 64-bit word on a little-endian host, so
+// each block copies straight in.
+void
+block_manager::load_bitmap()
+{
+  size_t nwords = (sb.nblocks + 63) / 64;
+  size_t bytes = nwords * 8;
+  char *p;
+
+  used.assign(nwords, 0);
+  p = (char *)&used[0];
+  for (blockid_t b = sb.bmap_start; b < sb.imap_start; b++) {
+    size_t off = (size_t)(b - sb.bmap_start) * sb.block_size;
+    const char *block = get_block(b);
+    memcpy(p + off, block, MIN((size_t)sb.block_size, bytes - off));
+    put_block(b);
+  }
+  mark_reserved(used);
+  load_snapshots();
+
+  for (blockid_t start = 0; start < sb.nblocks; start += BPB(sb)) {
+    alloc_group *g = new alloc_group;
+    pthread_mutex_init(&g->lock, NULL);
+    g->start = start;
+    g->end = MIN((uint64_t)start + BPB(sb), (uint64_t)sb.nblocks);
+    g->hint = g->start;
+    g->nfree = 0;
+    groups.push_back(g);
+  }
+
+  // index the runs of clear bits, splitting them at group boundaries
+  size_t w = 0;
+  blockid_t run = 0, len = 0;
+  while (w < nwords) {
+    if (len > 0 && (w * 64) % BPB(sb) == 0) {
+      add_free_extent(group_of(run), run, len);
+      len = 0;
+    }
+    if (used[w] == ~0ULL || used[w] == 0) {
+      // a whole word either ends or extends the current run
+      if (used[w] == 0) {
+        if (len == 0)
+          run = w * 64;
+        len += 64;
+      } else if (len > 0) {
+        add_free_extent(group_of(run), run, len);
+        len = 0;
+      }
+      w++;
+      continue;
+    }
+    for (int bit = 0; bit < 64; bit++) {
+      if (!(used[w] & (1ULL << bit))) {
+        if (len == 0)
+          run = w * 64 + bit;
+        len++;
+      } else if (len > 0) {
+        add_free_extent(group_of(run), run, len);
+        len = 0;
+      }
+    }
+    w++;
+  }
+  if (len > 0)
+    add_free_extent(group_of(run), run, len);
+}
+
+// A size from the environment, with an optional K/M/G suffix.
+static uint64_t
+env_size(const char *name, uint64_t dflt)
+{
+  const char *v = getenv(name);
+  char *end;
+  uint64_t n;
+
+  if (v == NULL || v[0] == '\0')
+    return dflt;
+  n = strtoull(v, &end, 0);
+  switch (*end) {
+  case 'G': case 'g': n <<= 10;  // fall through
+  case 'M': case 'm': n <<= 10;  // fall through
+  case 'K': case 'k': n <<= 10;
+  }
+  return n;
+}
+
+// Read the superblock of an existing image, before any disk is set up.
+static bool
+probe_superblock(const char *image, superblock_t *sb)
+{
+  int fd;
+  bool ok;
+
+  if (image == NULL || image[0] == '\0')
+    return false;
+  fd = open(image, O_RDONLY);
+  if (fd < 0)
+    return false;
+  ok = pread(fd, sb, sizeof(*sb), 0) == (ssize_t)sizeof(*sb)
+    && sb->magic == FS_MAGIC
+    && sb->block_size >= MIN_BLOCK_SIZE && sb->block_size <= MAX_BLOCK_SIZE
+    && (1U << sb->block_shift) == sb->block_size
+    && sb->data_start < sb->nblocks;
+  close(fd);
+  return ok;
+}
+
+// Lay out a disk of the given geometry:
+// |<-sb->|<-free block bitmap->|<-inode bitmap->|<-inode table->|<-log->|<-data->|
+static bool
+layout_superblock(superblock_t *sb, uint64_t disk_size, uint32_t block_size,
+                  uint32_t ninodes, uint32_t log_slots)
+{
+  uint32_t shift = 0;
+
+  while ((1U << shift) < block_size)
+    shift++;
+  if ((1U << shift) != block_size || block_size < MIN_BLOCK_SIZE
+      || block_size > MAX_BLOCK_SIZE) {
+    printf("\tbm: error! block size %u is not a power of two in [%d, %d]\n",
+           block_size, MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+    return false;
+  }
+  if ((disk_size >> shift) > 0xffffffffULL) {
+    printf("\tbm: error! disk too large for %u-byte blocks\n", block_size);
+    return false;
+  }
+
+  bzero(sb, sizeof(*sb));
+  sb->magic = FS_MAGIC;
+  sb->block_size = block_size;
+  sb->block_shift = shift;
+  sb->nblocks = disk_size >> shift;
+  sb->ninodes = ninodes;
+  sb->size = (uint64_t)sb->nblocks << shift;
+  sb->bmap_start = 1;
+  sb->imap_start = sb->bmap_start + (sb->nblocks + BPB(*sb) - 1) / BPB(*sb);
+  // inodes are numbered from 1 up to and including ninodes
+  sb->inode_start = IMBLOCK(ninodes, *sb) + 1;
+  sb->log_start = IBLOCK(ninodes, *sb) + 1;
+  sb->log_slots = log_slots;
+  sb->data_start = sb->log_start;
+  if (log_slots > 0)
+    sb->data_start += LOG_HDR_BLOCKS(*sb) + log_slots;
+  if (ninodes < 2 || sb->data_start >= sb->nblocks) {
+    printf("\tbm: error! disk of %llu bytes cannot hold %u inodes\n",
+           (unsigned long long)disk_size, ninodes);
+    return false;
+  }
+  return true;
+}
+
+// The layout must be the one layout_superblock gives the same
+// geometry: anything else was not written by this code. The
+// allocation hint is only a hint, and is not checked.
+bool
+check_superblock(const superblock_t &sb)
+{
+  superblock_t want;
+
+  if (sb.magic != FS_MAGIC) {
+    printf("\tbm: error! bad magic %#x\n", sb.magic);
+    return false;
+  }
+  if (!layout_superblock(&want, sb.size, sb.block_size, sb.ninodes,
+                         sb.log_slots))
+    return false;
+  if (sb.block_shift != want.block_shift || sb.nblocks != want.nblocks
+      || sb.bmap_start != want.bmap_start
+      || sb.imap_start != want.imap_start
+      || sb.inode_start != want.inode_start
+      || sb.log_start != want.log_start || sb.data_start != want.data_start) {
+    printf("\tbm: error! superblock layout does not match its geometry\n");
+    return false;
+  }
+  if (sb.snap_dir != 0
+      && (sb.snap_dir < sb.data_start || sb.snap_dir >= sb.nblocks)) {
+    printf("\tbm: error! snapshot directory %u out of range\n", sb.snap_dir);
+    return false;
+  }
+  return true;
+}
+
+// State shared by both constructors.
+void
+block_manager::setup()
+{
+  pthread_mutex_init(&cache_lock, NULL);
+  spare = 0;
+  cache_size = env_size(CACHE_BLOCKS_ENV, CACHE_BLOCKS);
+  if (cache_size == 0)
+    cache_size = 1;
+  hand = 0;
+  hits = misses = 0;
+  bzero(streams, sizeof(streams));
+  ra_clock = 0;
+  pthread_mutex_init(&log_lock, NULL);
+  pthread_cond_init(&log_cond, NULL);
+  pthread_mutex_init(&pending_lock, NULL);
+  outstanding = 0;
+  reserved = 0;
+  committing = false;
+  pthread_mutex_init(&snap_lock, NULL);
+  nsnaps = 0;
+  snap_next = 1;
+  readonly = false;
+  wb_hook = NULL;
+  wb_arg = NULL;
+}
+
+// An image that already holds a filesystem is reused with the geometry
+// in its superblock; a new or empty one is formatted with the geometry
+// from the environment (or the defaults). Anything else is refused
+// rather than formatted over.
+block_manager::block_manager()
+{
+  const char *image = getenv(DISK_IMAGE_ENV);
+  const char *backend = getenv(DISK_BACKEND_ENV);
+  const char *qdepth = getenv(DISK_QDEPTH_ENV);
+  struct stat st;
+  setup();
+  if (backend != NULL && strcmp(backend, "sparse") == 0)
+    image = NULL;
+  // a new image reads back as zeros, an old one may hold stale metadata
+  bool zeroed = image == NULL || image[0] == '\0'
+    || stat(image, &st) < 0 || st.st_size == 0;
+
+  formatted = !probe_superblock(image, &sb);
+  if (formatted && !zeroed) {
+    printf("\tbm: error! %s holds no filesystem this version recognizes;"
+           " check it with yfs_fsck\n", image);
+    exit(0);
+  }
+  if (formatted) {
+    uint64_t disk_size = env_size(DISK_SIZE_ENV, DEFAULT_DISK_SIZE);
+    uint64_t block_size = env_size(BLOCK_SIZE_ENV, DEFAULT_BLOCK_SIZE);
+    // unless told otherwise the journal takes a 64th of the disk
+    uint64_t log_blocks = block_size == 0 ? 0
+      : MIN((uint64_t)DEFAULT_LOG_BLOCKS, disk_size / block_size / 64);
+    if (!layout_superblock(&sb, disk_size, block_size,
+                           env_size(INODE_NUM_ENV, DEFAULT_INODE_NUM),
+                           env_size(LOG_BLOCKS_ENV, log_blocks)))
+      exit(0);
+  }
+
+  if (backend != NULL && strcmp(backend, "aio") == 0)
+    d = new aio_disk(image, sb.block_size, sb.nblocks,
+                     qdepth != NULL ? atoi(qdepth) : DISK_QDEPTH);
+  else if (backend != NULL && strcmp(backend, "sparse") == 0)
+    d = new sparse_disk(sb.block_size, sb.nblocks);
+  else
+    d = new mmap_disk(image, sb.block_size, sb.nblocks);
+  if (formatted) {
+    // format the disk: only the metadata needs clearing; data blocks
+    // are never read before being allocated and written
+    std::vector<char> buf(sb.block_size, 0);
+    for (blockid_t b = 1; !zeroed && b < sb.data_start; b++)
+      d->write_block(b, &buf[0]);
+    memcpy(&buf[0], &sb, sizeof(sb));
+    d->write_block(0, &buf[0]);
+  } else {
+    replay_log();
+  }
+  load_bitmap();
+}
+
+// Nothing is ever written back, so there is no writeback thread.
+block_manager::block_manager(disk *dev)
+{
+  std::vector<char> buf(MAX_BLOCK_SIZE);
+
+  setup();
+  d = dev;
+  d->read_block(0, &buf[0]);
+  memcpy(&sb, &buf[0], sizeof(sb));
+  formatted = false;
+  readonly = true;
+  load_bitmap();
+}
+
+// For a read-only view only, which has no write-back thread.
+block_manager::~block_manager()
+{
+  for (size_t f = 0; f < frames.size(); f++)
+    free(frames[f].data);
+  for (size_t g = 0; g < groups.size(); g++) {
+    pthread_mutex_destroy(&groups[g]->lock);
+    delete groups[g];
+  }
+  for (size_t k = 0; k < snaps.size(); k++)
+    delete snaps[k];
+  delete d;
+  pthread_mutex_destroy(&cache_lock);
+  pthread_mutex_destroy(&log_lock);
+  pthread_cond_destroy(&log_cond);
+  pthread_mutex_destroy(&pending_lock);
+  pthread_mutex_destroy(&snap_lock);
+}
+
+// Every WRITEBACK_INTERVAL seconds the running transaction commits
+// and the other dirty cached blocks are written back; the log is
+// checkpointed once it is half full.
+void *
+block_manager::writeback_thread(void *arg)
+{
+  block_manager *bm = (block_manager *)arg;
+
+  while (true) {
+    sleep(WRITEBACK_INTERVAL);
+    if (bm->wb_hook != NULL)
+      bm->wb_hook(bm->wb_arg);
+    bm->writeback(false);
+  }
+  return NULL;
+}
+
+void
+block_manager::start_writeback(void (*hook)(void *), void *arg)
+{
+  pthread_t th;
+
+  wb_hook = hook;
+  wb_arg = arg;
+  pthread_create(&th, NULL, writeback_thread, this);
+  pthread_detach(th);
+}
+
+void
+block_manager::flush()
+{
+  writeback(true);
+}
+
+// Commit the journal, and checkpoint it if asked to or if it is half
+// full; then write back the superblock, which carries the allocation
+// hint, and every other dirty cached block, and flush the device.
+void
+block_manager::writeback(bool checkpoint)
+{
+  if (readonly)
+    return;
+  if (sb.log_slots != 0) {
+    ScopedLock ll(&log_lock);
+    while (committing)
+      pthread_cond_wait(&log_cond, &log_lock);
+    committing = true;
+    while (outstanding > 0)
+      pthread_cond_wait(&log_cond, &log_lock);
+    commit_locked();
+    if (checkpoint || log_index.size() > sb.log_slots / 2)
+      checkpoint_locked();
+    committing = false;
+    pthread_cond_broadcast(&log_cond);
+  }
+  write_back_frames();
+}
+
+// Write back the superblock and every dirty cached block outside the
+// journal, and flush the device.
+void
+block_manager::write_back_frames()
+{
+  char *block = get_block_rw(0);
+  memcpy(block, &sb, sizeof(sb));
+  mark_dirty(0);
+  put_block(0);
+
+  ScopedLock ml(&cache_lock);
+  std::vector<std::pair<blockid_t, uint32_t> > dirty;
+  for (uint32_t f = 0; f < frames.size(); f++) {
+    if (frames[f].dirty && !frames[f].logged)
+      dirty.push_back(std::make_pair(frames[f].id, f));
+  }
+  write_frames(dirty);
+  d->flush();
+}
+
+// Write the given (block, frame) pairs home in block order, so that
+// neighbouring blocks go out as one request. Called with cache_lock
+// held.
+void
+block_manager::write_frames(std::vector<std::pair<blockid_t, uint32_t> > &dirty)
+{
+  std::vector<struct iovec> run;
+
+  std::sort(dirty.begin(), dirty.end());
+  for (size_t i = 0; i < dirty.size(); ) {
+    size_t j = i;
+    run.clear();
+    do {
+      struct frame &fr = frames[dirty[j].second];
+      struct iovec v = { fr.data, sb.block_size };
+      run.push_back(v);
+      fr.dirty = false;
+      j++;
+    } while (j < dirty.size() && dirty[j].first == dirty[j-1].first + 1);
+    d->submit_writev(dirty[i].first, &run[0], run.size());
+    i = j;
+  }
+  d->drain();
+}
+
+// journal ---------------------------------------------
+
+// Depth of the operations the calling thread is inside, and the log
+// space the outermost one reserved.
+static __thread int op_depth = 0;
+static __thread uint32_t op_blocks = 0;
+
+// Install the committed transactions a crash left in the log, in log
+// order so that the last copy of a block wins, then empty the log.
+void
+block_manager::replay_log()
+{
+  uint32_t hdr_blocks = LOG_HDR_BLOCKS(sb);
+  std::vector<char> hdr((size_t)hdr_blocks << sb.block_shift);
+  std::vector<char> buf(sb.block_size, 0);
+  uint32_t *h = (uint32_t *)&hdr[0];
+
+  if (sb.log_slots == 0)
+    return;
+  for (uint32_t b = 0; b < hdr_blocks; b++)
+    d->read_block(sb.log_start + b, &hdr[(size_t)b << sb.block_shift]);
+  if (h[0] == 0)
+    return;
+  if (h[0] > sb.log_slots) {
+    printf("\tbm: error! log header claims %u blocks\n", h[0]);
+    return;
+  }
+  printf("\tbm: replaying %u logged blocks\n", h[0]);
+  for (uint32_t i = 0; i < h[0]; i++) {
+    if (h[1 + i] < sb.bmap_start || h[1 + i] >= sb.nblocks) {
+      printf("\tbm: error! logged block %u out of range\n", h[1 + i]);
+      continue;
+    }
+    d->read_block(LOG_SLOT(i, sb), &buf[0]);
+    d->write_block(h[1 + i], &buf[0]);
+  }
+  d->flush();
+  bzero(&buf[0], sb.block_size);
+  d->write_block(sb.log_start, &buf[0]);
+  d->flush();
+}
+
+// Whether the log has room for an operation dirtying n more blocks,
+// counting committed blocks, the running transaction and what the
+// running operations reserved. Called with log_lock held.
+bool
+block_manager::log_fits(uint32_t n)
+{
+  ScopedLock ml(&cache_lock);
+  return log_index.size() + txn.size() + reserved + n <= sb.log_slots;
+}
+
+void
+block_manager::begin_op(uint32_t n)
+{
+  if (op_depth++ > 0)
+    return;
+  n = MIN(n, sb.log_slots);
+  ScopedLock ll(&log_lock);
+  while (committing || !log_fits(n)) {
+    if (committing || outstanding > 0) {
+      pthread_cond_wait(&log_cond, &log_lock);
+      continue;
+    }
+    // out of log space with nothing running: commit what is pending
+    // and, if that is not enough, empty the log
+    commit_locked();
+    if (!log_fits(n))
+      checkpoint_locked();
+  }
+  outstanding++;
+  reserved += n;
+  op_blocks = n;
+}
+
+// The transaction is not committed here: it keeps absorbing the
+// operations that follow until the next writeback, flush, or an
+// operation that finds the log full.
+void
+block_manager::end_op()
+{
+  if (--op_depth > 0)
+    return;
+  ScopedLock ll(&log_lock);
+  outstanding--;
+  reserved -= op_blocks;
+  pthread_cond_broadcast(&log_cond);
+}
+
+void
+block_manager::quiesce()
+{
+  ScopedLock ll(&log_lock);
+  while (committing)
+    pthread_cond_wait(&log_cond, &log_lock);
+  committing = true;
+  while (outstanding > 0)
+    pthread_cond_wait(&log_cond, &log_lock);
+}
+
+void
+block_manager::resume()
+{
+  ScopedLock ll(&log_lock);
+  committing = false;
+  pthread_cond_broadcast(&log_cond);
+}
+
+// A block dirtied inside an operation joins the running transaction
+// and stays pinned until checkpointed. Called with cache_lock held.
+void
+block_manager::log_frame(struct frame &fr)
+{
+  if (sb.log_slots == 0 || op_depth == 0)
+    return;
+  if (!fr.logged) {
+    fr.logged = true;
+    fr.refs++;
+  }
+  txn.insert(fr.id);
+}
+
+// Append the running transaction to the log. The slots and the tail
+// of the header go first; the header block holding the count is only
+// written after they are on disk, which is the commit point. Called
+// with log_lock held and no operation running.
+void
+block_manager::commit_locked()
+{
+  uint32_t hdr_blocks = LOG_HDR_BLOCKS(sb);
+  std::vector<struct iovec> slots;
+  std::vector<char> hdr((size_t)hdr_blocks << sb.block_shift, 0);
+  uint32_t *h = (uint32_t *)&hdr[0];
+  bool overflow;
+
+  {
+    ScopedLock ml(&cache_lock);
+    if (txn.empty())
+      return;
+    overflow = log_index.size() + txn.size() > sb.log_slots;
+    if (!overflow) {
+      size_t first = log_index.size();
+      for (std::set<blockid_t>::iterator it = txn.begin(); it != txn.end(); ++it) {
+        struct frame &fr = frames[cached[*it]];
+        struct iovec v = { fr.data, sb.block_size };
+        slots.push_back(v);
+        log_index.push_back(*it);
+      }
+      txn.clear();
+      d->submit_writev(LOG_SLOT(first, sb), &slots[0], slots.size());
+
+      h[0] = log_index.size();
+      memcpy(h + 1, &log_index[0], log_index.size() * sizeof(blockid_t));
+      if (hdr_blocks > 1) {
+        struct iovec v = { &hdr[sb.block_size],
+                           (size_t)(hdr_blocks - 1) << sb.block_shift };
+        d->submit_writev(sb.log_start + 1, &v, 1);
+      }
+      d->drain();
+    }
+  }
+  if (overflow) {
+    // an operation dirtied more than it reserved: install everything
+    // in place, without the journal's atomicity
+    printf("\tbm: error! transaction overflows the log\n");
+    checkpoint_locked();
+    return;
+  }
+  d->flush();
+  d->write_block(sb.log_start, &hdr[0]);
+  d->flush();
+  release_frees(false);
+}
+
+// Write every logged block home, then empty the log and hand the
+// blocks freed by the checkpointed transactions back to the
+// allocator. Called with log_lock held, no operation running and the
+// running transaction empty.
+void
+block_manager::checkpoint_locked()
+{
+  if (!log_index.empty() || !txn.empty()) {
+    std::vector<std::pair<blockid_t, uint32_t> > home;
+    ScopedLock ml(&cache_lock);
+    for (uint32_t f = 0; f < frames.size(); f++) {
+      if (frames[f].logged && frames[f].dirty)
+        home.push_back(std::make_pair(frames[f].id, f));
+    }
+    write_frames(home);
+    for (uint32_t f = 0; f < frames.size(); f++) {
+      if (frames[f].logged) {
+        frames[f].logged = false;
+        frames[f].refs--;
+      }
+    }
+    txn.clear();
+    log_index.clear();
+    d->flush();
+    std::vector<char> buf(sb.block_size, 0);
+    d->write_block(sb.log_start, &buf[0]);
+    d->flush();
+  }
+  release_frees(true);
+}
+
+// Return freed blocks to the allocator. Without all, blocks with a
+// copy in the log stay pending until the checkpoint; the others are
+// safe once their free is committed, and are also handed out early
+// when the disk is otherwise full. Returns whether any were released.
+bool
+block_manager::release_frees(bool all)
+{
+  std::vector<block_run_t> runs;
+  {
+    ScopedLock pl(&pending_lock);
+    ScopedLock ml(&cache_lock);
+    std::vector<block_run_t> keep;
+    for (size_t r = 0; r < pending_frees.size(); r++) {
+      blockid_t b = pending_frees[r].start;
+      blockid_t end = b + pending_frees[r].len;
+      while (b < end) {
+        std::map<blockid_t, uint32_t>::iterator it = cached.find(b);
+        bool logged = !all && it != cached.end() && frames[it->second].logged;
+        block_run_t seg = { b, 0 };
+        do {
+          seg.len++;
+          b++;
+          it = cached.find(b);
+        } while (b < end && logged == (!all && it != cached.end()
+                                       && frames[it->second].logged));
+        if (logged)
+          keep.push_back(seg);
+        else
+          runs.push_back(seg);
+      }
+    }
+    pending_frees.swap(keep);
+  }
+  for (size_t r = 0; r < runs.size(); r++)
+    return_blocks(runs[r].start, runs[r].len);
+  return !runs.empty();
+}
+
+// Hand [start, start+len) back to the allocator: clear the blocks in
+// the in-memory bitmap and add them to their groups' free extents.
+// The bitmap on disk already has them free.
+void
+block_manager::return_blocks(blockid_t start, uint32_t len)
+{
+  blockid_t end = start + len;
+
+  while (start < end) {
+    alloc_group *g = group_of(start);
+    uint32_t n = MIN(end, g->end) - start;
+    ScopedLock ml(&g->lock);
+    for (blockid_t b = start; b < start + n; b++)
+      used[b / 64] &= ~(1ULL << (b % 64));
+    add_free_extent(g, start, n);
+    if (start < g->hint)
+      g->hint = start;
+    start += n;
+  }
+}
+
+// snapshots -------------------------------------------
+
+// Copy out the blocks of ids that a snapshot still shares with the
+// live filesystem, before they change. The newest snapshot that had
+// the block in use takes the copy, unless a newer one already holds
+// one; older snapshots find it there. The copies and their table
+// entries are on disk before the caller goes on. Called with no lock
+// held; the superblock, block bitmap and log never get here.
+void
+block_manager::cow(const blockid_t *ids, uint32_t n)
+{
+  std::vector<blockid_t> todo;
+  std::vector<char> buf;
+
+  if (nsnaps == 0)
+    return;
+  for (uint32_t i = 0; i < n; i++) {
+    if (ids[i] >= sb.imap_start
+        && (ids[i] < sb.log_start || ids[i] >= sb.data_start))
+      todo.push_back(ids[i]);
+  }
+  if (todo.empty())
+    return;
+
+  ScopedLock sl(&snap_lock);
+  bool copied = false;
+  for (size_t i = 0; i < todo.size(); i++) {
+    blockid_t b = todo[i];
+    for (int k = snaps.size() - 1; k >= 0; k--) {
+      snap *s = snaps[k];
+      if (s->copies.count(b))
+        break;
+      if (!(s->used[b / 64] & (1ULL << (b % 64))))
+        continue;
+      blockid_t c = claim_blocks(1);
+      if (c == 0) {
+        printf("\tbm: error! no space to keep block %u for snapshot %u\n",
+               b, s->id);
+        break;
+      }
+      buf.resize(sb.block_size);
+      d->read_block(b, &buf[0]);
+      d->write_block(c, &buf[0]);
+      snap_record(s, b, c);
+      copied = true;
+      break;
+    }
+  }
+  if (!copied)
+    return;
+  for (size_t k = 0; k < snaps.size(); k++) {
+    if (snaps[k]->tail_dirty) {
+      d->write_block(snaps[k]->tail, &snaps[k]->tail_buf[0]);
+      snaps[k]->tail_dirty = false;
+    }
+  }
+  d->flush();
+}
+
+// Add (home, copy) to the tables of s. A table block holds the next
+// block of the chain, a count and the pairs; a new tail is written
+// before the old one points at it. Called with snap_lock held.
+void
+block_manager::snap_record(snap *s, blockid_t home, blockid_t copy)
+{
+  uint32_t *t = (uint32_t *)&s->tail_buf[0];
+  uint32_t cap = (sb.block_size - 8) / 8;
+
+  s->copies[home] = copy;
+  if (t[1] == cap) {
+    blockid_t next = claim_blocks(1);
+    if (next == 0) {
+      printf("\tbm: error! no space for the tables of snapshot %u\n", s->id);
+      return;
+    }
+    std::vector<char> empty(sb.block_size, 0);
+    d->write_block(next, &empty[0]);
+    t[0] = next;
+    d->write_block(s->tail, &s->tail_buf[0]);
+    s->tail = next;
+    memset(&s->tail_buf[0], 0, sb.block_size);
+  }
+  t[2 + 2 * t[1]] = home;
+  t[3 + 2 * t[1]] = copy;
+  t[1]++;
+  s->tail_dirty = true;
+}
+
+// The snapshot directory: a count, then id, creation time, bitmap copy
+// and first table block of each snapshot, and past room for
+// MAX_SNAPSHOTS of them the id the next one gets, so that an id is
+// never reused. Called with snap_lock held.
+void
+block_manager::write_snap_dir()
+{
+  std::vector<char> buf(sb.block_size, 0);
+  uint32_t *p = (uint32_t *)&buf[0];
+
+  p[0] = snaps.size();
+  for (size_t k = 0; k < snaps.size(); k++) {
+    p[1 + 4 * k] = snaps[k]->id;
+    p[2 + 4 * k] = snaps[k]->ctime;
+    p[3 + 4 * k] = snaps[k]->bmap;
+    p[4 + 4 * k] = snaps[k]->table;
+  }
+  p[1 + 4 * MAX_SNAPSHOTS] = snap_next;
+  d->write_block(sb.snap_dir, &buf[0]);
+}
+
+// Read the snapshots back at mount, marking every block they own in
+// use. Called from load_bitmap before the free extents are indexed.
+void
+block_manager::load_snapshots()
+{
+  uint32_t nbmap = sb.imap_start - sb.bmap_start;
+  std::vector<char> dir(sb.block_size), buf(sb.block_size);
+  uint32_t *p = (uint32_t *)&dir[0];
+  uint32_t *t = (uint32_t *)&buf[0];
+
+  if (sb.snap_dir == 0)
+    return;
+  d->read_block(sb.snap_dir, &dir[0]);
+  used[sb.snap_dir / 64] |= 1ULL << (sb.snap_dir % 64);
+  for (uint32_t k = 0; k < p[0] && k < MAX_SNAPSHOTS; k++) {
+    snap *s = new snap;
+    s->id = p[1 + 4 * k];
+    s->ctime = p[2 + 4 * k];
+    s->bmap = p[3 + 4 * k];
+    s->table = p[4 + 4 * k];
+    s->tail_dirty = false;
+    s->used.assign(used.size(), 0);
+    for (uint32_t i = 0; i < nbmap; i++) {
+      size_t off = (size_t)i << sb.block_shift;
+      d->read_block(s->bmap + i, &buf[0]);
+      memcpy((char *)&s->used[0] + off, &buf[0],
+             MIN((size_t)sb.block_size, s->used.size() * 8 - off));
+      used[(s->bmap + i) / 64] |= 1ULL << ((s->bmap + i) % 64);
+    }
+    mark_reserved(s->used);
+    for (blockid_t b = s->table; b != 0; b = t[0]) {
+      d->read_block(b, &buf[0]);
+      used[b / 64] |= 1ULL << (b % 64);
+      for (uint32_t j = 0; j < t[1]; j++) {
+        s->copies[t[2 + 2 * j]] = t[3 + 2 * j];
+        used[t[3 + 2 * j] / 64] |= 1ULL << (t[3 + 2 * j] % 64);
+      }
+      s->tail = b;
+      s->tail_buf = buf;
+    }
+    snaps.push_back(s);
+  }
+  nsnaps = snaps.size();
+  snap_next = MAX(p[1 + 4 * MAX_SNAPSHOTS],
+                  snaps.empty() ? 1 : snaps.back()->id + 1);
+}
+
+// Take n contiguous blocks for a snapshot: free in the live
+// filesystem and in every snapshot, since they are written without
+// being copied out. They are marked in use in memory only: the
+// snapshot's tables are their record on disk. Returns 0 if fewer
+// than n blocks are free beside those reserved, or no group has such
+// a run. Called with snap_lock held.
+blockid_t
+block_manager::claim_blocks(uint32_t n)
+{
+  uint32_t mine = my_group();
+
+  if (!take_spare(n))
+    return 0;
+  for (int pass = 0; pass < 16; pass++) {
+    if (pass > 0)
+      sched_yield();
+    for (uint32_t i = 0; i < groups.size(); i++) {
+      alloc_group *g = groups[(mine + i) % groups.size()];
+      blockid_t start = 0;
+      uint32_t len = 0;
+      if (g->nfree < n)
+        continue;
+      {
+        ScopedLock ml(&g->lock);
+        std::map<blockid_t, uint32_t>::iterator it;
+        for (it = g->free_by_start.begin();
+             len < n && it != g->free_by_start.end(); ++it) {
+          len = 0;
+          for (blockid_t b = it->first; len < n && b < it->first + it->second; b++) {
+            bool shared = false;
+            for (size_t k = 0; k < snaps.size() && !shared; k++)
+              shared = snaps[k]->used[b / 64] & (1ULL << (b % 64));
+            if (shared) {
+              len = 0;
+              continue;
+            }
+            if (len++ == 0)
+              start = b;
+          }
+        }
+        if (len < n)
+          continue;
+        take_free_extent(g, start, n);
+        for (blockid_t b = start; b < start + n; b++)
+          used[b / 64] |= 1ULL << (b % 64);
+      }
+      forget_blocks(start, n);
+      return start;
+    }
+    if (pass > 0 || !release_frees(false))
+      break;
+  }
+  unreserve_blocks(n);
+  return 0;
+}
+
+// Drop whatever the cache holds for blocks that are about to be
+// written behind its back, so a stale frame never lands on them.
+void
+block_manager::forget_blocks(blockid_t start, uint32_t n)
+{
+  ScopedLock ml(&cache_lock);
+  for (blockid_t b = start; b < start + n; b++) {
+    std::map<blockid_t, uint32_t>::iterator it = cached.find(b);
+    if (it == cached.end())
+      continue;
+    settle(frames[it->second]);
+    frames[it->second].dirty = false;
+    frames[it->second].referenced = false;
+    cached.erase(it);
+  }
+}
+
+// Quiesce, commit and checkpoint the journal and write everything
+// back, so the disk holds the whole state; then copy the bitmap,
+// which is all the snapshot needs to know which blocks it shares.
+// The freeze is not O(1): the write-back costs what is dirty, and the
+// bitmap copy a block read and write per 8 * block_size blocks of
+// disk (32 of each for 4 GB of 4K blocks), against the per-block
+// reference counts a constant-time freeze would have to keep up on
+// every allocation.
+int
+block_manager::snapshot()
+{
+  uint32_t nbmap = sb.imap_start - sb.bmap_start;
+  bool new_dir = false;
+  int id = -1;
+
+  if (readonly)
+    return -1;
+  ScopedLock ll(&log_lock);
+  while (committing)
+    pthread_cond_wait(&log_cond, &log_lock);
+  committing = true;
+  while (outstanding > 0)
+    pthread_cond_wait(&log_cond, &log_lock);
+  commit_locked();
+  checkpoint_locked();
+  write_back_frames();
+
+  {
+    ScopedLock sl(&snap_lock);
+    snap *s = new snap;
+    s->bmap = s->table = 0;
+    if (snaps.size() < MAX_SNAPSHOTS) {
+      if (sb.snap_dir == 0 && (sb.snap_dir = claim_blocks(1)) != 0)
+        new_dir = true;
+      if (sb.snap_dir != 0 && (s->bmap = claim_blocks(nbmap)) != 0)
+        s->table = claim_blocks(1);
+    }
+    if (snaps.size() >= MAX_SNAPSHOTS) {
+      printf("\tbm: error! already %d snapshots\n", MAX_SNAPSHOTS);
+    } else if (s->table == 0) {
+      // nothing on disk names the blocks claimed so far
+      printf("\tbm: error! no space for a snapshot\n");
+      if (s->bmap != 0)
+        return_blocks(s->bmap, nbmap);
+      if (new_dir) {
+        return_blocks(sb.snap_dir, 1);
+        sb.snap_dir = 0;
+      }
+    } else {
+      std::vector<char> buf(sb.block_size, 0);
+      s->id = snap_next++;
+      s->ctime = time(NULL);
+      s->tail = s->table;
+      s->tail_buf = buf;
+      s->tail_dirty = false;
+      d->write_block(s->table, &buf[0]);
+      s->used.assign(used.size(), 0);
+      for (uint32_t i = 0; i < nbmap; i++) {
+        size_t off = (size_t)i << sb.block_shift;
+        d->read_block(sb.bmap_start + i, &buf[0]);
+        d->write_block(s->bmap + i, &buf[0]);
+        memcpy((char *)&s->used[0] + off, &buf[0],
+               MIN((size_t)sb.block_size, s->used.size() * 8 - off));
+      }
+      mark_reserved(s->used);
+      snaps.push_back(s);
+      write_snap_dir();
+      d->flush();
+      id = s->id;
+      s = NULL;
+    }
+    delete s;
+    nsnaps = snaps.size();
+  }
+  // the superblock now points at the snapshot directory
+  write_back_frames();
+
+  committing = false;
+  pthread_cond_broadcast(&log_cond);
+  return id;
+}
+
+// Delete snapshot sid. The next older snapshot reads the copies sid
+// holds of blocks it has no copy of itself, since those did not
+// change between the two: they pass to it, and the table blocks that
+// record them are put at the end of its chain. Everything else sid
+// owns is freed once the directory no longer names it. Returns false
+// if there is no such snapshot.
+bool
+block_manager::delete_snapshot(uint32_t sid)
+{
+  uint32_t nbmap = sb.imap_start - sb.bmap_start;
+  std::vector<char> buf(sb.block_size);
+  uint32_t *t = (uint32_t *)&buf[0];
+  std::vector<blockid_t> gone;
+
+  if (readonly)
+    return false;
+  ScopedLock sl(&snap_lock);
+  size_t k = 0;
+  while (k < snaps.size() && snaps[k]->id != sid)
+    k++;
+  if (k == snaps.size())
+    return false;
+  snap *s = snaps[k];
+  snap *older = k > 0 ? snaps[k - 1] : NULL;
+
+  if (s->tail_dirty) {
+    d->write_block(s->tail, &s->tail_buf[0]);
+    s->tail_dirty = false;
+  }
+  for (blockid_t b = s->table, next; b != 0; b = next) {
+    d->read_block(b, &buf[0]);
+    next = t[0];
+    uint32_t m = 0;
+    for (uint32_t j = 0; j < t[1]; j++) {
+      blockid_t home = t[2 + 2 * j], copy = t[3 + 2 * j];
+      if (older == NULL || older->copies.count(home)) {
+        gone.push_back(copy);
+        continue;
+      }
+      older->copies[home] = copy;
+      t[2 + 2 * m] = home;
+      t[3 + 2 * m] = copy;
+      m++;
+    }
+    if (older == NULL) {
+      gone.push_back(b);
+      continue;
+    }
+    t[1] = m;
+    d->write_block(b, &buf[0]);
+  }
+  if (older != NULL) {
+    // buf is the tail of the chain now
+    ((uint32_t *)&older->tail_buf[0])[0] = s->table;
+    d->write_block(older->tail, &older->tail_buf[0]);
+    older->tail = s->tail;
+    older->tail_buf = buf;
+    older->tail_dirty = false;
+  }
+  snaps.erase(snaps.begin() + k);
+  nsnaps = snaps.size();
+  write_snap_dir();
+  d->flush();
+
+  return_blocks(s->bmap, nbmap);
+  std::sort(gone.begin(), gone.end());
+  for (size_t i = 0, j; i < gone.size(); i = j) {
+    for (j = i + 1; j < gone.size() && gone[j] == gone[j - 1] + 1; j++)
+      ;
+    return_blocks(gone[i], j - i);
+  }
+  delete s;
+  return true;
+}
+
+bool
+block_manager::has_snapshot(uint32_t sid)
+{
+  ScopedLock sl(&snap_lock);
+  for (size_t k = 0; k < snaps.size(); k++) {
+    if (snaps[k]->id == sid)
+      return true;
+  }
+  return false;
+}
+
+// A block as snapshot sid sees it: its own copy, or that of a newer
+// snapshot, or else the live block, which has not changed since. The
+// view's superblock has no journal and no snapshots, and its bitmap is
+// the copy taken with the snapshot.
+void
+block_manager::read_snapshot_block(uint32_t sid, blockid_t id, char *buf)
+{
+  ScopedLock sl(&snap_lock);
+  size_t k = 0;
+
+  while (k < snaps.size() && snaps[k]->id != sid)
+    k++;
+  if (k == snaps.size() || id >= sb.nblocks
+      || (id >= sb.log_start && id < sb.data_start)) {
+    memset(buf, 0, sb.block_size);
+    return;
+  }
+  if (id == 0) {
+    superblock_t view = sb;
+    view.log_slots = 0;
+    view.snap_dir = 0;
+    memset(buf, 0, sb.block_size);
+    memcpy(buf, &view, sizeof(view));
+    return;
+  }
+  if (id < sb.imap_start) {
+    d->read_block(snaps[k]->bmap + id - sb.bmap_start, buf);
+    return;
+  }
+  for (; k < snaps.size(); k++) {
+    std::map<blockid_t, blockid_t>::iterator it = snaps[k]->copies.find(id);
+    if (it != snaps[k]->copies.end()) {
+      d->read_block(it->second, buf);
+      return;
+    }
+  }
+  read_block(id, buf);
+}
+
+// The snapshot directory, and each snapshot's bitmap copy, tables and
+// copied-out blocks. None of them are in the bitmap on disk.
+void
+block_manager::snapshot_blocks(std::vector<uint64_t> &bits)
+{
+  ScopedLock sl(&snap_lock);
+  std::vector<char> buf(sb.block_size);
+  uint32_t *t = (uint32_t *)&buf[0];
+
+  if (sb.snap_dir != 0)
+    bits[sb.snap_dir / 64] |= 1ULL << (sb.snap_dir % 64);
+  for (size_t k = 0; k < snaps.size(); k++) {
+    snap *s = snaps[k];
+    for (blockid_t b = s->bmap; b < s->bmap + sb.imap_start - sb.bmap_start; b++)
+      bits[b / 64] |= 1ULL << (b % 64);
+    for (blockid_t b = s->table; b != 0 && b < sb.nblocks; b = t[0]) {
+      bits[b / 64] |= 1ULL << (b % 64);
+      if (b == s->tail)
+        break;
+      d->read_block(b, &buf[0]);
+    }
+    std::map<blockid_t, blockid_t>::iterator it;
+    for (it = s->copies.begin(); it != s->copies.end(); ++it)
+      bits[it->second / 64] |= 1ULL << (it->second % 64);
+  }
+}
+
+// block cache -----------------------------------------
+
+void
+block_manager::cache_stats(uint64_t *h, uint64_t *m)
+{
+  ScopedLock ml(&cache_lock);
+  *h = hits;
+  *m = misses;
+}
+
+// Pick a frame for a new block: a fresh one while the cache is below
+// its bound, else the first unpinned frame the CLOCK hand finds with
+// its reference bit clear. Called with cache_lock held.
+uint32_t
+block_manager::victim()
+{
+  struct frame nf;
+
+  if (frames.size() >= cache_size) {
+    for (uint32_t scanned = 0; scanned < 2 * frames.size(); scanned++) {
+      uint32_t f = hand;
+      struct frame &fr = frames[f];
+      hand = (hand + 1) % frames.size();
+      if (fr.refs > 0)
+        continue;
+      if (fr.referenced) {
+        fr.referenced = false;
+        continue;
+      }
+      settle(fr);
+      if (fr.dirty)
+        d->write_block(fr.id, fr.data);
+      // a forgotten frame no longer owns its block's entry
+      std::map<blockid_t, uint32_t>::iterator it = cached.find(fr.id);
+      if (it != cached.end() && it->second == f)
+        cached.erase(it);
+      return f;
+    }
+  }
+  nf.data = (char *)malloc(sb.block_size);
+  nf.io_tag = 0;
+  nf.logged = false;
+  frames.push_back(nf);
+  return frames.size() - 1;
+}
+
+// Wait for a prefetch into the frame to land.
+void
+block_manager::settle(struct frame &fr)
+{
+  if (fr.io_tag != 0) {
+    d->wait(fr.io_tag);
+    fr.io_tag = 0;
+  }
+}
+
+// Frame holding block id, reading the block in on a miss unless the
+// caller is about to overwrite all of it. Called with cache_lock held.
+uint32_t
+block_manager::lookup(blockid_t id, bool load)
+{
+  std::map<blockid_t, uint32_t>::iterator it = cached.find(id);
+  if (it != cached.end()) {
+    hits++;
+    frames[it->second].referenced = true;
+    settle(frames[it->second]);
+    return it->second;
+  }
+
+  misses++;
+  uint32_t f = victim();
+  struct frame &fr = frames[f];
+  fr.id = id;
+  fr.refs = 0;
+  fr.dirty = false;
+  fr.referenced = true;
+  fr.io_tag = 0;
+  if (load)
+    d->read_block(id, fr.data);
+  cached[id] = f;
+  return f;
+}
+
+void
+block_manager::read_block(uint32_t id, char *buf)
+{
+  ScopedLock ml(&cache_lock);
+  memcpy(buf, frames[lookup(id, true)].data, sb.block_size);
+}
+
+void
+block_manager::write_block(uint32_t id, const char *buf)
+{
+  cow(&id, 1);
+  ScopedLock ml(&cache_lock);
+  struct frame &fr = frames[lookup(id, false)];
+  memcpy(fr.data, buf, sb.block_size);
+  fr.dirty = true;
+  log_frame(fr);
+}
+
+char *
+block_manager::pin_block(blockid_t id)
+{
+  ScopedLock ml(&cache_lock);
+  struct frame &fr = frames[lookup(id, true)];
+  fr.refs++;
+  return fr.data;
+}
+
+const char *
+block_manager::get_block(uint32_t id)
+{
+  return pin_block(id);
+}
+
+char *
+block_manager::get_block_rw(uint32_t id)
+{
+  cow(&id, 1);
+  return pin_block(id);
+}
+
+void
+block_manager::mark_dirty(uint32_t id)
+{
+  ScopedLock ml(&cache_lock);
+  std::map<blockid_t, uint32_t>::iterator it = cached.find(id);
+  if (it != cached.end()) {
+    frames[it->second].dirty = true;
+    log_frame(frames[it->second]);
+  }
+}
+
+void
+block_manager::put_block(uint32_t id)
+{
+  ScopedLock ml(&cache_lock);
+  std::map<blockid_t, uint32_t>::iterator it = cached.find(id);
+  if (it == cached.end() || frames[it->second].refs == 0) {
+    printf("\tbm: error! put_block %u not pinned\n", id);
+    return;
+  }
+  frames[it->second].refs--;
+}
+
+// Split ids into runs of consecutive blocks and hand each run, with
+// the slice of iov that covers it, to the disk as one request. All
+// runs are in flight before the first is waited on. A cached block is
+// a run of its own that is copied to or from its frame instead.
+// Returns the number of blocks found in the cache.
+uint32_t
+block_manager::rw_blocks(const blockid_t *ids, uint32_t n,
+                         const struct iovec *iov, int iovcnt, bool write)
+{
+  std::vector<struct iovec> run;
+  int k = 0;          // current iovec
+  size_t off = 0;     // bytes of iov[k] already used
+  uint32_t i = 0;
+  uint32_t found = 0;
+
+  if (write)
+    cow(ids, n);
+  ScopedLock ml(&cache_lock);
+  while (i < n) {
+    std::map<blockid_t, uint32_t>::iterator it = cached.find(ids[i]);
+    uint32_t j = i + 1;
+    while (it == cached.end() && j < n && ids[j] == ids[j-1] + 1
+           && cached.find(ids[j]) == cached.end())
+      j++;
+
+    size_t left = (size_t)(j - i) << sb.block_shift;
+    run.clear();
+    while (left > 0 && k < iovcnt) {
+      size_t len = MIN(left, iov[k].iov_len - off);
+      struct iovec v = { (char *)iov[k].iov_base + off, len };
+      run.push_back(v);
+      left -= len;
+      off += len;
+      if (off == iov[k].iov_len) {
+        k++;
+        off = 0;
+      }
+    }
+    if (it != cached.end()) {
+      struct frame &fr = frames[it->second];
+      size_t pos = 0;
+      hits++;
+      found++;
+      fr.referenced = true;
+      settle(fr);
+      for (size_t v = 0; v < run.size(); v++) {
+        if (write)
+          memcpy(fr.data + pos, run[v].iov_base, run[v].iov_len);
+        else
+          memcpy(run[v].iov_base, fr.data + pos, run[v].iov_len);
+        pos += run[v].iov_len;
+      }
+      if (write)
+        fr.dirty = true;
+    } else if (write) {
+      d->submit_writev(ids[i], &run[0], run.size());
+    } else {
+      d->submit_readv(ids[i], &run[0], run.size());
+    }
+    i = j;
+  }
+  d->drain();
+  return found;
+}
+
+// Follow the read of ids as part of a sequential stream and prefetch
+// past it. Prefetching stops at the first free block, which belongs to
+// no file, and the frames it fills are first in line for eviction
+// until they are read.
+void
+block_manager::readahead(const blockid_t *ids, uint32_t n,
+                         uint32_t cached_hits)
+{
+  ScopedLock ml(&cache_lock);
+  struct ra_stream *st = NULL;
+  blockid_t first = ids[0], last = ids[n-1];
+  uint32_t window_max = MIN(RA_MAX_WINDOW, cache_size / 4);
+
+  for (int s = 0; s < RA_STREAMS; s++) {
+    struct ra_stream *c = &streams[s];
+    if (c->window != 0 && first >= c->next && first <= c->ahead) {
+      st = c;
+      break;
+    }
+  }
+  if (st == NULL) {
+    // a new stream replaces the least recently used one; nothing is
+    // prefetched until a second read shows it to be sequential
+    st = &streams[0];
+    for (int s = 1; s < RA_STREAMS; s++) {
+      if (streams[s].used < st->used)
+        st = &streams[s];
+    }
+    st->window = RA_MIN_WINDOW;
+    st->next = st->ahead = last + 1;
+    st->used = ++ra_clock;
+    return;
+  } else if (first < st->ahead && cached_hits < MIN(n, st->ahead - first)) {
+    // prefetched blocks were evicted before being read
+    st->window = MAX(st->window / 2, RA_MIN_WINDOW);
+  } else {
+    st->window = MIN(st->window * 2, MAX(window_max, RA_MIN_WINDOW));
+  }
+  st->next = last + 1;
+  st->used = ++ra_clock;
+
+  blockid_t b = MAX(st->ahead, st->next);
+  for (; b < st->next + st->window && b < sb.nblocks; b++) {
+    if (!(used[b / 64] & (1ULL << (b % 64))))
+      break;
+    if (cached.count(b))
+      continue;
+    uint32_t f = victim();
+    struct frame &fr = frames[f];
+    fr.id = b;
+    fr.refs = 0;
+    fr.dirty = false;
+    fr.referenced = false;
+    fr.io_tag = d->submit_read(b, fr.data);
+    cached[b] = f;
+  }
+  st->ahead = b;
+}
+
+void
+block_manager::read_blocks(const blockid_t *ids, uint32_t n,
+                           const struct iovec *iov, int iovcnt)
+{
+  if (n > 0)
+    readahead(ids, n, rw_blocks(ids, n, iov, iovcnt, false));
+}
+
+void
+block_manager::write_blocks(const blockid_t *ids, uint32_t n,
+                            const struct iovec *iov, int iovcnt)
+{
+  rw_blocks(ids, n, iov, iovcnt, true);
+}
+
+void
+block_manager::read_blocks(const blockid_t *ids, uint32_t n, char *buf)
+{
+  struct iovec iov = { buf, (size_t)n << sb.block_shift };
+  if (n > 0)
+    readahead(ids, n, rw_blocks(ids, n, &iov, 1, false));
+}
+
+void
+block_manager::write_blocks(const blockid_t *ids, uint32_t n, const char *buf)
+{
+  struct iovec iov = { (char *)buf, (size_t)n << sb.block_shift };
+  rw_blocks(ids, n, &iov, 1, true);
+}
+
+// A cached block is copied out at once and needs no completion.
+int
+block_manager::submit_read_block(uint32_t id, char *buf)
+{
+  ScopedLock ml(&cache_lock);
+  std::map<blockid_t, uint32_t>::iterator it = cached.find(id);
+  if (it != cached.end()) {
+    hits++;
+    settle(frames[it->second]);
+    memcpy(buf, frames[it->second].data, sb.block_size);
+    return 0;
+  }
+  return d->submit_read(id, buf);
+}
+
+void
+block_manager::complete_block(int tag)
+{
+  d->wait(tag);
+}
+
+void
+block_manager::complete_blocks()
+{
+  d->drain();
+}
+
+// inode layer -----------------------------------------
+
+// An inode fills its slot of the table exactly.
+typedef char inode_size_check[sizeof(struct inode) == (1U << INODE_SHIFT) ? 1 : -1];
+
+// Log space needed to allocate or free n blocks: a bitmap block each
+// at worst, and never more than the whole bitmap.
+static uint32_t
+bitmap_blocks(const superblock_t &sb, uint32_t n)
+{
+  return MIN(sb.imap_start - sb.bmap_start, n);
+}
+
+// State shared by both constructors.
+void
+inode_manager::setup()
+{
+  readonly = false;
+  pthread_mutex_init(&ialloc_lock, NULL);
+  pthread_mutex_init(&icache_lock, NULL);
+  pthread_mutex_init(&ilocks_lock, NULL);
+  pthread_mutex_init(&delay_lock, NULL);
+  ndelayed = 0;
+  delay_max = env_size(DELAY_BLOCKS_ENV, DELAY_BLOCKS);
+  wb_failed = false;
+  icache_size = env_size(ICACHE_INODES_ENV, ICACHE_INODES);
+  if (icache_size == 0)
+    icache_size = 1;
+  ihand = 0;
+  ichanges = 0;
+  const char *format = getenv(INODE_FORMAT_ENV);
+  extents = format == NULL || strcmp(format, "blocks") != 0;
+}
+
+inode_manager::inode_manager()
+{
+  bm = new block_manager();
+  setup();
+  load_imap();
+  if (bm->formatted) {
+    uint32_t root_dir = alloc_inode(extent_protocol::T_DIR);
+    if (root_dir != 1) {
+      printf("\tim: error! alloc first inode %d, should be 1\n", root_dir);
+      exit(0);
+    }
+  }
+  bm->start_writeback(writeback_hook, this);
+}
+
+// Reads leave access times alone, so nothing is ever dirty.
+inode_manager::inode_manager(inode_manager *live, uint32_t sid)
+{
+  bm = new block_manager(new snapshot_disk(live->bm, sid));
+  setup();
+  readonly = true;
+}
+
+inode_manager::~inode_manager()
+{
+  delete bm;
+  pthread_mutex_destroy(&ialloc_lock);
+  pthread_mutex_destroy(&icache_lock);
+  pthread_mutex_destroy(&ilocks_lock);
+  pthread_mutex_destroy(&delay_lock);
+}
+
+// Before each periodic write-back of the block cache, the delayed file
+// data gets its blocks and the access times dirty in the inode cache
+// go to their blocks, so that all of it goes out with the cache.
+void
+inode_manager::writeback_hook(void *arg)
+{
+  inode_manager *im = (inode_manager *)arg;
+
+  im->write_back();
+  im->sync_inodes();
+}
+
+int
+inode_manager::flush()
+{
+  bool ok = write_back();
+
+  sync_inodes();
+  bm->flush();
+  ScopedLock ml(&delay_lock);
+  ok = ok && !wb_failed;
+  wb_failed = false;
+  return ok ? 0 : -1;
+}
+
+// Data still being written while the snapshot is taken may be left
+// out of it, as from a crash, the file reading zeros in its place.
+int
+inode_manager::snapshot()
+{
+  if (!write_back()) {
+    printf("\tim: error! delayed data left out of the snapshot\n");
+    return -1;
+  }
+  sync_inodes();
+  return bm->snapshot();
+}
+
+bool
+inode_manager::delete_snapshot(uint32_t sid)
+{
+  return bm->delete_snapshot(sid);
+}
+
+bool
+inode_manager::has_snapshot(uint32_t sid)
+{
+  return bm->has_snapshot(sid);
+}
+
+// Copy the inode bitmap in, and stack the words with a free inode
+// highest first, so that the lowest inodes are handed out first.
+void
+inode_manager::load_imap()
+{
+  superblock_t &sb = bm->sb;
+  size_t nwords = (sb.ninodes + 64) / 64;
+  size_t bytes = nwords * 8;
+  char *p;
+
+  iused.assign(nwords, 0);
+  p = (char *)&iused[0];
+  for (blockid_t b = sb.imap_start; b < sb.inode_start; b++) {
+    size_t off = (size_t)(b - sb.imap_start) << sb.block_shift;
+    const char *block = bm->get_block(b);
+    memcpy(p + off, block, MIN((size_t)sb.block_size, bytes - off));
+    bm->put_block(b);
+  }
+  iused[0] |= 1;
+  for (size_t i = sb.ninodes + 1; i < nwords * 64; i++)
+    iused[i / 64] |= 1ULL << (i % 64);
+  for (size_t w = nwords; w-- > 0; ) {
+    if (iused[w] != ~0ULL)
+      ifree.push_back(w);
+  }
+}
+
+// Set or clear the bit of inode inum, in memory and in the inode
+// bitmap. A word that gains a free inode goes back on the stack; one
+// that fills up is dropped when it next comes to the top. Called
+// inside an operation with ialloc_lock held.
+void
+inode_manager::set_imap(uint32_t inum, bool inuse)
+{
+  uint64_t bit = 1ULL << (inum % 64);
+  uint64_t &word = iused[inum / 64];
+  uint32_t off = inum & (BPB(bm->sb) - 1);
+  blockid_t bnum = IMBLOCK(inum, bm->sb);
+
+  if (inuse) {
+    word |= bit;
+  } else {
+    if (word == ~0ULL)
+      ifree.push_back(inum / 64);
+    word &= ~bit;
+  }
+  char *block = bm->get_block_rw(bnum);
+  if (inuse)
+    block[off / 8] |= (char)(1 << (off % 8));
+  else
+    block[off / 8] &= ~(char)(1 << (off % 8));
+  bm->mark_dirty(bnum);
+  bm->put_block(bnum);
+}
+
+// inode cache -----------------------------------------
+
+// Entry for an inode not in the cache: a fresh one while the cache is
+// below its bound, else the first clean entry the CLOCK hand finds
+// with its reference bit clear. Called with icache_lock held.
+uint32_t
+inode_manager::ivictim()
+{
+  struct icache_entry ne;
+
+  if (icache.size() >= icache_size) {
+    for (uint32_t scanned = 0; scanned < 2 * icache.size(); scanned++) {
+      uint32_t e = ihand;
+      struct icache_entry &ie = icache[e];
+      ihand = (ihand + 1) % icache.size();
+      if (ie.dirty)
+        continue;
+      if (ie.referenced) {
+        ie.referenced = false;
+        continue;
+      }
+      if (ie.inum != 0)
+        icached.erase(ie.inum);
+      return e;
+    }
+  }
+  ne.inum = 0;
+  ne.dirty = false;
+  ne.referenced = false;
+  icache.push_back(ne);
+  return icache.size() - 1;
+}
+
+// Copy the cached inode inum into ino; false on a miss.
+bool
+inode_manager::icache_get(uint32_t inum, struct inode *ino)
+{
+  ScopedLock ml(&icache_lock);
+  std::map<uint32_t, uint32_t>::iterator it = icached.find(inum);
+
+  if (it == icached.end())
+    return false;
+  icache[it->second].referenced = true;
+  *ino = icache[it->second].ino;
+  return true;
+}
+
+// Cache ino, just read from its block, unless the inode is cached by
+// now or anything was put or dropped since seen: the block may then
+// have changed after it was read.
+void
+inode_manager::icache_fill(uint32_t inum, const struct inode *ino, uint64_t seen)
+{
+  ScopedLock ml(&icache_lock);
+
+  if (ichanges != seen || icached.count(inum))
+    return;
+  uint32_t e = ivictim();
+  icached[inum] = e;
+  icache[e].inum = inum;
+  icache[e].ino = *ino;
+  icache[e].dirty = false;
+  icache[e].referenced = true;
+}
+
+// Cache ino, which its block now holds too. A newer access time still
+// waiting to be written back is kept.
+void
+inode_manager::icache_put(uint32_t inum, const struct inode *ino)
+{
+  ScopedLock ml(&icache_lock);
+  std::map<uint32_t, uint32_t>::iterator it = icached.find(inum);
+  uint32_t e;
+
+  ichanges++;
+  if (it != icached.end()) {
+    e = it->second;
+  } else {
+    e = ivictim();
+    icached[inum] = e;
+    icache[e].inum = inum;
+    icache[e].dirty = false;
+  }
+  struct icache_entry &ie = icache[e];
+  uint32_t atime = ie.ino.atime;
+  bool newer = ie.dirty && atime > ino->atime;
+  ie.ino = *ino;
+  ie.referenced = true;
+  ie.dirty = newer;
+  if (newer)
+    ie.ino.atime = atime;
+}
+
+void
+inode_manager::icache_drop(uint32_t inum)
+{
+  ScopedLock ml(&icache_lock);
+  std::map<uint32_t, uint32_t>::iterator it = icached.find(inum);
+
+  ichanges++;
+  if (it == icached.end())
+    return;
+  icache[it->second].inum = 0;
+  icache[it->second].dirty = false;
+  icache[it->second].referenced = false;
+  icached.erase(it);
+}
+
+// Set the access time of inode inum, in the cache only if it is there.
+void
+inode_manager::touch_inode(uint32_t inum, uint32_t atime)
+{
+  {
+    ScopedLock ml(&icache_lock);
+    std::map<uint32_t, uint32_t>::iterator it = icached.find(inum);
+    if (it != icached.end()) {
+      struct icache_entry &ie = icache[it->second];
+      if (atime > ie.ino.atime) {
+        ie.ino.atime = atime;
+        ie.dirty = true;
+      }
+      return;
+    }
+  }
+  bm->begin_op();
+  blockid_t bnum = IBLOCK(inum, bm->sb);
+  struct inode *ino_disk = (struct inode*)bm->get_block_rw(bnum) + IOFF(inum, bm->sb);
+  if (ino_disk->type != 0 && atime > ino_disk->atime) {
+    ino_disk->atime = atime;
+    bm->mark_dirty(bnum);
+  }
+  bm->put_block(bnum);
+  bm->end_op();
+}
+
+// Write the dirty access times back to the inode blocks, in inode
+// order and MAXOPBLOCKS blocks to an operation. Only the access time
+// is written: the rest of each inode is in its block already.
+void
+inode_manager::sync_inodes()
+{
+  std::vector<std::pair<uint32_t, uint32_t> > dirty;   // (inum, atime)
+  size_t i = 0;
+
+  {
+    ScopedLock ml(&icache_lock);
+    for (size_t e = 0; e < icache.size(); e++) {
+      if (icache[e].dirty) {
+        dirty.push_back(std::make_pair(icache[e].inum, icache[e].ino.atime));
+        icache[e].dirty = false;
+      }
+    }
+  }
+  std::sort(dirty.begin(), dirty.end());
+  while (i < dirty.size()) {
+    bm->begin_op();
+    for (uint32_t nb = 0; nb < MAXOPBLOCKS && i < dirty.size(); nb++) {
+      blockid_t bnum = IBLOCK(dirty[i].first, bm->sb);
+      struct inode *table = (struct inode*)bm->get_block_rw(bnum);
+      bool changed = false;
+      for (; i < dirty.size() && IBLOCK(dirty[i].first, bm->sb) == bnum; i++) {
+        struct inode *ino = &table[IOFF(dirty[i].first, bm->sb)];
+        // a freed (or reused) inode has no older access time to update
+        if (ino->type != 0 && ino->atime < dirty[i].second) {
+          ino->atime = dirty[i].second;
+          changed = true;
+        }
+      }
+      if (changed)
+        bm->mark_dirty(bnum);
+      bm->put_block(bnum);
+    }
+    bm->end_op();
+  }
+}
+
+// Inode inum from the cache, or else from its block; false if it is
+// not in use.
+bool
+inode_manager::read_inode(uint32_t inum, struct inode *ino)
+{
+  uint64_t seen;
+
+  if (icache_get(inum, ino))
+    return true;
+  {
+    ScopedLock ml(&icache_lock);
+    seen = ichanges;
+  }
+  blockid_t bnum = IBLOCK(inum, bm->sb);
+  *ino = *((const struct inode*)bm->get_block(bnum) + IOFF(inum, bm->sb));
+  bm->put_block(bnum);
+  if (ino->type == 0)
+    return false;
+  icache_fill(inum, ino, seen);
+  return true;
+}
+
+// inode locks -----------------------------------------
+
+// Take the lock of inode inum, made on first use. The table lock is
+// dropped before waiting, the reference keeping the lock alive.
+void
+inode_manager::lock_inode(uint32_t inum, bool excl)
+{
+  ilock *l;
+
+  {
+    ScopedLock ml(&ilocks_lock);
+    std::map<uint32_t, ilock *>::iterator it = ilocks.find(inum);
+    if (it != ilocks.end()) {
+      l = it->second;
+    } else {
+      l = new ilock;
+      pthread_rwlock_init(&l->rw, NULL);
+      l->refs = 0;
+      ilocks[inum] = l;
+    }
+    l->refs++;
+  }
+  if (excl)
+    VERIFY(pthread_rwlock_wrlock(&l->rw) == 0);
+  else
+    VERIFY(pthread_rwlock_rdlock(&l->rw) == 0);
+}
+
+void
+inode_manager::unlock_inode(uint32_t inum)
+{
+  ScopedLock ml(&ilocks_lock);
+  std::map<uint32_t, ilock *>::iterator it = ilocks.find(inum);
+  ilock *l = it->second;
+
+  VERIFY(pthread_rwlock_unlock(&l->rw) == 0);
+  if (--l->refs == 0) {
+    pthread_rwlock_destroy(&l->rw);
+    delete l;
+    ilocks.erase(it);
+  }
+}
+
+// inode operations ------------------------------------
+
+/* Create a new file.
+ * Return its inum. */
+uint32_t
+inode_manager::alloc_inode(uint32_t type)
+{
+  /* 
+   * your code goes here.
+   * note: the normal inode block should begin from the 2nd inode block.
+   * the 1st is used for root_dir, see inode_manager::inode_manager().
+   */
+  time_t rawtime;
+  uint32_t num = 0;
+  //Take the lowest free inode of the word on top of the free stack,
+  //dropping words that filled up while below the top. It is only
+  //reserved in memory until its lock is held and the operation begins
+  {
+    ScopedLock ml(&ialloc_lock);
+    while(!ifree.empty() && iused[ifree.back()] == ~0ULL){
+      ifree.pop_back();
+    }
+    if(!ifree.empty()){
+      uint32_t w = ifree.back();
+      num = w * 64 + __builtin_ctzll(~iused[w]);
+      iused[w] |= 1ULL << (num % 64);
+    }
+  }
+  //If there is no residual inode.
+  if(num == 0){
+    printf("\tim: error! There is no inode left!\n");
+    exit(0);
+  }
+  inode_lock il(this, num, true);
+  bm->begin_op();
+  {
+    ScopedLock ml(&ialloc_lock);
+    set_imap(num, true);
+  }
+  struct inode inode;
+  bzero(&inode, sizeof(inode));
+  inode.size = 0;
+  inode.type = type;
+  inode.ctime = time(&rawtime);
+  inode.mtime = time(&rawtime);
+  inode.atime = time(&rawtime);
+  inode.flags = INODE_INLINE;
+  put_inode(num,&inode);
+  bm->end_op();
+  return num;
+}
+
+void
+inode_manager::free_inode(uint32_t inum)
+{
+  /* 
+   * your code goes here.
+   * note: you need to check if the inode is already a freed one;
+   * if not, clear it, and remember to write back to disk.
+   */
+  if (inum <= 0 || inum > bm->sb.ninodes)
+    return;
+  bm->begin_op();
+  blockid_t bnum = IBLOCK(inum, bm->sb);
+  struct inode *ino_disk = (struct inode*)bm->get_block_rw(bnum) + IOFF(inum, bm->sb);
+  if(ino_disk->type == 0){
+    printf("\tThis block has been freed.\n");
+  }else{
+    bzero(ino_disk, sizeof(*ino_disk));
+    bm->mark_dirty(bnum);
+  }
+  bm->put_block(bnum);
+  icache_drop(inum);
+  {
+    ScopedLock ml(&ialloc_lock);
+    if(iused[inum / 64] & (1ULL << (inum % 64)))
+      set_imap(inum, false);
+  }
+  bm->end_op();
+  return;
+}
+
+
+/* Return an inode structure by inum, NULL otherwise.
+ * Caller should release the memory. */
+struct inode* 
+inode_manager::get_inode(uint32_t inum)
+{
+  struct inode *ino;
+
+  printf("\tim: get_inode %d\n", inum);
+
+  if (inum <= 0 || inum > bm->sb.ninodes) {                                    //modified
+    printf("\tim: inum out of range\n");
+    return NULL;
+  }
+
+  ino = (struct inode*)malloc(sizeof(struct inode));
+  if (!read_inode(inum, ino)) {
+    printf("\tim: inode not exist\n");
+    free(ino);
+    return NULL;
+  }
+
+  return ino;
+}
+
+void
+inode_manager::put_inode(uint32_t inum, struct inode *ino)
+{
+  struct inode *ino_disk;
+
+  printf("\tim: put_inode %d\n", inum);
+  if (ino == NULL)
+    return;
+
+  blockid_t bnum = IBLOCK(inum, bm->sb);
+  ino_disk = (struct inode*)bm->get_block_rw(bnum) + IOFF(inum, bm->sb);
+  *ino_disk = *ino;
+  bm->mark_dirty(bnum);
+  bm->put_block(bnum);
+  icache_put(inum, ino);
+}
+
+/* Turn ino, whose contents are inline, into an empty file with a map
+ * of the format new inodes get. */
+void
+inode_manager::uninline(struct inode *ino)
+{
+  ino->flags &= ~INODE_INLINE;
+  ino->size = 0;
+  bzero(ino->blocks, sizeof(ino->blocks));
+  if (extents) {
+    ino->flags |= INODE_EXTENTS;
+    ext_write(ino, std::vector<ext_entry>(), std::vector<blockid_t>());
+  }
+}
+
+/* Fill ids with the data blocks of ino, in file order, 0 for a hole,
+ * and meta (if not NULL) with its mapping blocks, one list per tree
+ * laid end to end, each in preorder. Return the number of blocks. */
+uint32_t
+inode_manager::block_ids(const struct inode *ino, std::vector<blockid_t> &ids,
+                         std::vector<blockid_t> *meta)
+{
+  ids.clear();
+  return block_range(ino, 0, NBLOCKS(ino->size, bm->sb), ids, meta);
+}
+
+/* Append to ids the data blocks first to first+n-1 of ino, or as many
+ * of them as the file has, 0 for a hole, and to meta the mapping
+ * blocks read to find them. Only the parts of the map that cover the
+ * range are read. Return the number of blocks appended. */
+uint32_t
+inode_manager::block_range(const struct inode *ino, uint64_t first,
+                           uint64_t n, std::vector<blockid_t> &ids,
+                           std::vector<blockid_t> *meta)
+{
+  uint64_t nblocks = NBLOCKS(ino->size, bm->sb);
+  size_t was = ids.size();
+
+  if (first >= nblocks || (ino->flags & INODE_INLINE))
+    return 0;
+  n = MIN(n, nblocks - first);
+  ids.reserve(was + n);
+  if (ino->flags & INODE_EXTENTS) {
+    std::vector<ext_entry> ext;
+    ext_read((const struct ext_header *)ino->blocks, first, n, ext, meta);
+    ids.resize(was + n, 0);
+    for (size_t i = 0; i < ext.size(); i++) {
+      uint64_t from = MAX(first, ext[i].lblk);
+      uint64_t to = MIN(first + n, (uint64_t)ext[i].lblk + ext[i].len);
+      for (uint64_t b = from; b < to; b++)
+        ids[was + b - first] = ext[i].pblk + (b - ext[i].lblk);
+    }
+    return n;
+  }
+  if (first < NDIRECT) {
+    uint64_t m = MIN(n, NDIRECT - first);
+    ids.insert(ids.end(), ino->blocks + first, ino->blocks + first + m);
+    first += m;
+    n -= m;
+  }
+  first -= MIN(first, NDIRECT);
+  for (int d = 1; d <= NMAPTREES && n > 0; d++) {
+    uint64_t span = MAPSPAN(d, bm->sb);
+    if (first >= span) {
+      first -= span;
+      continue;
+    }
+    uint64_t m = MIN(n, span - first);
+    map_read(ino->blocks[NDIRECT + d - 1], d, first, m, ids, meta);
+    first = 0;
+    n -= m;
+  }
+  return ids.size() - was;
+}
+
+/* Append to ids the data blocks first to first+n-1 under mapping block
+ * bnum, depth levels above them, and to meta the mapping blocks. A
+ * missing mapping block (0) is a hole over all it would map. */
+void
+inode_manager::map_read(blockid_t bnum, int depth, uint64_t first, uint64_t n,
+                        std::vector<blockid_t> &ids,
+                        std::vector<blockid_t> *meta)
+{
+  uint64_t span = MAPSPAN(depth - 1, bm->sb);
+  uint32_t lo = first / span;
+  uint32_t k = (first + n - 1) / span + 1 - lo;
+  std::vector<blockid_t> ptrs(k);
+
+  if (bnum == 0) {
+    ids.insert(ids.end(), n, 0);
+    return;
+  }
+  if (meta != NULL)
+    meta->push_back(bnum);
+  const char *block = bm->get_block(bnum);
+  memcpy(&ptrs[0], (const blockid_t *)block + lo, k * sizeof(blockid_t));
+  bm->put_block(bnum);
+  if (depth == 1) {
+    ids.insert(ids.end(), ptrs.begin(), ptrs.end());
+    return;
+  }
+  for (uint32_t i = 0; i < k; i++) {
+    uint64_t from = MAX(first, (lo + i) * span);
+    uint64_t to = MIN(first + n, (lo + i + 1) * span);
+    map_read(ptrs[i], depth - 1, from - (lo + i) * span, to - from, ids, meta);
+  }
+}
+
+/* Point blocks first to first+n-1 of ino at ids, creating the
+ * mapping blocks missing on the way from pool. With ids NULL nothing
+ * changes, and used only counts the mapping blocks that would be
+ * taken from pool. */
+void
+inode_manager::map_range(struct inode *ino, uint64_t first, uint64_t n,
+                         const blockid_t *ids,
+                         const std::vector<blockid_t> &pool, size_t &used)
+{
+  if (first < NDIRECT) {
+    uint64_t m = MIN(n, NDIRECT - first);
+    if (ids != NULL) {
+      memcpy(ino->blocks + first, ids, m * sizeof(blockid_t));
+      ids += m;
+    }
+    first += m;
+    n -= m;
+  }
+  first -= MIN(first, NDIRECT);
+  for (int d = 1; d <= NMAPTREES && n > 0; d++) {
+    uint64_t span = MAPSPAN(d, bm->sb);
+    if (first >= span) {
+      first -= span;
+      continue;
+    }
+    uint64_t m = MIN(n, span - first);
+    blockid_t top = map_set(ino->blocks[NDIRECT + d - 1], d, first, m, ids,
+                            pool, used);
+    if (ids != NULL) {
+      ino->blocks[NDIRECT + d - 1] = top;
+      ids += m;
+    }
+    first = 0;
+    n -= m;
+  }
+}
+
+/* Point blocks first to first+n-1 under mapping block bnum, depth
+ * levels above them, at ids, and return the block. If bnum is 0 (a
+ * hole) a zeroed one is taken from pool. Only the path down to the
+ * range is read, and only the blocks that change are dirtied. */
+blockid_t
+inode_manager::map_set(blockid_t bnum, int depth, uint64_t first, uint64_t n,
+                       const blockid_t *ids,
+                       const std::vector<blockid_t> &pool, size_t &used)
+{
+  uint64_t span = MAPSPAN(depth - 1, bm->sb);
+  uint32_t lo = first / span;
+  uint32_t k = (first + n - 1) / span + 1 - lo;
+  std::vector<blockid_t> ptrs(k, 0), next(k);
+
+  if (bnum == 0 && ids == NULL) {
+    used++;
+  } else if (bnum == 0) {
+    bnum = pool[used++];
+    char *block = bm->get_block_rw(bnum);
+    memset(block, 0, bm->sb.block_size);
+    bm->mark_dirty(bnum);
+    bm->put_block(bnum);
+  } else if (ids != NULL || depth > 1) {
+    const char *block = bm->get_block(bnum);
+    memcpy(&ptrs[0], (const blockid_t *)block + lo, k * sizeof(blockid_t));
+    bm->put_block(bnum);
+  }
+  if (depth == 1) {
+    if (ids == NULL)
+      return bnum;
+    memcpy(&next[0], ids, k * sizeof(blockid_t));
+  } else {
+    for (uint32_t i = 0; i < k; i++) {
+      uint64_t from = MAX(first, (lo + i) * span);
+      uint64_t to = MIN(first + n, (lo + i + 1) * span);
+      next[i] = map_set(ptrs[i], depth - 1, from - (lo + i) * span, to - from,
+                        ids != NULL ? ids + (from - first) : NULL, pool, used);
+    }
+    if (ids == NULL)
+      return bnum;
+  }
+  if (next != ptrs) {
+    blockid_t *p = (blockid_t *)bm->get_block_rw(bnum);
+    memcpy(p + lo, &next[0], k * sizeof(blockid_t));
+    bm->mark_dirty(bnum);
+    bm->put_block(bnum);
+  }
+  return bnum;
+}
+
+/* Free the blocks from keep on of the n mapped under mapping block
+ * bnum, depth levels above them, adding them and the mapping blocks
+ * left with nothing to map to freed. In a node that stays, the
+ * pointers to what is freed are cleared. */
+void
+inode_manager::map_trim(blockid_t bnum, int depth, uint64_t keep, uint64_t n,
+                        std::vector<blockid_t> &freed)
+{
+  uint64_t span = MAPSPAN(depth - 1, bm->sb);
+  uint32_t lo = keep / span;
+  uint32_t clear = (keep + span - 1) / span;
+  uint32_t k = (n + span - 1) / span;
+  std::vector<blockid_t> ptrs(k - lo);
+
+  if (keep > 0) {
+    blockid_t *p = (blockid_t *)bm->get_block_rw(bnum);
+    memcpy(&ptrs[0], p + lo, (k - lo) * sizeof(blockid_t));
+    if (clear < k) {
+      memset(p + clear, 0, (k - clear) * sizeof(blockid_t));
+      bm->mark_dirty(bnum);
+    }
+  } else {
+    const char *block = bm->get_block(bnum);
+    memcpy(&ptrs[0], (const blockid_t *)block + lo, (k - lo) * sizeof(blockid_t));
+  }
+  bm->put_block(bnum);
+  for (uint32_t i = lo; i < k; i++) {
+    uint64_t base = (uint64_t)i * span;
+    if (ptrs[i - lo] == 0)
+      continue;
+    if (depth > 1)
+      map_trim(ptrs[i - lo], depth - 1, keep > base ? keep - base : 0,
+               MIN(span, n - base), freed);
+    if (keep <= base)
+      freed.push_back(ptrs[i - lo]);
+  }
+}
+
+// Depth of an extent tree over n extents: the root holds up to
+// EXT_ROOT_MAX entries, every other node EXT_NODE_MAX.
+static int
+ext_depth(const superblock_t &sb, uint64_t n)
+{
+  int depth = 0;
+
+  while (n > EXT_ROOT_MAX) {
+    n = (n + EXT_NODE_MAX(sb) - 1) / EXT_NODE_MAX(sb);
+    depth++;
+  }
+  return depth;
+}
+
+// Nodes of an extent tree over n extents, not counting the root.
+static uint64_t
+ext_nodes(const superblock_t &sb, uint64_t n)
+{
+  uint64_t total = 0;
+
+  while (n > EXT_ROOT_MAX) {
+    n = (n + EXT_NODE_MAX(sb) - 1) / EXT_NODE_MAX(sb);
+    total += n;
+  }
+  return total;
+}
+
+/* Append to ext the leaf entries under node that overlap the n blocks
+ * from first, and to meta (if not NULL) the nodes read on the way.
+ * Only the subtrees covering the range are descended into. */
+void
+inode_manager::ext_read(const struct ext_header *node, uint64_t first,
+                        uint64_t n, std::vector<ext_entry> &ext,
+                        std::vector<blockid_t> *meta)
+{
+  const ext_entry *e = (const ext_entry *)(node + 1);
+
+  for (uint32_t i = 0; i < node->entries; i++) {
+    if (e[i].lblk >= first + n)
+      break;
+    if (node->depth == 0) {
+      if ((uint64_t)e[i].lblk + e[i].len > first)
+        ext.push_back(e[i]);
+      continue;
+    }
+    if (i + 1 < node->entries && e[i + 1].lblk <= first)
+      continue;
+    if (meta != NULL)
+      meta->push_back(e[i].pblk);
+    const char *child = bm->get_block(e[i].pblk);
+    ext_read((const struct ext_header *)child, first, n, ext, meta);
+    bm->put_block(e[i].pblk);
+  }
+}
+
+/* Make the extent tree in ino map ext, on the nodes of pool in
+ * preorder. As with the block map, a tree over fewer extents is laid
+ * out on a prefix of the same preorder, and only the nodes whose
+ * contents change are dirtied. pool holds ext_nodes(ext.size())
+ * blocks. */
+void
+inode_manager::ext_write(struct inode *ino, const std::vector<ext_entry> &ext,
+                         const std::vector<blockid_t> &pool)
+{
+  struct ext_header *root = (struct ext_header *)ino->blocks;
+  ext_entry *e = (ext_entry *)(root + 1);
+  int depth = ext_depth(bm->sb, ext.size());
+  size_t used = 0;
+
+  bzero(ino->blocks, sizeof(ino->blocks));
+  root->magic = EXT_MAGIC;
+  root->max = EXT_ROOT_MAX;
+  root->depth = depth;
+  if (depth == 0) {
+    root->entries = ext.size();
+    if (!ext.empty())
+      memcpy(e, &ext[0], ext.size() * sizeof(ext_entry));
+    return;
+  }
+  uint64_t span = 1;
+  for (int d = 0; d < depth; d++)
+    span *= EXT_NODE_MAX(bm->sb);
+  root->entries = (ext.size() + span - 1) / span;
+  for (uint32_t i = 0; i < root->entries; i++) {
+    e[i].lblk = ext[i * span].lblk;
+    e[i].pblk = ext_build(depth - 1, &ext[i * span],
+                          MIN(span, ext.size() - i * span), pool, used);
+    e[i].len = 0;
+  }
+}
+
+/* Write a node of the given depth over the n extents ext on the next
+ * block of pool, its subtrees after it. Return the node's block. */
+blockid_t
+inode_manager::ext_build(int depth, const ext_entry *ext, uint64_t n,
+                         const std::vector<blockid_t> &pool, size_t &used)
+{
+  blockid_t bnum = pool[used++];
+  uint64_t span = 1;
+  uint32_t k;
+
+  for (int d = 0; d < depth; d++)
+    span *= EXT_NODE_MAX(bm->sb);
+  k = (n + span - 1) / span;
+  std::vector<char> node(sizeof(struct ext_header) + k * sizeof(ext_entry));
+  struct ext_header *h = (struct ext_header *)&node[0];
+  ext_entry *e = (ext_entry *)(h + 1);
+  h->magic = EXT_MAGIC;
+  h->entries = k;
+  h->max = EXT_NODE_MAX(bm->sb);
+  h->depth = depth;
+  if (depth == 0) {
+    memcpy(e, ext, n * sizeof(ext_entry));
+  } else {
+    for (uint32_t i = 0; i < k; i++) {
+      e[i].lblk = ext[i * span].lblk;
+      e[i].pblk = ext_build(depth - 1, ext + i * span,
+                            MIN(span, n - i * span), pool, used);
+      e[i].len = 0;
+    }
+  }
+  char *block = bm->get_block_rw(bnum);
+  if (memcmp(block, &node[0], node.size()) != 0) {
+    memcpy(block, &node[0], node.size());
+    bm->mark_dirty(bnum);
+  }
+  bm->put_block(bnum);
+  return bnum;
+}
+
+/* Node b of the tree c changes, read in if it is not yet. */
+struct ext_header *
+inode_manager::ext_node(ext_change &c, blockid_t b)
+{
+  std::vector<char> &node = c.nodes[b];
+
+  if (node.empty()) {
+    node.resize(bm->sb.block_size);
+    memcpy(&node[0], bm->get_block(b), bm->sb.block_size);
+    bm->put_block(b);
+  }
+  return (struct ext_header *)&node[0];
+}
+
+/* Make an empty node of the given depth in c; return its number. */
+blockid_t
+inode_manager::ext_new(ext_change &c, int depth)
+{
+  blockid_t b = c.next++;
+  std::vector<char> &node = c.nodes[b];
+  struct ext_header *h;
+
+  node.resize(bm->sb.block_size, 0);
+  h = (struct ext_header *)&node[0];
+  h->magic = EXT_MAGIC;
+  h->entries = 0;
+  h->max = EXT_NODE_MAX(bm->sb);
+  h->depth = depth;
+  c.dirty.insert(b);
+  return b;
+}
+
+/* Map the blocks of e, which are holes, in c: descend to the leaf
+ * over e.lblk and there extend the extent before or after it if e
+ * continues it on disk, else put e in as an entry of its own. */
+void
+inode_manager::ext_insert(ext_change &c, const ext_entry &e)
+{
+  std::vector<blockid_t> path(1, 0);
+  std::vector<uint32_t> at;
+  struct ext_header *h = ext_node(c, 0);
+  ext_entry *x = (ext_entry *)(h + 1);
+  uint32_t pos = 0;
+
+  while (h->depth > 0) {
+    uint32_t i = 0;
+    while (i + 1 < h->entries && x[i + 1].lblk <= e.lblk)
+      i++;
+    at.push_back(i);
+    path.push_back(x[i].pblk);
+    h = ext_node(c, x[i].pblk);
+    x = (ext_entry *)(h + 1);
+  }
+  while (pos < h->entries && x[pos].lblk < e.lblk)
+    pos++;
+  if (pos > 0 && x[pos - 1].lblk + x[pos - 1].len == e.lblk
+      && x[pos - 1].pblk + x[pos - 1].len == e.pblk) {
+    x[pos - 1].len += e.len;
+    if (pos < h->entries && e.lblk + e.len == x[pos].lblk
+        && e.pblk + e.len == x[pos].pblk) {
+      x[pos - 1].len += x[pos].len;
+      memmove(x + pos, x + pos + 1, (h->entries - pos - 1) * sizeof(ext_entry));
+      h->entries--;
+      bzero(x + h->entries, sizeof(ext_entry));
+    }
+    c.dirty.insert(path.back());
+    return;
+  }
+  if (pos < h->entries && e.lblk + e.len == x[pos].lblk
+      && e.pblk + e.len == x[pos].pblk) {
+    x[pos].lblk = e.lblk;
+    x[pos].pblk = e.pblk;
+    x[pos].len += e.len;
+    c.dirty.insert(path.back());
+    if (pos == 0)
+      ext_fix_key(c, path, at, path.size() - 1);
+    return;
+  }
+  ext_put(c, path, at, path.size() - 1, pos, e);
+}
+
+/* Put e in at pos of node path[l], which is entry at[l-1] of its
+ * parent. A full node splits first: the root moves its entries down
+ * into a new node and grows a level; any other node starts a new one
+ * when e goes past its last entry (a file written in order leaves its
+ * nodes full), else gives half its entries to a new one, and the new
+ * node's entry goes in one level up. */
+void
+inode_manager::ext_put(ext_change &c, std::vector<blockid_t> &path,
+                       std::vector<uint32_t> &at, size_t l, uint32_t pos,
+                       const ext_entry &e)
+{
+  struct ext_header *h = ext_node(c, path[l]);
+  ext_entry *x = (ext_entry *)(h + 1);
+
+  c.dirty.insert(path[l]);
+  if (h->entries < h->max) {
+    memmove(x + pos + 1, x + pos, (h->entries - pos) * sizeof(ext_entry));
+    x[pos] = e;
+    h->entries++;
+    if (pos == 0 && l > 0)
+      ext_fix_key(c, path, at, l);
+    return;
+  }
+  blockid_t b = ext_new(c, h->depth);
+  struct ext_header *s = ext_node(c, b);
+  ext_entry *y = (ext_entry *)(s + 1);
+  if (l == 0) {
+    memcpy(y, x, h->entries * sizeof(ext_entry));
+    s->entries = h->entries;
+    bzero(x, h->entries * sizeof(ext_entry));
+    h->depth++;
+    h->entries = 1;
+    x[0].lblk = y[0].lblk;
+    x[0].pblk = b;
+    x[0].len = 0;
+    path.insert(path.begin() + 1, b);
+    at.insert(at.begin(), 0);
+    ext_put(c, path, at, 1, pos, e);
+    return;
+  }
+  if (pos == h->entries) {
+    y[0] = e;
+    s->entries = 1;
+  } else {
+    std::vector<ext_entry> all(x, x + h->entries);
+    all.insert(all.begin() + pos, e);
+    uint32_t half = all.size() / 2;
+    memcpy(x, &all[0], half * sizeof(ext_entry));
+    bzero(x + half, (h->entries - half) * sizeof(ext_entry));
+    memcpy(y, &all[half], (all.size() - half) * sizeof(ext_entry));
+    h->entries = half;
+    s->entries = all.size() - half;
+    if (pos == 0)
+      ext_fix_key(c, path, at, l);
+  }
+  ext_entry up = { y[0].lblk, b, 0 };
+  ext_put(c, path, at, l - 1, at[l - 1] + 1, up);
+}
+
+/* Give the entry of node path[l] in its parent the node's first
+ * logical block, and so on up while it is its parent's first entry. */
+void
+inode_manager::ext_fix_key(ext_change &c, const std::vector<blockid_t> &path,
+                           const std::vector<uint32_t> &at, size_t l)
+{
+  for (; l > 0; l--) {
+    struct ext_header *h = ext_node(c, path[l]);
+    struct ext_header *p = ext_node(c, path[l - 1]);
+    ((ext_entry *)(p + 1))[at[l - 1]].lblk = ((ext_entry *)(h + 1))[0].lblk;
+    c.dirty.insert(path[l - 1]);
+    if (at[l - 1] > 0)
+      break;
+  }
+}
+
+/* Write the nodes of c that changed into ino (the root) and their
+ * blocks, the new ones onto pool in the order they were made. */
+void
+inode_manager::ext_commit(struct inode *ino, ext_change &c,
+                          const std::vector<blockid_t> &pool)
+{
+  blockid_t base = bm->sb.nblocks;
+
+  for (std::set<blockid_t>::iterator it = c.dirty.begin();
+       it != c.dirty.end(); ++it) {
+    std::vector<char> &node = c.nodes[*it];
+    struct ext_header *h = (struct ext_header *)&node[0];
+    ext_entry *e = (ext_entry *)(h + 1);
+    blockid_t bnum = *it >= base ? pool[*it - base] : *it;
+    for (uint32_t i = 0; h->depth > 0 && i < h->entries; i++) {
+      if (e[i].pblk >= base)
+        e[i].pblk = pool[e[i].pblk - base];
+    }
+    if (bnum == 0) {
+      memcpy(ino->blocks, &node[0], sizeof(ino->blocks));
+      continue;
+    }
+    char *block = bm->get_block_rw(bnum);
+    memcpy(block, &node[0], node.size());
+    bm->mark_dirty(bnum);
+    bm->put_block(bnum);
+  }
+}
+
+/* Count in touched, by depth, the nodes under node that an insert
+ * among the n blocks from first may reach. Leaves are counted, not
+ * read. */
+void
+inode_manager::ext_touch(const struct ext_header *node, uint64_t first,
+                         uint64_t n, std::vector<uint64_t> &touched)
+{
+  const ext_entry *e = (const ext_entry *)(node + 1);
+
+  for (uint32_t i = 0; node->depth > 0 && i < node->entries; i++) {
+    if (i > 0 && e[i].lblk >= first + n)
+      break;
+    if (i + 1 < node->entries && e[i + 1].lblk <= first)
+      continue;
+    touched[node->depth - 1]++;
+    if (node->depth == 1)
+      continue;
+    const char *child = bm->get_block(e[i].pblk);
+    ext_touch((const struct ext_header *)child, first, n, touched);
+    bm->put_block(e[i].pblk);
+  }
+}
+
+/* Most nodes that inserting k extents among blocks first to
+ * first+n-1 of ino in order can add, and in *touched (if not NULL)
+ * the nodes there it may change besides. A split leaves either half
+ * (max-1)/2 entries free at least, so at each level below the root
+ * the inserts split each node of the range once, and then one node
+ * per (max-1)/2 more; each split is an insert a level up. When the
+ * root runs out of entries it moves down a level, and the count goes
+ * on from there. */
+uint64_t
+inode_manager::ext_new_nodes(const struct inode *ino, uint64_t first,
+                             uint64_t n, uint64_t k, uint64_t *touched)
+{
+  const struct ext_header *root = (const struct ext_header *)ino->blocks;
+  uint64_t half = (EXT_NODE_MAX(bm->sb) - 1) / 2;
+  uint64_t room = EXT_ROOT_MAX - root->entries;
+  std::vector<uint64_t> nodes(root->depth, 0);
+  uint64_t total = 0;
+
+  ext_touch(root, first, n, nodes);
+  if (touched != NULL) {
+    *touched = 0;
+    for (int d = 0; d < root->depth; d++)
+      *touched += nodes[d];
+  }
+  for (int d = 0; d < root->depth && k > 0; d++) {
+    k = MIN(k, nodes[d] + (k + half - 1) / half);
+    total += k;
+  }
+  while (k > room) {
+    k = MIN(k, 1 + (k + half - 1) / half);
+    total += 1 + k;
+    room = EXT_ROOT_MAX - 1;
+  }
+  return total;
+}
+
+// Mapping blocks a tree of the given depth needs over n data blocks.
+static uint64_t
+map_blocks(const superblock_t &sb, int depth, uint64_t n)
+{
+  uint64_t total = 0;
+
+  for (int d = depth; d >= 1 && n > 0; d--)
+    total += (n + MAPSPAN(d, sb) - 1) / MAPSPAN(d, sb);
+  return total;
+}
+
+// Mapping blocks of every tree of a file of n data blocks.
+static uint64_t
+file_map_blocks(const superblock_t &sb, uint64_t n)
+{
+  uint64_t total = 0;
+
+  n -= MIN(NDIRECT, n);
+  for (int d = 1; d <= NMAPTREES && n > 0; d++) {
+    uint64_t m = MIN(n, MAPSPAN(d, sb));
+    total += map_blocks(sb, d, m);
+    n -= m;
+  }
+  return total;
+}
+
+// Free the blocks ids, a run of consecutive ones at a time; holes (0)
+// are skipped.
+static void
+free_ids(block_manager *bm, std::vector<blockid_t> &ids)
+{
+  std::sort(ids.begin(), ids.end());
+  for (size_t i = std::upper_bound(ids.begin(), ids.end(), 0) - ids.begin(), j;
+       i < ids.size(); i = j) {
+    for (j = i + 1; j < ids.size() && ids[j] == ids[j - 1] + 1; j++)
+      ;
+    bm->free_blocks(ids[i], j - i);
+  }
+}
+
+/* Log blocks that filling the holes among blocks first to
+ * first+ids.size()-1 of ino (ids holding their current addresses) may
+ * dirty: its map, and the bitmap blocks of the blocks gained. For an
+ * extent tree that is the nodes over the range and the ones their
+ * splits may add, each new block being an extent of its own; for a
+ * block map the nodes over the range, a leaf per NINDIRECT blocks and
+ * fewer above, plus a partly covered one at either end of each
+ * level. */
+uint32_t
+inode_manager::fill_log(const struct inode *ino, uint64_t first,
+                        const std::vector<blockid_t> &ids)
+{
+  uint64_t holes = std::count(ids.begin(), ids.end(), 0);
+  uint64_t map_bound;
+
+  if (holes == 0)
+    return 0;
+  if (ino->flags & INODE_EXTENTS) {
+    uint64_t touched;
+    map_bound = ext_new_nodes(ino, first, ids.size(), holes, &touched);
+    map_bound += touched;
+  } else {
+    map_bound = 2 * (ids.size() >> NINDIRECT_SHIFT(bm->sb))
+      + 2 * NMAPTREES * NMAPTREES;
+  }
+  return MIN(map_bound + bitmap_blocks(bm->sb, MIN(holes + map_bound,
+                                                   (uint64_t)bm->sb.nblocks)),
+             (uint64_t)bm->sb.nblocks);
+}
+
+/* Allocate a block for each hole among blocks first to
+ * first+ids.size()-1 of ino, whose current addresses are in ids, as a
+ * few runs starting right after the block before the first hole if
+ * that is free, and the mapping blocks they need; map them and put
+ * them in ids. With resv, the blocks come out of the *resv the caller
+ * reserved, which is topped up first if it falls short of the most
+ * they can take, and is charged for them. Return false, changing
+ * nothing, if there is no space. */
+bool
+inode_manager::fill_blocks(struct inode *ino, uint64_t first,
+                           std::vector<blockid_t> &ids, uint64_t *resv)
+{
+  superblock_t &sb = bm->sb;
+  uint64_t n = ids.size();
+  uint64_t holes = std::count(ids.begin(), ids.end(), 0);
+  bool extent = ino->flags & INODE_EXTENTS;
+  std::vector<block_run_t> runs, mruns;
+  std::vector<blockid_t> prev, pool;
+  std::vector<uint64_t> filled;
+  ext_change c;
+  size_t need_meta = 0;
+  blockid_t goal = 0;
+
+  if (holes == 0)
+    return true;
+  if (holes > sb.nblocks)
+    return false;
+  uint64_t h = std::find(ids.begin(), ids.end(), 0) - ids.begin();
+  if (h > 0)
+    goal = ids[h - 1] + 1;
+  else if (first > 0 && block_range(ino, first - 1, 1, prev) == 1 && prev[0] != 0)
+    goal = prev[0] + 1;
+  //For a block map the mapping blocks the range lacks, which the new
+  //blocks do not change
+  if (!extent)
+    map_range(ino, first, n, NULL, pool, need_meta);
+  if (resv != NULL) {
+    //At worst every new block is an extent of its own
+    uint64_t worst = extent ? ext_new_nodes(ino, first, n, holes, NULL)
+      : need_meta;
+    worst += holes;
+    if (worst > *resv) {
+      if (!bm->reserve_blocks(worst - *resv))
+        return false;
+      *resv = worst;
+    }
+  }
+  if (!bm->alloc_blocks(holes, runs, goal, resv != NULL)) {
+    if (resv != NULL)
+      *resv -= holes;
+    return false;
+  }
+
+  //Work out the map with the new blocks, and the mapping blocks that
+  //takes: for an extent tree, put each run of them in, in order
+  std::vector<blockid_t> fill(ids);
+  size_t r = 0;
+  uint32_t k = 0;
+  for (uint64_t i = 0; i < n; i++) {
+    if (fill[i] != 0)
+      continue;
+    fill[i] = runs[r].start + k;
+    filled.push_back(i);
+    if (++k == runs[r].len) {
+      r++;
+      k = 0;
+    }
+  }
+  if (extent) {
+    ext_entry e = { 0, 0, 0 };
+    c.nodes[0].assign((const char *)ino->blocks,
+                      (const char *)ino->blocks + sizeof(ino->blocks));
+    c.next = sb.nblocks;
+    for (size_t j = 0; j < filled.size(); j++) {
+      uint64_t i = filled[j];
+      if (e.len > 0 && e.lblk + e.len == first + i
+          && e.pblk + e.len == fill[i]) {
+        e.len++;
+        continue;
+      }
+      if (e.len > 0)
+        ext_insert(c, e);
+      e.lblk = first + i;
+      e.pblk = fill[i];
+      e.len = 1;
+    }
+    ext_insert(c, e);
+    need_meta = c.next - sb.nblocks;
+  }
+  if (resv != NULL)
+    *resv -= holes + need_meta;
+  if (need_meta > 0 && !bm->alloc_blocks(need_meta, mruns, 0, resv != NULL)) {
+    for (size_t j = 0; j < runs.size(); j++)
+      bm->free_blocks(runs[j].start, runs[j].len);
+    return false;
+  }
+  for (size_t j = 0; j < mruns.size(); j++) {
+    for (uint32_t l = 0; l < mruns[j].len; l++)
+      pool.push_back(mruns[j].start + l);
+  }
+  if (extent) {
+    ext_commit(ino, c, pool);
+  } else {
+    size_t used = 0;
+    map_range(ino, first, n, &fill[0], pool, used);
+  }
+  ids.swap(fill);
+  return true;
+}
+
+/* Zero what lies past the end of ino in its last block, if that block
+ * is allocated: it may hold stale bytes, which growing the file would
+ * bring into view. */
+void
+inode_manager::zero_tail(const struct inode *ino)
+{
+  superblock_t &sb = bm->sb;
+  uint32_t tail = ino->size & (sb.block_size - 1);
+  std::vector<blockid_t> last;
+
+  if (tail == 0 || (ino->flags & INODE_INLINE)
+      || block_range(ino, (ino->size >> sb.block_shift), 1, last) != 1
+      || last[0] == 0)
+    return;
+  if (ino->type == extent_protocol::T_DIR) {
+    char *block = bm->get_block_rw(last[0]);
+    memset(block + tail, 0, sb.block_size - tail);
+    bm->mark_dirty(last[0]);
+    bm->put_block(last[0]);
+    return;
+  }
+  std::vector<char> block(sb.block_size);
+  bm->read_blocks(&last[0], 1, &block[0]);
+  memset(&block[tail], 0, sb.block_size - tail);
+  bm->write_blocks(&last[0], 1, &block[0]);
+}
+
+/* Read the n blocks ids into buf, one after another; a hole (0) reads
+ * as zeros. Each run of allocated blocks is one vectored read. */
+void
+inode_manager::read_data(const blockid_t *ids, uint64_t n, char *buf)
+{
+  uint32_t shift = bm->sb.block_shift;
+
+  for (uint64_t i = 0, j; i < n; i = j) {
+    for (j = i + 1; j < n && (ids[j] == 0) == (ids[i] == 0); j++)
+      ;
+    if (ids[i] == 0)
+      memset(buf + (i << shift), 0, (j - i) << shift);
+    else
+      bm->read_blocks(ids + i, j - i, buf + (i << shift));
+  }
+}
+
+/* Log blocks that shrinking ino from old_num to new_num data blocks
+ * may dirty: the nodes of its map that stay (for a block map, the one
+ * partly kept node per level of the tree the new end falls in), and
+ * the bitmap blocks of the data and mapping blocks freed. */
+uint32_t
+inode_manager::trim_log(const struct inode *ino, uint64_t old_num,
+                        uint64_t new_num)
+{
+  uint64_t nodes, freed_meta;
+
+  if (ino->flags & INODE_EXTENTS) {
+    std::vector<ext_entry> ext;
+    std::vector<blockid_t> meta;
+    ext_read((const struct ext_header *)ino->blocks, 0, old_num, ext, &meta);
+    nodes = freed_meta = meta.size();
+  } else {
+    nodes = NMAPTREES;
+    freed_meta = file_map_blocks(bm->sb, old_num)
+      - file_map_blocks(bm->sb, new_num);
+  }
+  return MIN(nodes + bitmap_blocks(bm->sb, MIN(old_num - new_num + freed_meta,
+                                               (uint64_t)bm->sb.nblocks)),
+             (uint64_t)bm->sb.nblocks);
+}
+
+/* Free data blocks new_num to old_num-1 of ino and the mapping blocks
+ * that no longer map anything. Only the part of the map past the new
+ * end is read, or for an extent tree its nodes, and the data blocks
+ * are not touched. */
+void
+inode_manager::trim_blocks(struct inode *ino, uint64_t old_num,
+                           uint64_t new_num)
+{
+  superblock_t &sb = bm->sb;
+  std::vector<blockid_t> freed;
+
+  if (ino->flags & INODE_EXTENTS) {
+    std::vector<ext_entry> ext;
+    std::vector<blockid_t> meta;
+    ext_read((const struct ext_header *)ino->blocks, 0, old_num, ext, &meta);
+    size_t keep = 0;
+    for (size_t i = 0; i < ext.size(); i++) {
+      uint64_t from = MAX(new_num, ext[i].lblk);
+      uint64_t to = (uint64_t)ext[i].lblk + ext[i].len;
+      if (from < to)
+        bm->free_blocks(ext[i].pblk + (from - ext[i].lblk), to - from);
+      if (ext[i].lblk < new_num) {
+        ext[i].len = MIN(ext[i].len, new_num - ext[i].lblk);
+        keep = i + 1;
+      }
+    }
+    ext.resize(keep);
+    size_t new_meta = ext_nodes(sb, ext.size());
+    freed.assign(meta.begin() + MIN(new_meta, meta.size()), meta.end());
+    meta.resize(MIN(new_meta, meta.size()));
+    free_ids(bm, freed);
+    ext_write(ino, ext, meta);
+    return;
+  }
+  for (uint64_t i = new_num; i < MIN(old_num, (uint64_t)NDIRECT); i++) {
+    freed.push_back(ino->blocks[i]);
+    ino->blocks[i] = 0;
+  }
+  uint64_t base = NDIRECT;
+  for (int d = 1; d <= NMAPTREES && old_num > base; d++) {
+    uint64_t span = MAPSPAN(d, sb);
+    uint64_t n = MIN(old_num - base, span);
+    uint64_t keep = new_num > base ? MIN(new_num - base, span) : 0;
+    if (keep < n && ino->blocks[NDIRECT + d - 1] != 0) {
+      map_trim(ino->blocks[NDIRECT + d - 1], d, keep, n, freed);
+      if (keep == 0) {
+        freed.push_back(ino->blocks[NDIRECT + d - 1]);
+        ino->blocks[NDIRECT + d - 1] = 0;
+      }
+    }
+    base += span;
+  }
+  free_ids(bm, freed);
+}
+
+// delayed allocation ----------------------------------
+
+// The delayed blocks of inum, NULL if it has none.
+inode_manager::delayed_file *
+inode_manager::delayed_of(uint32_t inum)
+{
+  ScopedLock ml(&delay_lock);
+  std::map<uint32_t, delayed_file>::iterator it = delayed.find(inum);
+
+  return it == delayed.end() ? NULL : &it->second;
+}
+
+// Blocks a write of the blocks ids maps from first would delay anew:
+// the holes that are not delayed already.
+uint64_t
+inode_manager::delay_need(uint32_t inum, uint64_t first,
+                          const std::vector<blockid_t> &ids)
+{
+  delayed_file *df = delayed_of(inum);
+  uint64_t n = 0;
+
+  for (uint64_t i = 0; i < ids.size(); i++) {
+    if (ids[i] == 0 && (df == NULL || df->blocks.count(first + i) == 0))
+      n++;
+  }
+  return n;
+}
+
+// Reserve for n more delayed blocks of inum, written to blocks first to
+// first+count-1 of ino, and for the mapping blocks the file may need
+// at worst once all its delayed blocks are written back: with
+// extents, the nodes that putting them all in, each an extent of its
+// own, may add over the range they span; with a block map, the mapping
+// blocks each write's range lacks, up to a whole map for the file.
+// Returns false, reserving nothing, if they are not free.
+// Called with the lock of inum held exclusively.
+bool
+inode_manager::delay_reserve(uint32_t inum, struct inode *ino, uint64_t n,
+                             uint64_t first, uint64_t count)
+{
+  superblock_t &sb = bm->sb;
+  delayed_file *df = delayed_of(inum);
+  uint64_t held = df == NULL ? 0 : df->blocks.size();
+  uint64_t resv = df == NULL ? 0 : df->resv;
+  uint64_t meta;
+
+  if (n == 0)
+    return true;
+  if (ino->flags & INODE_EXTENTS) {
+    uint64_t lo = first, hi = first + count;
+    if (held > 0) {
+      lo = MIN(lo, df->blocks.begin()->first);
+      hi = MAX(hi, df->blocks.rbegin()->first + 1);
+    }
+    meta = ext_new_nodes(ino, lo, hi - lo, held + n, NULL);
+  } else {
+    size_t missing = 0;
+    uint64_t had = resv - MIN(resv, held);
+    map_range(ino, first, count, NULL, std::vector<blockid_t>(), missing);
+    meta = MIN(had + missing,
+               MAX(had, file_map_blocks(sb, MAX(NBLOCKS(ino->size, sb),
+                                                first + count))));
+  }
+  uint64_t want = held + n + meta;
+  if (want > resv && !bm->reserve_blocks(want - resv))
+    return false;
+  ScopedLock ml(&delay_lock);
+  delayed[inum].resv = MAX(want, resv);
+  ndelayed += n;
+  return true;
+}
+
+bool
+inode_manager::delay_over()
+{
+  ScopedLock ml(&delay_lock);
+  return ndelayed > delay_max;
+}
+
+// Store the blocks of a regular file from block first, whose addresses
+// are ids, from len bytes of data, the last block padded with zeros:
+// allocated blocks are written in place, holes are delayed. The holes
+// not delayed yet have been reserved (delay_need, delay_reserve).
+// Called with the lock of inum held exclusively.
+void
+inode_manager::store_blocks(uint32_t inum, uint64_t first,
+                            const std::vector<blockid_t> &ids,
+                            const char *data, uint64_t len)
+{
+  superblock_t &sb = bm->sb;
+  uint64_t nb = ids.size();
+  uint64_t full = len >> sb.block_shift;
+  std::vector<char> last;
+  delayed_file *df = NULL;
+
+  if (full < nb) {
+    last.assign(sb.block_size, 0);
+    memcpy(&last[0], data + (full << sb.block_shift),
+           len - (full << sb.block_shift));
+  }
+  for (uint64_t i = 0; i < nb; ) {
+    const char *src = i < full ? data + (i << sb.block_shift) : &last[0];
+    if (ids[i] == 0) {
+      if (df == NULL) {
+        ScopedLock ml(&delay_lock);
+        df = &delayed[inum];
+      }
+      df->blocks[first + i].assign(src, src + sb.block_size);
+      i++;
+      continue;
+    }
+    uint64_t j = i + 1;
+    while (j < full && ids[j] != 0)
+      j++;
+    bm->write_blocks(&ids[i], j - i, src);
+    i = j;
+  }
+}
+
+// Drop the delayed blocks past a new size of inum, and their
+// reservations, and zero the rest of the one it ends in. The mapping
+// blocks stay reserved while any delayed block is left, or with
+// refill, when the caller has reserved for blocks it is about to
+// delay. Called with the lock of inum held exclusively.
+void
+inode_manager::trim_delayed(uint32_t inum, uint64_t size, bool refill)
+{
+  superblock_t &sb = bm->sb;
+  delayed_file *df = delayed_of(inum);
+  uint64_t keep = NBLOCKS(size, sb);
+  uint64_t n = 0;
+
+  if (df == NULL)
+    return;
+  std::map<uint64_t, std::vector<char> >::iterator it;
+  it = df->blocks.lower_bound(keep);
+  while (it != df->blocks.end()) {
+    df->blocks.erase(it++);
+    n++;
+  }
+  if ((size & (sb.block_size - 1)) != 0
+      && (it = df->blocks.find(keep - 1)) != df->blocks.end()) {
+    uint32_t used = size & (sb.block_size - 1);
+    memset(&it->second[used], 0, sb.block_size - used);
+  }
+  bool gone = df->blocks.empty() && !refill;
+  uint64_t freed = gone ? df->resv : MIN(n, df->resv);
+  df->resv -= freed;
+  bm->unreserve_blocks(freed);
+  ScopedLock ml(&delay_lock);
+  ndelayed -= n;
+  if (gone)
+    delayed.erase(inum);
+}
+
+// Read n blocks of inum from block first, whose addresses are ids:
+// from disk, holes as zeros, and the delayed ones from memory. Called
+// with the lock of inum held.
+void
+inode_manager::read_file_blocks(uint32_t inum, uint64_t first,
+                                const blockid_t *ids, uint64_t n, char *buf)
+{
+  superblock_t &sb = bm->sb;
+  delayed_file *df = delayed_of(inum);
+
+  read_data(ids, n, buf);
+  if (df == NULL)
+    return;
+  std::map<uint64_t, std::vector<char> >::iterator it;
+  for (it = df->blocks.lower_bound(first);
+       it != df->blocks.end() && it->first < first + n; ++it)
+    memcpy(buf + ((it->first - first) << sb.block_shift), &it->second[0],
+           sb.block_size);
+}
+
+// Give the delayed blocks of inum their blocks, out of the file's
+// reservation, and write them out. Each run of consecutive delayed
+// blocks is allocated in one request, new blocks following the one
+// before the run if possible, in steps whose map and bitmap changes
+// fit in the log; the data goes out before the map that points at it
+// is committed. Returns false if there was no space, leaving the rest
+// delayed and the next flush to fail. Called with the lock of inum
+// held exclusively.
+bool
+inode_manager::write_back_locked(uint32_t inum)
+{
+  superblock_t &sb = bm->sb;
+  delayed_file *df = delayed_of(inum);
+  bool ok = true;
+
+  if (df == NULL)
+    return true;
+  struct inode *inode = get_inode(inum);
+  if (inode == NULL)
+    return false;
+  while (!df->blocks.empty()) {
+    std::map<uint64_t, std::vector<char> >::iterator it = df->blocks.begin();
+    uint64_t first = it->first;
+    uint64_t step = 0;
+    while (it != df->blocks.end() && it->first == first + step) {
+      step++;
+      ++it;
+    }
+    std::vector<blockid_t> ids;
+    uint32_t log;
+    while (true) {
+      ids.assign(step, 0);
+      log = fill_log(inode, first, ids);
+      if (sb.log_slots == 0 || 1 + log <= sb.log_slots / 2 || step == 1)
+        break;
+      step /= 2;
+    }
+    bm->begin_op(1 + log);
+    if (!fill_blocks(inode, first, ids, &df->resv)) {
+      printf("\tim: error! no space to write back inode %u\n", inum);
+      bm->end_op();
+      ok = false;
+      break;
+    }
+    uint64_t chunk = MIN(step, MAX(1U, (uint32_t)DELAY_CHUNK >> sb.block_shift));
+    std::vector<char> buf(chunk << sb.block_shift);
+    it = df->blocks.begin();
+    for (uint64_t i = 0; i < step; i += chunk) {
+      uint64_t c = MIN(chunk, step - i);
+      for (uint64_t j = 0; j < c; j++) {
+        memcpy(&buf[j << sb.block_shift], &it->second[0], sb.block_size);
+        df->blocks.erase(it++);
+      }
+      bm->write_blocks(&ids[i], c, &buf[0]);
+    }
+    put_inode(inum, inode);
+    bm->end_op();
+    ScopedLock ml(&delay_lock);
+    ndelayed -= step;
+  }
+  free(inode);
+  //What the map did not take of the reservation goes back
+  if (df->blocks.empty()) {
+    bm->unreserve_blocks(df->resv);
+    df->resv = 0;
+  }
+  ScopedLock ml(&delay_lock);
+  if (!ok)
+    wb_failed = true;
+  if (df->blocks.empty())
+    delayed.erase(inum);
+  return ok;
+}
+
+// Write back the delayed blocks of every file. Returns false if some
+// could not be.
+bool
+inode_manager::write_back()
+{
+  std::vector<uint32_t> inums;
+  bool ok = true;
+
+  {
+    ScopedLock ml(&delay_lock);
+    std::map<uint32_t, delayed_file>::iterator it;
+    for (it = delayed.begin(); it != delayed.end(); ++it)
+      inums.push_back(it->first);
+  }
+  for (size_t i = 0; i < inums.size(); i++) {
+    inode_lock il(this, inums[i], true);
+    if (!write_back_locked(inums[i]))
+      ok = false;
+  }
+  return ok;
+}
+
+/* Get all the data of a file by inum. 
+ * Return alloced data, should be freed by caller. */
+void
+inode_manager::read_file(uint32_t inum, char **buf_out, int *size)
+{
+  /*
+   * your code goes here.
+   * note: read blocks related to inode number inum,
+   * and copy them to buf_Out
+   */
+  time_t rawtime;
+  inode_lock il(this, inum, false);
+  struct inode* inode = get_inode(inum);
+  if(inode == NULL) return;
+  uint node_size = inode->size;
+  if(node_size == 0){
+    free(inode);
+    return;
+  }
+  *size = node_size;
+
+  //Inline contents come with the inode
+  if(inode->flags & INODE_INLINE){
+    *buf_out = (char*)malloc(node_size);
+    memcpy(*buf_out, inode->blocks, node_size);
+    if (!readonly)
+      touch_inode(inum, time(&rawtime));
+    free(inode);
+    return;
+  }
+
+  //Gather every block of the file in one vectored read per run of
+  //allocated blocks; holes read as zeros, delayed blocks from memory
+  std::vector<blockid_t> ids;
+  uint block_num = block_ids(inode, ids);
+  char* block_data = (char*)malloc((size_t)block_num << bm->sb.block_shift);
+  read_file_blocks(inum, 0, &ids[0], block_num, block_data);
+  *buf_out = block_data;
+  printf("\tread result: size = %d;\n",node_size);
+  //Update the access time, in the inode cache until the next sync
+  if (!readonly)
+    touch_inode(inum, time(&rawtime));
+  free(inode);
+  return;
+}
+
+/* alloc/free blocks if needed */
+void
+inode_manager::write_file(uint32_t inum, const char *buf, int size)
+{
+  /*
+   * your code goes here.
+   * note: write buf to blocks of inode inum.
+   * you need to consider the situation when the size of buf 
+   * is larger or smaller than the size of original inode
+   */
+  printf("\tinode_manager-write_file:%d\n",size);
+  time_t rawtime;
+  uint32_t bsize = bm->sb.block_size;
+  if(size < 0 || (uint64_t)size > MAXFILE(bm->sb) * bsize){
+    printf("\tim: error! file size %d too large\n", size);
+    return;
+  }
+  inode_lock il(this, inum, true);
+  struct inode* inode = get_inode(inum);
+  if(inode == NULL) return;
+
+  //Small contents go in the inode, freeing the blocks it had
+  if((uint32_t)size <= INLINE_MAX){
+    uint64_t old_num = NBLOCKS(inode->size, bm->sb);
+    if(inode->flags & INODE_INLINE){
+      bm->begin_op(1);
+    }else{
+      trim_delayed(inum, 0);
+      bm->begin_op(1 + trim_log(inode, old_num, 0));
+      trim_blocks(inode, old_num, 0);
+    }
+    inode->flags = INODE_INLINE;
+    bzero(inode->blocks, sizeof(inode->blocks));
+    memcpy(inode->blocks, buf, size);
+    inode->size = size;
+    inode->mtime = time(&rawtime);
+    inode->atime = time(&rawtime);
+    inode->ctime = time(&rawtime);
+    put_inode(inum, inode);
+    bm->end_op();
+    free(inode);
+    return;
+  }
+  if(inode->flags & INODE_INLINE)
+    uninline(inode);
+
+  //The blocks the file keeps, holes included, then new ones
+  std::vector<blockid_t> ids;
+  uint64_t old_num = NBLOCKS(inode->size, bm->sb);
+  uint new_num = NBLOCKS(size, bm->sb);
+  uint i;
+  bool dir = inode->type == extent_protocol::T_DIR;
+  block_range(inode, 0, MIN(old_num, (uint64_t)new_num), ids);
+  ids.resize(new_num, 0);
+
+  //A regular file's holes are delayed rather than filled: reserve
+  //their blocks first, so that if there is no space nothing has changed
+  uint64_t grow = dir ? 0 : delay_need(inum, 0, ids);
+  if(!dir && !delay_reserve(inum, inode, grow, 0, new_num)){
+    printf("\tim: error! no space for %d bytes\n", size);
+    free(inode);
+    return;
+  }
+
+  //Log space: the inode, the map and bitmap blocks that shrinking the
+  //file and filling a directory's holes change, and its own blocks
+  bm->begin_op(1 + (old_num > new_num ? trim_log(inode, old_num, new_num) : 0)
+               + (dir ? fill_log(inode, 0, ids) + new_num : 0));
+
+  //A directory's holes are filled first: if there is no space, nothing
+  //has changed. New blocks follow the current last one if possible
+  if(dir && !fill_blocks(inode, 0, ids)){
+    printf("\tim: error! no space for %d bytes\n", size);
+    bm->end_op();
+    free(inode);
+    return;
+  }
+  //Shrink: free the tail
+  trim_delayed(inum, size, grow > 0);
+  if(old_num > new_num)
+    trim_blocks(inode, old_num, new_num);
+
+  if(dir){
+    //Directory blocks are metadata: update them in the cache, where
+    //the journal picks up the ones that changed; a partial last block
+    //goes through a padded copy
+    uint full = size >> bm->sb.block_shift;
+    std::vector<char> tail(bsize, 0);
+    if(full < new_num)
+      memcpy(&tail[0], buf + (size_t)full * bsize, size - (size_t)full * bsize);
+    for(i = 0; i < new_num; i++){
+      const char *src = i < full ? buf + ((size_t)i << bm->sb.block_shift) : &tail[0];
+      char *block = bm->get_block_rw(ids[i]);
+      if(memcmp(block, src, bsize) != 0){
+        memcpy(block, src, bsize);
+        bm->mark_dirty(ids[i]);
+      }
+      bm->put_block(ids[i]);
+    }
+  }else{
+    store_blocks(inum, 0, ids, buf, size);
+  }
+
+  //Update inode metadata
+  inode->size = size;
+  inode->mtime = time(&rawtime);
+  inode->atime = time(&rawtime);
+  inode->ctime = time(&rawtime);
+  put_inode(inum,inode);
+  bm->end_op();
+  free(inode);
+  if(delay_over())
+    write_back_locked(inum);
+  return;
+}
+
+int
+inode_manager::read_range(uint32_t inum, uint64_t off, uint32_t len, char *buf)
+{
+  superblock_t &sb = bm->sb;
+  uint64_t mask = sb.block_size - 1;
+  struct inode ino;
+  time_t rawtime;
+
+  printf("\tinode_manager-read_range:%d %llu %u\n", inum,
+         (unsigned long long)off, len);
+  if (inum <= 0 || inum > sb.ninodes)
+    return -1;
+  inode_lock il(this, inum, false);
+  if (!read_inode(inum, &ino))
+    return -1;
+  if (off >= ino.size || len == 0)
+    return 0;
+  len = MIN(len, ino.size - off);
+
+  if (ino.flags & INODE_INLINE) {
+    memcpy(buf, (const char *)ino.blocks + off, len);
+    if (!readonly)
+      touch_inode(inum, time(&rawtime));
+    return len;
+  }
+
+  //Map just the blocks of the range, and read them straight into buf
+  //when it is block aligned
+  uint64_t first = off >> sb.block_shift;
+  uint64_t last = (off + len - 1) >> sb.block_shift;
+  std::vector<blockid_t> ids;
+  block_range(&ino, first, last - first + 1, ids);
+  if ((off & mask) == 0 && (len & mask) == 0) {
+    read_file_blocks(inum, first, &ids[0], ids.size(), buf);
+  } else {
+    std::vector<char> stage(ids.size() << sb.block_shift);
+    read_file_blocks(inum, first, &ids[0], ids.size(), &stage[0]);
+    memcpy(buf, &stage[off & mask], len);
+  }
+  if (!readonly)
+    touch_inode(inum, time(&rawtime));
+  return len;
+}
+
+int
+inode_manager::write_range(uint32_t inum, uint64_t off, uint32_t len,
+                           const char *buf, uint64_t *prev_size)
+{
+  superblock_t &sb = bm->sb;
+  uint32_t bsize = sb.block_size;
+  uint64_t mask = bsize - 1;
+  time_t rawtime;
+
+  printf("\tinode_manager-write_range:%d %llu %u\n", inum,
+         (unsigned long long)off, len);
+  if(len == 0)
+    return 0;
+  if(off + len > MAXFILE(sb) * bsize){
+    printf("\tim: error! file size %llu too large\n",
+           (unsigned long long)(off + len));
+    return -1;
+  }
+  inode_lock il(this, inum, true);
+  struct inode* inode = get_inode(inum);
+  if(inode == NULL) return -1;
+  uint32_t written = len;
+  if(prev_size != NULL)
+    *prev_size = inode->size;
+
+  //Inline contents that still fit are changed in the inode; if they
+  //no longer fit, they move to the first block
+  char head[INLINE_MAX];
+  uint32_t nhead = 0;
+  if(inode->flags & INODE_INLINE){
+    char *data = (char *)inode->blocks;
+    if(off + len <= INLINE_MAX){
+      bm->begin_op(1);
+      if(off > inode->size)
+        memset(data + inode->size, 0, off - inode->size);
+      memcpy(data + off, buf, len);
+      inode->size = MAX(inode->size, off + len);
+      inode->mtime = time(&rawtime);
+      inode->ctime = time(&rawtime);
+      put_inode(inum, inode);
+      bm->end_op();
+      free(inode);
+      return len;
+    }
+    nhead = inode->size;
+    memcpy(head, data, nhead);
+    uninline(inode);
+  }
+
+  //The blocks from the one holding off to the one holding end. A gap
+  //between the old end of the file and off is left a hole, apart from
+  //the rest of the old last block, which is zeroed
+  uint64_t old_size = MAX(inode->size, (uint64_t)nhead);
+  uint64_t end = off + len;
+  uint64_t first = off >> sb.block_shift;
+  uint64_t last = (end - 1) >> sb.block_shift;
+  uint64_t base = first << sb.block_shift;
+  uint64_t nb = last - first + 1;
+  bool dir = inode->type == extent_protocol::T_DIR;
+  std::vector<blockid_t> ids;
+
+  block_range(inode, first, nb, ids);
+  ids.resize(nb, 0);
+
+  //Stage the blocks before anything is allocated: the part of the
+  //first and last blocks outside the range is read back, what was past
+  //the old end is zero, then the new data
+  std::vector<char> stage(nb << sb.block_shift, 0);
+  bool lead = (off & mask) != 0;
+  if(lead)
+    read_file_blocks(inum, first, &ids[0], 1, &stage[0]);
+  if((end & mask) != 0 && !(lead && nb == 1))
+    read_file_blocks(inum, last, &ids[nb - 1], 1,
+                     &stage[(nb - 1) << sb.block_shift]);
+  if(nhead > 0 && first == 0)
+    memcpy(&stage[0], head, nhead);
+  if(old_size > base && old_size < off)
+    memset(&stage[old_size - base], 0, off - old_size);
+  memcpy(&stage[off - base], buf, len);
+
+  //Former inline contents outside the range go to a block of their own
+  std::vector<blockid_t> hid(1, 0);
+  std::vector<char> block(bsize, 0);
+  memcpy(&block[0], head, nhead);
+  if(dir){
+    //Log space: the inode, the map and bitmap blocks filling the holes
+    //in the range (and the first block, for inline contents) takes,
+    //and the directory's blocks
+    bm->begin_op(1 + fill_log(inode, first, ids) + (nhead > 0 ? 2 : 0)
+                 + nb + 2);
+    if(nhead > 0 && first > 0){
+      if(!fill_blocks(inode, 0, hid)){
+        printf("\tim: error! no space for %llu bytes\n", (unsigned long long)end);
+        bm->end_op();
+        free(inode);
+        return -1;
+      }
+      char *p = bm->get_block_rw(hid[0]);
+      memcpy(p, &block[0], bsize);
+      bm->mark_dirty(hid[0]);
+      bm->put_block(hid[0]);
+      inode->size = nhead;
+    }
+    //Allocate the holes in the range, new blocks following the one
+    //before them if possible, and the mapping blocks that takes
+    if(!fill_blocks(inode, first, ids)){
+      printf("\tim: error! no space for %llu bytes\n", (unsigned long long)end);
+      bm->end_op();
+      free(inode);
+      return -1;
+    }
+    if(old_size < base)
+      zero_tail(inode);
+    //Directory blocks are metadata, updated in the cache
+    for(uint64_t i = 0; i < nb; i++){
+      const char *src = &stage[i << sb.block_shift];
+      char *p = bm->get_block_rw(ids[i]);
+      if(memcmp(p, src, bsize) != 0){
+        memcpy(p, src, bsize);
+        bm->mark_dirty(ids[i]);
+      }
+      bm->put_block(ids[i]);
+    }
+  }else{
+    //A regular file's holes are delayed: reserve their blocks first,
+    //so that if there is no space nothing has changed
+    bool apart = nhead > 0 && first > 0;
+    if(!delay_reserve(inum, inode, delay_need(inum, first, ids) + (apart ? 1 : 0),
+                      apart ? 0 : first, apart ? first + nb : nb)){
+      printf("\tim: error! no space for %llu bytes\n", (unsigned long long)end);
+      free(inode);
+      return -1;
+    }
+    bm->begin_op(1);
+    if(apart){
+      store_blocks(inum, 0, hid, &block[0], bsize);
+      inode->size = nhead;
+    }
+    if(old_size < base)
+      zero_tail(inode);
+    store_blocks(inum, first, ids, &stage[0], nb << sb.block_shift);
+  }
+
+  //Update inode metadata
+  inode->size = MAX(old_size, end);
+  inode->mtime = time(&rawtime);
+  inode->ctime = time(&rawtime);
+  put_inode(inum, inode);
+  bm->end_op();
+  free(inode);
+  if(delay_over())
+    write_back_locked(inum);
+  return written;
+}
+
+int
+inode_manager::truncate(uint32_t inum, uint64_t size)
+{
+  inode_lock il(this, inum, true);
+  return truncate_locked(inum, size);
+}
+
+// Called with the lock of inum held exclusively.
+int
+inode_manager::truncate_locked(uint32_t inum, uint64_t size)
+{
+  superblock_t &sb = bm->sb;
+  time_t rawtime;
+
+  printf("\tinode_manager-truncate:%d %llu\n", inum, (unsigned long long)size);
+  if(size > MAXFILE(sb) * sb.block_size){
+    printf("\tim: error! file size %llu too large\n", (unsigned long long)size);
+    return -1;
+  }
+  struct inode* inode = get_inode(inum);
+  if(inode == NULL) return -1;
+  if(inode->type == extent_protocol::T_DIR){
+    printf("\tim: error! truncating directory %d\n", inum);
+    free(inode);
+    return -1;
+  }
+  uint64_t old_size = inode->size;
+  uint64_t old_num = NBLOCKS(old_size, sb);
+  char head[INLINE_MAX];
+  uint32_t nhead = 0;
+
+  //Contents that fit end up inline: a file shrunk that far keeps what
+  //is left of its first block, and frees every block it had
+  if(size <= INLINE_MAX){
+    bzero(head, sizeof(head));
+    if(inode->flags & INODE_INLINE){
+      memcpy(head, inode->blocks, MIN(old_size, size));
+      bm->begin_op(1);
+    }else{
+      std::vector<blockid_t> ids;
+      if(MIN(old_size, size) > 0 && block_range(inode, 0, 1, ids) == 1){
+        std::vector<char> block(sb.block_size);
+        read_file_blocks(inum, 0, &ids[0], 1, &block[0]);
+        memcpy(head, &block[0], MIN(old_size, size));
+      }
+      trim_delayed(inum, 0);
+      bm->begin_op(1 + trim_log(inode, old_num, 0));
+      trim_blocks(inode, old_num, 0);
+    }
+    inode->flags = INODE_INLINE;
+    memcpy(inode->blocks, head, sizeof(head));
+    inode->size = size;
+    inode->mtime = time(&rawtime);
+    inode->ctime = time(&rawtime);
+    put_inode(inum, inode);
+    bm->end_op();
+    free(inode);
+    return 0;
+  }
+  //Inline contents that no longer fit go to the first block, the rest
+  //being a hole
+  if(inode->flags & INODE_INLINE){
+    nhead = old_size;
+    memcpy(head, inode->blocks, nhead);
+    uninline(inode);
+    old_size = 0;
+    old_num = 0;
+  }
+
+  uint64_t new_num = NBLOCKS(size, sb);
+  if(size < old_size)
+    trim_delayed(inum, size);
+  if(new_num < old_num){
+    bm->begin_op(1 + trim_log(inode, old_num, new_num));
+    trim_blocks(inode, old_num, new_num);
+  }else if(nhead > 0){
+    //The first block is delayed like any other hole written to
+    std::vector<blockid_t> ids(1, 0);
+    if(!delay_reserve(inum, inode, 1, 0, 1)){
+      printf("\tim: error! no space for %llu bytes\n", (unsigned long long)size);
+      free(inode);
+      return -1;
+    }
+    bm->begin_op(1);
+    store_blocks(inum, 0, ids, head, nhead);
+  }else{
+    //Growing leaves a hole, once the rest of the old last block is
+    //zeroed
+    bm->begin_op(1);
+    if(size > old_size)
+      zero_tail(inode);
+  }
+
+  //Update inode metadata
+  inode->size = size;
+  inode->mtime = time(&rawtime);
+  inode->ctime = time(&rawtime);
+  put_inode(inum, inode);
+  bm->end_op();
+  free(inode);
+  return 0;
+}
+
+int
+inode_manager::fallocate(uint32_t inum, uint64_t off, uint64_t len)
+{
+  superblock_t &sb = bm->sb;
+  struct inode ino;
+  time_t rawtime;
+
+  printf("\tinode_manager-fallocate:%d %llu %llu\n", inum,
+         (unsigned long long)off, (unsigned long long)len);
+  if (len == 0)
+    return 0;
+  if (off + len < off || inum <= 0 || inum > sb.ninodes)
+    return -1;
+  inode_lock il(this, inum, true);
+  if (!read_inode(inum, &ino))
+    return -1;
+  //Grow the file over the range, as a hole, then fill the holes in it
+  //in steps whose map and bitmap changes fit in the log
+  if (off + len > ino.size && truncate_locked(inum, off + len) < 0)
+    return -1;
+  if (!write_back_locked(inum))
+    return -1;
+  uint64_t first = off >> sb.block_shift;
+  uint64_t last = (off + len - 1) >> sb.block_shift;
+  uint64_t step = MIN(last - first + 1, (uint64_t)sb.nblocks);
+  while (first <= last) {
+    struct inode *inode = get_inode(inum);
+    if (inode == NULL)
+      return -1;
+    if (inode->flags & INODE_INLINE) {
+      free(inode);
+      return 0;
+    }
+    std::vector<blockid_t> ids, fresh;
+    step = MIN(step, last + 1 - first);
+    block_range(inode, first, step, ids);
+    ids.resize(step, 0);
+    std::vector<blockid_t> had(ids);
+    uint32_t log = fill_log(inode, first, ids);
+    if (sb.log_slots > 0 && 1 + log > sb.log_slots / 2 && step > 1) {
+      step /= 2;
+      free(inode);
+      continue;
+    }
+    bm->begin_op(1 + log);
+    if (!fill_blocks(inode, first, ids)) {
+      printf("\tim: error! no space for %llu bytes\n",
+             (unsigned long long)(off + len));
+      bm->end_op();
+      free(inode);
+      return -1;
+    }
+    //The new blocks must read back as the zeros the holes did
+    for (uint64_t i = 0; i < step; i++) {
+      if (had[i] == 0)
+        fresh.push_back(ids[i]);
+    }
+    uint64_t chunk = MIN((uint64_t)fresh.size(),
+                         MAX(1U, (uint32_t)ZERO_CHUNK >> sb.block_shift));
+    std::vector<char> zeros(chunk << sb.block_shift, 0);
+    for (uint64_t i = 0; i < fresh.size(); i += chunk)
+      bm->write_blocks(&fresh[i], MIN(chunk, fresh.size() - i), &zeros[0]);
+    inode->ctime = time(&rawtime);
+    put_inode(inum, inode);
+    bm->end_op();
+    free(inode);
+    first += step;
+  }
+  return 0;
+}
+
+void
+inode_manager::getattr(uint32_t inum, extent_protocol::attr &a)
+{
+  /*
+   * your code goes here.
+   * note: get the attributes of inode inum.
+   * you can refer to "struct attr" in extent_protocol.h
+   */
+  struct inode inode;
+  if (inum <= 0 || inum > bm->sb.ninodes)
+    return;
+  inode_lock il(this, inum, false);
+  if(read_inode(inum, &inode)){
+    a.type = inode.type;
+    a.size = inode.size;
+    a.ctime = inode.ctime;
+    a.mtime = inode.mtime;
+    a.atime = inode.atime;
   }
   return ;
 }
@@ -416,21 +4600,617 @@ inode_manager::remove_file(uint32_t inum)
    * your code goes here
    * note: you need to consider about both the data block and inode of the file
    */
+  inode_lock il(this, inum, true);
   struct inode* old_inode = get_inode(inum);
-  uint block_num = old_inode->size%BLOCK_SIZE==0?(old_inode->size/BLOCK_SIZE):(old_inode->size/BLOCK_SIZE+1);
-  for(int i=0; i<MIN(NDIRECT,block_num); i++){
-    bm->free_block(old_inode->blocks[i]);
-  }
-  if(NDIRECT < block_num){
-    char inblock[BLOCK_SIZE];
-    bm->read_block(old_inode->blocks[NDIRECT],inblock);
-    for(int i=0; i<(block_num-NDIRECT); i++){
-      blockid_t block_id = ((blockid_t*)inblock)[i];
-      bm->free_block(block_id);
-    }
-    bm->free_block(old_inode->blocks[NDIRECT]);
+  if(old_inode == NULL) return;
+  //Delayed blocks never got a block: dropping them is all they take
+  trim_delayed(inum, 0);
+  uint64_t block_num = NBLOCKS(old_inode->size, bm->sb);
+  if(old_inode->flags & INODE_INLINE){
+    bm->begin_op(1);
+  }else{
+    bm->begin_op(1 + trim_log(old_inode, block_num, 0));
+    trim_blocks(old_inode, block_num, 0);
   }
   free(old_inode);
   free_inode(inum);
+  bm->end_op();
   return;
 }
+
+// fsck ------------------------------------------------
+
+// Shared by the threads of a check. They take FSCK_BATCH inode blocks
+// at a time from next; the maps of held blocks and of directory
+// entries are updated with atomic operations.
+struct inode_manager::fsck_state {
+  int flags;
+  fsck_report *r;
+  blockid_t next, end;              // inode blocks left to hand out
+  std::vector<uint64_t> claimed;    // blocks some inode holds
+  std::vector<uint64_t> owned;      // blocks the snapshots own
+  std::vector<char> types;          // type of each inode, 0 if free
+  std::vector<uint32_t> links;      // directory entries naming it
+  inode_manager *im;
+  pthread_mutex_t lock;
+  std::map<uint32_t, struct inode> suspects;  // online: to read again
+};
+
+// An inode being checked, with the data blocks found in its map so
+// far and whether every pointer met was in range.
+struct inode_manager::fsck_map {
+  uint32_t inum;
+  struct inode ino;
+  bool sound;
+  uint64_t nmeta;                   // mapping blocks
+  uint64_t mapped;                  // extent tree: end of the last extent
+  std::vector<blockid_t> ids;       // data blocks, in file order, no holes
+};
+
+// A mapping block still to be read, of map owner, depth levels above
+// the data. A block map node holds the addresses of the next n
+// blocks; an extent tree node's first entry must start at block n.
+struct inode_manager::fsck_node {
+  blockid_t b;
+  uint32_t owner;
+  int depth;
+  uint64_t n;
+};
+
+// Inode slot of a run of inode table blocks read into table.
+static const struct inode *
+table_inode(const superblock_t &sb, const std::vector<char> &table,
+            uint32_t slot)
+{
+  return (const struct inode *)&table[(size_t)(slot >> (sb.block_shift - INODE_SHIFT))
+                                      << sb.block_shift] + IOFF(slot, sb);
+}
+
+// Whether a and b map the same blocks; access times do not count.
+static bool
+same_inode(const struct inode *a, const struct inode *b)
+{
+  return a->type == b->type && a->flags == b->flags && a->size == b->size
+    && a->mtime == b->mtime
+    && a->ctime == b->ctime
+    && memcmp(a->blocks, b->blocks, sizeof(a->blocks)) == 0;
+}
+
+// Run the calling thread at the lowest CPU priority and, where the
+// system has one, in the idle I/O class, so that a scrub only takes
+// what the filesystem leaves over.
+static void
+lower_priority()
+{
+#ifdef __linux__
+  pid_t tid = syscall(SYS_gettid);
+  setpriority(PRIO_PROCESS, tid, SCRUB_NICE);
+#ifdef SYS_ioprio_set
+  // IOPRIO_WHO_PROCESS, IOPRIO_CLASS_IDLE
+  syscall(SYS_ioprio_set, 1, tid, 3 << 13);
+#endif
+#endif
+}
+
+void
+inode_manager::check(int nthreads, int flags, fsck_report &r)
+{
+  superblock_t &sb = bm->sb;
+  fsck_state st;
+  size_t nwords = (sb.nblocks + 63) / 64;
+
+  bzero(&r, sizeof(r));
+  if ((flags & FSCK_ONLINE) && (flags & FSCK_REPAIR)) {
+    printf("\tfsck: not repairing a live filesystem\n");
+    flags &= ~FSCK_REPAIR;
+  }
+  st.flags = flags;
+  st.r = &r;
+  st.next = IBLOCK(1, sb);
+  st.end = IBLOCK(sb.ninodes, sb) + 1;
+  st.claimed.assign(nwords, 0);
+  st.owned.assign(nwords, 0);
+  bm->snapshot_blocks(st.owned);
+  st.types.assign(sb.ninodes + 1, 0);
+  st.links.assign(sb.ninodes + 1, 0);
+  st.im = this;
+  pthread_mutex_init(&st.lock, NULL);
+
+  std::vector<pthread_t> th(MAX(nthreads, 1));
+  for (size_t i = 0; i < th.size(); i++)
+    pthread_create(&th[i], NULL, check_thread, &st);
+  for (size_t i = 0; i < th.size(); i++)
+    pthread_join(th[i], NULL);
+
+  if (flags & FSCK_ONLINE) {
+    recheck(&st);
+    pthread_mutex_destroy(&st.lock);
+    return;
+  }
+  // every entry names an inode in use, and every inode but the root
+  // is named by some entry
+  if (st.types[1] != extent_protocol::T_DIR) {
+    printf("\tfsck: root inode 1 is not a directory\n");
+    r.bad_inodes++;
+  }
+  for (uint32_t inum = 1; inum <= sb.ninodes; inum++) {
+    if (st.types[inum] == 0 && st.links[inum] > 0) {
+      printf("\tfsck: %u entries name free inode %u\n", st.links[inum], inum);
+      r.bad_entries += st.links[inum];
+    } else if (st.types[inum] != 0 && st.links[inum] == 0 && inum != 1) {
+      printf("\tfsck: inode %u is in no directory\n", inum);
+      r.orphans++;
+    }
+  }
+  check_imap(&st);
+  check_bitmap(&st);
+  pthread_mutex_destroy(&st.lock);
+}
+
+void *
+inode_manager::check_thread(void *arg)
+{
+  fsck_state *st = (fsck_state *)arg;
+
+  if (st->flags & FSCK_ONLINE)
+    lower_priority();
+  for (;;) {
+    blockid_t first = __sync_fetch_and_add(&st->next, FSCK_BATCH);
+    if (first >= st->end)
+      break;
+    st->im->check_batch(st, first, MIN(FSCK_BATCH, st->end - first));
+  }
+  return NULL;
+}
+
+// Check the inodes in n blocks of the table from first. The blocks
+// are read in one request, then the mapping blocks of all their
+// inodes a level at a time, then the contents of the directories
+// among them.
+void
+inode_manager::check_batch(fsck_state *st, blockid_t first, uint32_t n)
+{
+  superblock_t &sb = bm->sb;
+  std::vector<blockid_t> ids(n), dir_ids;
+  std::vector<char> table((size_t)n << sb.block_shift), dirs;
+  std::vector<fsck_map> maps;
+  std::vector<size_t> dir_maps;
+
+  for (uint32_t i = 0; i < n; i++)
+    ids[i] = first + i;
+  bm->read_blocks(&ids[0], n, &table[0]);
+
+  for (uint32_t i = 0; i < n * IPB(sb); i++) {
+    uint32_t inum = (first - sb.inode_start) * IPB(sb) + i;
+    const struct inode *ino = table_inode(sb, table, i);
+    if (inum == 0 || inum > sb.ninodes || ino->type == 0)
+      continue;
+    maps.push_back(fsck_map());
+    maps.back().inum = inum;
+    maps.back().ino = *ino;
+  }
+  check_inodes(st, maps, false);
+
+  for (size_t j = 0; j < maps.size(); j++) {
+    if (!maps[j].sound || maps[j].ino.type != extent_protocol::T_DIR
+        || (st->flags & FSCK_ONLINE))
+      continue;
+    if (maps[j].ino.flags & INODE_INLINE) {
+      check_dir(st, maps[j].inum, (const char *)maps[j].ino.blocks,
+                maps[j].ino.size);
+      continue;
+    }
+    if (maps[j].ids.size() < NBLOCKS(maps[j].ino.size, sb)) {
+      std::vector<blockid_t> ids;
+      block_ids(&maps[j].ino, ids);
+      std::vector<char> data(ids.size() << sb.block_shift);
+      read_data(&ids[0], ids.size(), &data[0]);
+      check_dir(st, maps[j].inum, &data[0], maps[j].ino.size);
+      continue;
+    }
+    dir_ids.insert(dir_ids.end(), maps[j].ids.begin(), maps[j].ids.end());
+    dir_maps.push_back(j);
+  }
+  if (dir_ids.empty())
+    return;
+  dirs.resize(dir_ids.size() << sb.block_shift);
+  bm->read_blocks(&dir_ids[0], dir_ids.size(), &dirs[0]);
+  size_t off = 0;
+  for (size_t j = 0; j < dir_maps.size(); j++) {
+    fsck_map &m = maps[dir_maps[j]];
+    check_dir(st, m.inum, &dirs[off], m.ino.size);
+    off += m.ids.size() << sb.block_shift;
+  }
+}
+
+// Check the inodes of maps and every block they hold. The top
+// mapping blocks of all of them are read in one request, the blocks
+// those point to in the next, and so on down to the data; a pointer
+// out of range is not followed. With confirm, the inodes are being
+// looked at again and only their problems are of interest. A 0
+// pointer is a hole.
+void
+inode_manager::check_inodes(fsck_state *st, std::vector<fsck_map> &maps,
+                            bool confirm)
+{
+  superblock_t &sb = bm->sb;
+  std::vector<fsck_node> level, next;
+  std::vector<blockid_t> ids;
+  std::vector<char> buf;
+  std::vector<char> typed(maps.size(), 0);
+
+  for (uint32_t j = 0; j < maps.size(); j++) {
+    if (!check_inode(st, maps[j], confirm))
+      continue;
+    typed[j] = 1;
+    if (maps[j].ino.flags & INODE_INLINE)
+      continue;
+    if (maps[j].ino.flags & INODE_EXTENTS) {
+      const struct ext_header *root = (const struct ext_header *)maps[j].ino.blocks;
+      check_extents(st, maps[j], j, root, root->depth, level, confirm);
+      continue;
+    }
+    uint64_t left = NBLOCKS(maps[j].ino.size, sb);
+    left -= MIN(left, NDIRECT);
+    for (int d = 1; d <= NMAPTREES && left > 0; d++) {
+      fsck_node node = { maps[j].ino.blocks[NDIRECT + d - 1], j, d,
+                         MIN(left, MAPSPAN(d, sb)) };
+      if (node.b != 0)
+        level.push_back(node);
+      left -= node.n;
+    }
+  }
+
+  while (!level.empty()) {
+    size_t k = 0;
+    ids.clear();
+    for (size_t i = 0; i < level.size(); i++) {
+      fsck_map &m = maps[level[i].owner];
+      if (!check_block(st, m.inum, &m.ino, level[i].b, confirm)) {
+        m.sound = false;
+        continue;
+      }
+      m.nmeta++;
+      ids.push_back(level[i].b);
+      level[k++] = level[i];
+    }
+    level.resize(k);
+    if (ids.empty())
+      break;
+    buf.resize(ids.size() << sb.block_shift);
+    bm->read_blocks(&ids[0], ids.size(), &buf[0]);
+    for (size_t i = 0; i < level.size(); i++) {
+      const blockid_t *p = (const blockid_t *)&buf[i << sb.block_shift];
+      fsck_map &m = maps[level[i].owner];
+      if (m.ino.flags & INODE_EXTENTS) {
+        const struct ext_header *h = (const struct ext_header *)p;
+        const ext_entry *e = (const ext_entry *)(h + 1);
+        if (h->entries == 0 || e[0].lblk != level[i].n)
+          m.sound = false;
+        else
+          check_extents(st, m, level[i].owner, h, level[i].depth, next, confirm);
+        continue;
+      }
+      uint64_t span = MAPSPAN(level[i].depth - 1, sb);
+      uint64_t left = level[i].n;
+      for (uint32_t e = 0; left > 0; e++) {
+        fsck_node node = { p[e], level[i].owner, level[i].depth - 1,
+                           MIN(left, span) };
+        left -= node.n;
+        if (node.b == 0) {
+          continue;
+        } else if (node.depth > 0) {
+          next.push_back(node);
+        } else if (check_block(st, m.inum, &m.ino, node.b, confirm)) {
+          m.ids.push_back(node.b);
+        } else {
+          m.sound = false;
+        }
+      }
+    }
+    level.swap(next);
+    next.clear();
+  }
+
+  for (size_t j = 0; j < maps.size(); j++) {
+    fsck_map &m = maps[j];
+    bool extent = m.ino.flags & INODE_EXTENTS;
+    if (!confirm && m.nmeta + m.ids.size() > 0)
+      __sync_fetch_and_add(&st->r->blocks, m.nmeta + m.ids.size());
+    if (typed[j] && !m.sound && flagged(st, m.inum, &m.ino, confirm)) {
+      printf("\tfsck: inode %u: %s\n", m.inum,
+             extent ? "bad extent tree" : "block pointer out of range");
+      __sync_fetch_and_add(&st->r->bad_inodes, 1);
+    }
+  }
+}
+
+// Check a node of the extent tree of map m (maps[owner]), expected at
+// the given depth: its header, then each of its entries. A leaf's
+// extents must start past the blocks mapped so far, and their
+// blocks are claimed; an inner node's children go to next.
+void
+inode_manager::check_extents(fsck_state *st, fsck_map &m, uint32_t owner,
+                             const struct ext_header *node, int depth,
+                             std::vector<fsck_node> &next, bool confirm)
+{
+  superblock_t &sb = bm->sb;
+  const ext_entry *e = (const ext_entry *)(node + 1);
+  bool root = (const void *)node == (const void *)m.ino.blocks;
+  uint64_t n = NBLOCKS(m.ino.size, sb);
+
+  if (node->magic != EXT_MAGIC || node->depth != depth
+      || depth > EXT_MAX_DEPTH || node->entries > node->max
+      || node->max != (root ? EXT_ROOT_MAX : EXT_NODE_MAX(sb))) {
+    m.sound = false;
+    return;
+  }
+  for (uint32_t i = 0; i < node->entries; i++) {
+    if (i > 0 && e[i].lblk <= e[i - 1].lblk) {
+      m.sound = false;
+      return;
+    }
+    if (depth > 0) {
+      fsck_node child = { e[i].pblk, owner, depth - 1, e[i].lblk };
+      next.push_back(child);
+      continue;
+    }
+    if (e[i].lblk < m.mapped || e[i].len == 0 || e[i].lblk >= n
+        || e[i].len > n - e[i].lblk) {
+      m.sound = false;
+      return;
+    }
+    for (uint32_t k = 0; k < e[i].len; k++) {
+      if (check_block(st, m.inum, &m.ino, e[i].pblk + k, confirm))
+        m.ids.push_back(e[i].pblk + k);
+      else
+        m.sound = false;
+    }
+    m.mapped = e[i].lblk + e[i].len;
+  }
+}
+
+// Check the type, flags and size of inode m.inum, and its direct
+// blocks if it has a block map. Inline contents hold no block.
+// Returns whether its block map is worth walking.
+bool
+inode_manager::check_inode(fsck_state *st, fsck_map &m, bool confirm)
+{
+  superblock_t &sb = bm->sb;
+  const struct inode *ino = &m.ino;
+  uint64_t n = NBLOCKS(ino->size, sb);
+
+  m.sound = true;
+  m.nmeta = 0;
+  m.mapped = 0;
+  m.ids.clear();
+  if (!confirm) {
+    st->types[m.inum] = ino->type;
+    __sync_fetch_and_add(&st->r->inodes, 1);
+    if (ino->type == extent_protocol::T_DIR)
+      __sync_fetch_and_add(&st->r->dirs, 1);
+  }
+  if ((ino->type != extent_protocol::T_DIR
+       && ino->type != extent_protocol::T_FILE
+       && ino->type != extent_protocol::T_SYMLINK) || n > MAXFILE(sb)
+      || (ino->flags & ~(INODE_EXTENTS | INODE_INLINE)) != 0
+      || ((ino->flags & INODE_INLINE)
+          && ((ino->flags & INODE_EXTENTS) || ino->size > INLINE_MAX))) {
+    if (flagged(st, m.inum, ino, confirm)) {
+      printf("\tfsck: inode %u: bad type %d or size %llu\n",
+             m.inum, ino->type, (unsigned long long)ino->size);
+      __sync_fetch_and_add(&st->r->bad_inodes, 1);
+    }
+    m.sound = false;
+    return false;
+  }
+  if (ino->flags & (INODE_EXTENTS | INODE_INLINE))
+    return true;
+  for (uint64_t i = 0; i < MIN(n, NDIRECT); i++) {
+    if (ino->blocks[i] == 0)
+      continue;
+    if (check_block(st, m.inum, ino, ino->blocks[i], confirm))
+      m.ids.push_back(ino->blocks[i]);
+    else
+      m.sound = false;
+  }
+  return true;
+}
+
+// Check block b that inode inum holds, and claim it for the inode.
+// Returns false if b is not a data block.
+bool
+inode_manager::check_block(fsck_state *st, uint32_t inum,
+                           const struct inode *ino, blockid_t b, bool confirm)
+{
+  superblock_t &sb = bm->sb;
+  uint64_t bit = 1ULL << (b % 64);
+
+  if (b < sb.data_start || b >= sb.nblocks)
+    return false;
+  if (st->flags & FSCK_ONLINE) {
+    if (!bm->in_use(b) && flagged(st, inum, ino, confirm)) {
+      printf("\tfsck: inode %u: block %u is free\n", inum, b);
+      __sync_fetch_and_add(&st->r->lost_blocks, 1);
+    }
+    return true;
+  }
+  if (__sync_fetch_and_or(&st->claimed[b / 64], bit) & bit) {
+    printf("\tfsck: inode %u: block %u is held twice\n", inum, b);
+    __sync_fetch_and_add(&st->r->dup_blocks, 1);
+  } else if (st->owned[b / 64] & bit) {
+    printf("\tfsck: inode %u: block %u belongs to a snapshot\n", inum, b);
+    __sync_fetch_and_add(&st->r->dup_blocks, 1);
+  }
+  return true;
+}
+
+// Whether a problem with inode inum, read as ino, is to be reported
+// now. Online, the first sighting only marks the inode to be read
+// again, since it may have been caught in the middle of a change.
+bool
+inode_manager::flagged(fsck_state *st, uint32_t inum, const struct inode *ino,
+                       bool confirm)
+{
+  if (confirm || !(st->flags & FSCK_ONLINE))
+    return true;
+  ScopedLock ml(&st->lock);
+  st->suspects.insert(std::make_pair(inum, *ino));
+  return false;
+}
+
+// A directory holds "name:inum;" entries, as yfs_client writes them.
+void
+inode_manager::check_dir(fsck_state *st, uint32_t inum, const char *data,
+                         uint32_t size)
+{
+  uint32_t pos = 0;
+
+  while (pos < size) {
+    const char *start = data + pos;
+    const char *semi = (const char *)memchr(start, ';', size - pos);
+    const char *colon = (const char *)memchr(start, ':',
+                                             (semi ? semi : data + size) - start);
+    unsigned long ent = 0;
+    const char *c;
+
+    if (semi == NULL || colon == NULL || colon == start || colon + 1 == semi) {
+      printf("\tfsck: directory %u: bad entry at offset %u\n", inum, pos);
+      __sync_fetch_and_add(&st->r->bad_entries, 1);
+      if (semi == NULL)
+        return;
+      pos = semi - data + 1;
+      continue;
+    }
+    for (c = colon + 1; c < semi && *c >= '0' && *c <= '9'; c++)
+      ent = MIN(ent * 10 + (*c - '0'), 0xffffffffUL);
+    if (c != semi || ent == 0 || ent > bm->sb.ninodes) {
+      printf("\tfsck: directory %u: entry %.*s names no inode\n",
+             inum, (int)(colon - start), start);
+      __sync_fetch_and_add(&st->r->bad_entries, 1);
+    } else {
+      __sync_fetch_and_add(&st->links[ent], 1);
+    }
+    pos = semi - data + 1;
+  }
+}
+
+// Compare the bitmap with the blocks the inodes hold, a word at a
+// time. Blocks before data_start and the snapshots' blocks are never
+// set in it. With FSCK_REPAIR each difference is fixed through the
+// allocator, so its own map and the journal follow.
+void
+inode_manager::check_bitmap(fsck_state *st)
+{
+  superblock_t &sb = bm->sb;
+  size_t nwords = st->claimed.size(), wpb = sb.block_size / 8;
+  std::vector<blockid_t> lost, leaked;
+
+  for (blockid_t bnum = sb.bmap_start; bnum < sb.imap_start; bnum++) {
+    const char *block = bm->get_block(bnum);
+    size_t w0 = (size_t)(bnum - sb.bmap_start) * wpb;
+    for (size_t w = w0; w < w0 + wpb && w < nwords; w++) {
+      uint64_t disk, held = st->claimed[w];
+      memcpy(&disk, block + (w - w0) * 8, sizeof(disk));
+      uint64_t diff = (held & ~disk) | (disk & ~held & ~st->owned[w]);
+      for (int bit = 0; diff != 0 && bit < 64; bit++) {
+        blockid_t b = w * 64 + bit;
+        if (!(diff & (1ULL << bit)) || b < sb.data_start || b >= sb.nblocks)
+          continue;
+        if (held & (1ULL << bit))
+          lost.push_back(b);
+        else
+          leaked.push_back(b);
+      }
+    }
+    bm->put_block(bnum);
+  }
+
+  for (size_t i = 0; i < lost.size(); i++)
+    printf("\tfsck: block %u is in use but free in the bitmap\n", lost[i]);
+  for (size_t i = 0; i < leaked.size(); i++)
+    printf("\tfsck: block %u is in the bitmap but not in use\n", leaked[i]);
+  st->r->lost_blocks += lost.size();
+  st->r->leaked_blocks += leaked.size();
+  if (!(st->flags & FSCK_REPAIR))
+    return;
+  for (size_t i = 0; i < lost.size(); i++) {
+    bm->begin_op(1);
+    bm->set_used(lost[i]);
+    bm->end_op();
+  }
+  for (size_t i = 0; i < leaked.size(); i++) {
+    bm->begin_op(1);
+    bm->free_block(leaked[i]);
+    bm->end_op();
+  }
+  st->r->repaired += lost.size() + leaked.size();
+}
+
+// Compare the inode bitmap with the inodes in use. With FSCK_REPAIR
+// each wrong bit is fixed, in memory too.
+void
+inode_manager::check_imap(fsck_state *st)
+{
+  superblock_t &sb = bm->sb;
+  std::vector<uint32_t> wrong;
+
+  for (uint32_t inum = 1; inum <= sb.ninodes; ) {
+    blockid_t bnum = IMBLOCK(inum, sb);
+    const char *block = bm->get_block(bnum);
+    for (; inum <= sb.ninodes && IMBLOCK(inum, sb) == bnum; inum++) {
+      uint32_t off = inum & (BPB(sb) - 1);
+      bool set = (block[off / 8] >> (off % 8)) & 1;
+      if (set != (st->types[inum] != 0))
+        wrong.push_back(inum);
+    }
+    bm->put_block(bnum);
+  }
+
+  for (size_t i = 0; i < wrong.size(); i++) {
+    bool inuse = st->types[wrong[i]] != 0;
+    printf("\tfsck: inode %u is %s but %s in the inode bitmap\n", wrong[i],
+           inuse ? "in use" : "free", inuse ? "free" : "in use");
+  }
+  st->r->imap_errors += wrong.size();
+  if (!(st->flags & FSCK_REPAIR))
+    return;
+  for (size_t i = 0; i < wrong.size(); i++) {
+    bm->begin_op(1);
+    {
+      ScopedLock ml(&ialloc_lock);
+      set_imap(wrong[i], st->types[wrong[i]] != 0);
+    }
+    bm->end_op();
+  }
+  st->r->repaired += wrong.size();
+}
+
+// Read again the inodes a scrub found fault with, and report the
+// problems of those that have not changed since. No operation runs
+// meanwhile, so none is caught halfway, such as a removal that has
+// freed the blocks but not yet the inode.
+void
+inode_manager::recheck(fsck_state *st)
+{
+  superblock_t &sb = bm->sb;
+  std::vector<fsck_map> maps;
+  std::map<uint32_t, struct inode>::iterator it;
+
+  if (st->suspects.empty())
+    return;
+  bm->quiesce();
+  for (it = st->suspects.begin(); it != st->suspects.end(); ++it) {
+    blockid_t bnum = IBLOCK(it->first, sb);
+    struct inode cur = *((const struct inode *)bm->get_block(bnum)
+                         + IOFF(it->first, sb));
+    bm->put_block(bnum);
+    if (!same_inode(&cur, &it->second))
+      continue;
+    maps.push_back(fsck_map());
+    maps.back().inum = it->first;
+    maps.back().ino = cur;
+  }
+  check_inodes(st, maps, true);
+  bm->resume();
+}
@@ -4,92 +4,857 @@
 #define inode_h
 
 #include <stdint.h>
+#include <sys/uio.h>
+#include <map>
+#include <set>
+#include <vector>
+#include <pthread.h>
 #include "extent_protocol.h" // TODO: delete it
+#include "slock.h"
 
-#define DISK_SIZE  1024*1024*16
-#define BLOCK_SIZE 512
-#define BLOCK_NUM  (DISK_SIZE/BLOCK_SIZE)
+// Geometry used when formatting; an existing image keeps the geometry
+// in its superblock. Each default can be overridden from the
+// environment at format time (sizes accept a K, M or G suffix).
+#define DEFAULT_DISK_SIZE  1024*1024*16
+#define DEFAULT_BLOCK_SIZE 512
+#define DEFAULT_INODE_NUM  1024
+#define DISK_SIZE_ENV  "YFS_DISK_SIZE"
+#define BLOCK_SIZE_ENV "YFS_BLOCK_SIZE"
+#define INODE_NUM_ENV  "YFS_INODE_NUM"
+// Blocks of metadata the journal holds between checkpoints, by default
+// a 64th of the disk up to DEFAULT_LOG_BLOCKS; 0 formats a disk
+// without a journal.
+#define DEFAULT_LOG_BLOCKS 1024
+#define LOG_BLOCKS_ENV "YFS_LOG_BLOCKS"
+
+// Block sizes are powers of two in this range.
+#define MIN_BLOCK_SIZE 512
+#define MAX_BLOCK_SIZE 65536
+
+// Path of the disk image, taken from the environment at startup.
+// Without it the disk lives in anonymous memory and is lost on exit.
+#define DISK_IMAGE_ENV "YFS_DISK_IMAGE"
+// "aio" selects the asynchronous backend (needs an image or device),
+// "sparse" an in-memory disk that only allocates blocks once written.
+#define DISK_BACKEND_ENV "YFS_DISK_BACKEND"
+// Queue depth of the asynchronous backend.
+#define DISK_QDEPTH_ENV "YFS_DISK_QDEPTH"
+#define DISK_QDEPTH 32
+// Blocks kept in the block cache.
+#define CACHE_BLOCKS_ENV "YFS_CACHE_BLOCKS"
+#define CACHE_BLOCKS 1024
+// Inodes kept in the inode cache.
+#define ICACHE_INODES_ENV "YFS_ICACHE_INODES"
+#define ICACHE_INODES 4096
+// How new inodes map their blocks: "extents" (the default) or
+// "blocks" for the block map. Inodes keep the format they were made
+// with, so a filesystem can hold both.
+#define INODE_FORMAT_ENV "YFS_INODE_FORMAT"
+// Seconds between background write-backs of dirty cached blocks (and
+// of the access times held in the inode cache, and of file data whose
+// allocation is delayed).
+#define WRITEBACK_INTERVAL 5
+// File blocks whose allocation is delayed, over all files, before a
+// writer writes its file back at once; 0 writes all data back as it
+// is written.
+#define DELAY_BLOCKS_ENV "YFS_DELAY_BLOCKS"
+#define DELAY_BLOCKS 8192
+// Read-ahead window, in blocks, and the number of sequential streams
+// followed at once.
+#define RA_MIN_WINDOW 4
+#define RA_MAX_WINDOW 64
+#define RA_STREAMS 8
 
 typedef uint32_t blockid_t;
 
 // disk layer -----------------------------------------
 
+// Interface of a block device. read_block/write_block are synchronous;
+// submit_* start a request and return a tag that wait() completes.
+// A backend without real asynchrony finishes requests at submit time.
+// The *v calls move a contiguous run of blocks starting at start,
+// scattered over iovecs that together cover whole blocks. Any call
+// may come from several threads at once (the cache, the journal and
+// the snapshots each reach the device under their own locks); a
+// backend with state of its own serializes the calls itself.
 class disk {
+ protected:
+  uint32_t bsize;
+  blockid_t nblocks;
+
+ public:
+  disk(uint32_t bsize, blockid_t nblocks) : bsize(bsize), nblocks(nblocks) {}
+  virtual ~disk() {}
+  virtual void read_block(blockid_t id, char *buf) = 0;
+  virtual void write_block(blockid_t id, const char *buf) = 0;
+  virtual void readv_blocks(blockid_t start, const struct iovec *iov, int iovcnt);
+  virtual void writev_blocks(blockid_t start, const struct iovec *iov, int iovcnt);
+  virtual void flush() {}
+
+  virtual int submit_read(blockid_t id, char *buf);
+  virtual int submit_write(blockid_t id, const char *buf);
+  virtual int submit_readv(blockid_t start, const struct iovec *iov, int iovcnt);
+  virtual int submit_writev(blockid_t start, const struct iovec *iov, int iovcnt);
+  virtual void wait(int tag) {}
+  virtual void drain() {}
+};
+
+// The blocks are mmap'd, either from the image file or anonymously,
+// so startup never touches (or zeroes) the whole device.
+class mmap_disk : public disk {
  private:
-  unsigned char blocks[BLOCK_NUM][BLOCK_SIZE];
+  unsigned char *blocks;
+  int fd;
 
  public:
-  disk();
-  void read_block(uint32_t id, char *buf);
-  void write_block(uint32_t id, const char *buf);
+  mmap_disk(const char *image, uint32_t bsize, blockid_t nblocks);
+  ~mmap_disk();
+  void read_block(blockid_t id, char *buf);
+  void write_block(blockid_t id, const char *buf);
+  void readv_blocks(blockid_t start, const struct iovec *iov, int iovcnt);
+  void writev_blocks(blockid_t start, const struct iovec *iov, int iovcnt);
+  void flush();
+};
+
+// An in-memory disk allocated lazily through a two-level page table of
+// chunks. Unwritten blocks read back as zeros without allocating, so
+// memory tracks the blocks written rather than the disk size.
+class sparse_disk : public disk {
+ private:
+  enum { CHUNK_SIZE = 64*1024, L2_ENTRIES = 1024 };
+  char ***dir;          // dir[l1][l2] -> chunk of CHUNK_SIZE bytes
+  uint32_t ndir;
+  pthread_mutex_t lock;
+
+  char *chunk(blockid_t id, bool alloc);
+
+ public:
+  sparse_disk(uint32_t bsize, blockid_t nblocks);
+  ~sparse_disk();
+  void read_block(blockid_t id, char *buf);
+  void write_block(blockid_t id, const char *buf);
+};
+
+// A regular file or loop device driven through POSIX AIO, keeping up
+// to qdepth requests in flight. Submitting into a full queue first
+// completes the oldest request. A run that lands in one buffer is a
+// single request; scattered runs fall back to preadv/pwritev. The
+// slots are guarded by lock, which every call holds throughout, so a
+// request is reaped and its slot handed out by one thread at a time.
+class aio_disk : public disk {
+ private:
+  struct aio_slot;
+  int fd;
+  int qdepth;
+  int next_tag;
+  struct aio_slot *slots;
+  pthread_mutex_t lock;
+
+  void reap(struct aio_slot *s);
+  struct aio_slot *get_slot();
+  void drain_locked();
+  void sync_io(blockid_t start, const struct iovec *iov, int iovcnt,
+               bool write);
+  int submit(blockid_t start, const struct iovec *iov, int iovcnt, bool write);
+
+ public:
+  aio_disk(const char *image, uint32_t bsize, blockid_t nblocks, int qdepth);
+  ~aio_disk();
+  void read_block(blockid_t id, char *buf);
+  void write_block(blockid_t id, const char *buf);
+  void readv_blocks(blockid_t start, const struct iovec *iov, int iovcnt);
+  void writev_blocks(blockid_t start, const struct iovec *iov, int iovcnt);
+  void flush();
+
+  int submit_read(blockid_t id, char *buf);
+  int submit_write(blockid_t id, const char *buf);
+  int submit_readv(blockid_t start, const struct iovec *iov, int iovcnt);
+  int submit_writev(blockid_t start, const struct iovec *iov, int iovcnt);
+  void wait(int tag);
+  void drain();
 };
 
 // block layer -----------------------------------------
 
+#define FS_MAGIC 0x79667335   // "yfs5"
+
+// Lives in block 0, so it can be found before the block size is known.
 typedef struct superblock {
-  uint32_t size;
+  uint32_t magic;
+  uint32_t block_size;
+  uint32_t block_shift;   // log2(block_size)
   uint32_t nblocks;
   uint32_t ninodes;
+  uint32_t bmap_start;    // first block of the free block bitmap
+  uint32_t imap_start;    // first block of the inode bitmap
+  uint32_t inode_start;   // first block of the inode table
+  uint32_t data_start;    // first allocatable block
+  uint64_t size;
+  uint32_t alloc_hint;    // unused; allocation groups keep their own hints
+  uint32_t log_start;     // first block of the journal
+  uint32_t log_slots;     // blocks the journal can log, 0 if none
+  uint32_t snap_dir;      // snapshot directory block, 0 if none
 } superblock_t;
 
+// Whether sb lays out a filesystem this code can mount; says what is
+// wrong if not.
+bool check_superblock(const superblock_t &sb);
+
+// Everything that depends on the geometry is a shift or mask of the
+// superblock fields, so a runtime block size costs no divisions.
+
+// Blocks needed to hold n bytes
+#define NBLOCKS(n, sb)    (((uint64_t)(n) + (sb).block_size - 1) >> (sb).block_shift)
+
+// Bitmap bits per block
+#define BPB(sb)           ((sb).block_size*8)
+
+// Block containing bit for block b
+#define BBLOCK(b, sb)     ((sb).bmap_start + ((b) >> ((sb).block_shift + 3)))
+
+// Block of the inode bitmap containing the bit for inode i
+#define IMBLOCK(i, sb)    ((sb).imap_start + ((i) >> ((sb).block_shift + 3)))
+
+// The journal starts with a header of LOG_HDR_BLOCKS(sb) blocks: the
+// number of logged blocks, then the home block of each, in log order.
+// The logged copies follow in as many slots.
+#define LOG_HDR_BLOCKS(sb) \
+  ((4 * ((uint64_t)(sb).log_slots + 1) + (sb).block_size - 1) >> (sb).block_shift)
+#define LOG_SLOT(i, sb)   ((sb).log_start + LOG_HDR_BLOCKS(sb) + (i))
+
+// Log space reserved by an operation that does not say otherwise.
+#define MAXOPBLOCKS 16
+
+// Snapshots kept at once.
+#define MAX_SNAPSHOTS 16
+
+// A run of contiguous blocks.
+typedef struct block_run {
+  blockid_t start;
+  uint32_t len;
+} block_run_t;
+
 class block_manager {
  private:
+  // A frame of the write-back block cache. A cached block is always
+  // read and written through its frame, which is newer than the disk
+  // while dirty. Unpinned frames are recycled in CLOCK order, a dirty
+  // one being written back first; if every frame is pinned the cache
+  // grows past its bound rather than fail.
+  struct frame {
+    blockid_t id;
+    char *data;
+    int refs;           // pins; a pinned frame is never evicted
+    bool dirty;
+    bool referenced;    // CLOCK bit, set on every hit
+    int io_tag;         // read-ahead still in flight, 0 if none
+    bool logged;        // in the journal: pinned until checkpointed
+  };
+  // A sequential reader: reads that start where the last one ended
+  // grow the window and prefetch that many blocks past the read into
+  // the cache; prefetched blocks that are gone by the time they are
+  // read shrink it.
+  struct ra_stream {
+    blockid_t next;     // block after the last one read
+    blockid_t ahead;    // prefetched up to here
+    uint32_t window;
+    uint32_t used;      // last use, to recycle the oldest stream
+  };
   disk *d;
   std::map <uint32_t, int> using_blocks;
+  std::vector<struct frame> frames;
+  std::map<blockid_t, uint32_t> cached;   // block -> frame
+  uint32_t cache_size;
+  uint32_t hand;
+  uint64_t hits, misses;
+  struct ra_stream streams[RA_STREAMS];
+  uint32_t ra_clock;
+  // In-memory copy of the free block bitmap, one bit per block (set =
+  // in use), scanned a 64-bit word at a time. Reserved blocks and the
+  // tail past nblocks are marked in use here but not on disk.
+  std::vector<uint64_t> used;
+
+  // The disk is split into allocation groups, one per bitmap block, so
+  // a group's bits, bitmap block and free extents belong to it alone.
+  // Each thread allocates from its own group under that group's lock
+  // and steals from the others only when its own runs dry.
+  struct alloc_group {
+    pthread_mutex_t lock;
+    blockid_t start, end;     // blocks [start, end)
+    blockid_t hint;           // where the next block search starts
+    uint32_t nfree;
+    // free extents by start (-> length) and by size, so a run of n
+    // blocks is a best-fit lookup
+    std::map<blockid_t, uint32_t> free_by_start;
+    std::set<std::pair<uint32_t, blockid_t> > free_by_size;
+  };
+  std::vector<alloc_group *> groups;
+  // Free blocks that are not promised: those in the groups' free
+  // extents, less the ones set aside by reserve_blocks. Every
+  // allocation takes its blocks out of spare first, unless they were
+  // reserved, so none can take blocks promised to another. Changed
+  // atomically, under no lock.
+  int64_t spare;
+  pthread_mutex_t cache_lock;
+
+  // Metadata journal. Blocks dirtied inside begin_op/end_op join the
+  // running transaction and stay pinned in the cache. The transaction
+  // is committed at the next writeback or flush, or when the log runs
+  // short, between operations; so all the operations since the last
+  // commit share one log write and flush. A checkpoint later writes
+  // the logged blocks home and empties the log. Blocks freed by an
+  // operation are reused once the free is committed, or after the
+  // checkpoint if the log holds a copy of them, so a replay never
+  // lands on top of newer data.
+  pthread_mutex_t log_lock;
+  pthread_cond_t log_cond;
+  int outstanding;                  // operations running
+  uint32_t reserved;                // log blocks they may still dirty
+  bool committing;
+  std::set<blockid_t> txn;          // running transaction (cache_lock)
+  std::vector<blockid_t> log_index; // committed: home of each slot
+  pthread_mutex_t pending_lock;
+  std::vector<block_run_t> pending_frees;
+
+  void replay_log();
+  bool log_fits(uint32_t n);
+  void commit_locked();
+  void checkpoint_locked();
+  bool release_frees(bool all);
+  void return_blocks(blockid_t start, uint32_t len);
+  void log_frame(struct frame &fr);
+  void write_frames(std::vector<std::pair<blockid_t, uint32_t> > &dirty);
+  void writeback(bool checkpoint);
+  void write_back_frames();
+
+  // Snapshots. Taking one flushes everything and copies the bitmap;
+  // nothing else is copied until a block that was in use at the time
+  // is first about to change, when its old contents move to a block
+  // of the snapshot's own (copy-out on write). Until then the block is
+  // shared between the live filesystem and every snapshot that has
+  // not copied it. A snapshot's blocks are recorded in its tables, not
+  // in the bitmap, and are marked in use in memory at mount.
+  struct snap {
+    uint32_t id;
+    uint32_t ctime;
+    blockid_t bmap;                       // copy of the bitmap
+    blockid_t table, tail;                // chain of (home, copy) blocks
+    std::vector<char> tail_buf;           // contents of tail
+    bool tail_dirty;
+    std::vector<uint64_t> used;           // its bitmap, in memory
+    std::map<blockid_t, blockid_t> copies;
+  };
+  std::vector<snap *> snaps;          // oldest first
+  uint32_t nsnaps;                        // snaps.size(), read unlocked
+  uint32_t snap_next;                     // id of the next snapshot
+  pthread_mutex_t snap_lock;
+  bool readonly;
+
+  void cow(const blockid_t *ids, uint32_t n);
+  void snap_record(snap *s, blockid_t home, blockid_t copy);
+  void write_snap_dir();
+  void load_snapshots();
+  blockid_t claim_blocks(uint32_t n);
+  void forget_blocks(blockid_t start, uint32_t n);
+
+  void setup();
+  static void *writeback_thread(void *arg);
+  void (*wb_hook)(void *);
+  void *wb_arg;
+  uint32_t lookup(blockid_t id, bool load);
+  uint32_t victim();
+  void settle(struct frame &fr);
+  void readahead(const blockid_t *ids, uint32_t n, uint32_t cached_hits);
+  char *pin_block(blockid_t id);
+  void load_bitmap();
+  void mark_reserved(std::vector<uint64_t> &bits);
+  uint32_t my_group();
+  alloc_group *group_of(blockid_t id) { return groups[id / BPB(sb)]; }
+  blockid_t group_alloc_block(alloc_group *g);
+  uint32_t group_alloc_blocks(alloc_group *g, uint32_t n, blockid_t goal,
+                              std::vector<block_run_t> &runs);
+  void set_bitmap_run(blockid_t start, uint32_t len, bool inuse);
+  void add_free_extent(alloc_group *g, blockid_t start, uint32_t len);
+  void take_free_extent(alloc_group *g, blockid_t start, uint32_t len);
+  bool take_spare(uint64_t n);
+  uint32_t rw_blocks(const blockid_t *ids, uint32_t n,
+                     const struct iovec *iov, int iovcnt, bool write);
  public:
   block_manager();
+  // A read-only manager of a filesystem already on dev.
+  block_manager(disk *dev);
+  ~block_manager();
   struct superblock sb;
+  bool formatted;   // false if an existing image was reused
+
+  // Commit and checkpoint the journal, write back every dirty cached
+  // block and flush the device.
+  void flush();
+  // Write back every WRITEBACK_INTERVAL seconds from now on. Each time,
+  // hook(arg) first lets the layer above move into the cache what it
+  // holds in memory, so that it goes out with the rest.
+  void start_writeback(void (*hook)(void *), void *arg);
+  // Bracket every operation that changes metadata. n bounds the
+  // blocks it dirties; operations may nest.
+  void begin_op(uint32_t n = MAXOPBLOCKS);
+  void end_op();
+  // Wait for the running operations to end and hold off new ones
+  // until resume, so that nothing is seen half changed.
+  void quiesce();
+  void resume();
+  void cache_stats(uint64_t *hits, uint64_t *misses);
+
+  // Freeze the filesystem as it is now; returns the snapshot's id, or
+  // -1 if no more snapshots fit or there is no space for one.
+  int snapshot();
+  // Free a snapshot's blocks; false if there is no such snapshot.
+  bool delete_snapshot(uint32_t sid);
+  bool has_snapshot(uint32_t id);
+  // Block id as it was when snapshot sid was taken.
+  void read_snapshot_block(uint32_t sid, blockid_t id, char *buf);
+
+  // For fsck: set the bit of every block a snapshot owns; whether the
+  // allocator has a block in use; and mark in use a block the bitmap
+  // wrongly has free, which is only safe on a quiescent filesystem.
+  void snapshot_blocks(std::vector<uint64_t> &bits);
+  bool in_use(blockid_t id);
+  void set_used(blockid_t id);
 
   uint32_t alloc_block();
   void free_block(uint32_t id);
+  // Allocate n blocks as a few contiguous runs, appended to runs.
+  // Starts at goal if it is free (to extend a file in place), else
+  // takes the smallest free extent that fits, else the largest ones,
+  // trying the goal's group, then the caller's, then the rest.
+  // Returns false, allocating nothing, if fewer than n blocks are free
+  // beside those reserved; with reserved set the n blocks come out of
+  // the caller's reservation instead, and are spent either way.
+  bool alloc_blocks(uint32_t n, std::vector<block_run_t> &runs,
+                    blockid_t goal = 0, bool reserved = false);
+  void free_blocks(blockid_t start, uint32_t len);
+  // Set aside n free blocks for later alloc_blocks(..., true) calls,
+  // so that no other allocation can take them; false, setting aside
+  // nothing, if fewer than n are free and not reserved already.
+  // unreserve_blocks hands back blocks that will not be allocated.
+  bool reserve_blocks(uint64_t n);
+  void unreserve_blocks(uint64_t n);
   void read_block(uint32_t id, char *buf);
   void write_block(uint32_t id, const char *buf);
+
+  // Zero-copy access: pin the block's cache frame and work on it in
+  // place. Every get_block/get_block_rw is matched by a put_block; a
+  // writer calls mark_dirty before putting the block back.
+  const char *get_block(uint32_t id);
+  char *get_block_rw(uint32_t id);
+  void mark_dirty(uint32_t id);
+  void put_block(uint32_t id);
+
+  // Vectored access to n blocks in the order given, gathered from or
+  // scattered into iov (or one flat buffer of n blocks). Cached blocks
+  // are served from their frames; runs of consecutive uncached ids
+  // become single device requests and are not cached. Sequential
+  // reads also prefetch the blocks that follow them into the cache.
+  void read_blocks(const blockid_t *ids, uint32_t n,
+                   const struct iovec *iov, int iovcnt);
+  void write_blocks(const blockid_t *ids, uint32_t n,
+                    const struct iovec *iov, int iovcnt);
+  void read_blocks(const blockid_t *ids, uint32_t n, char *buf);
+  void write_blocks(const blockid_t *ids, uint32_t n, const char *buf);
+
+  // Asynchronous reads: keep many blocks in flight, then complete them.
+  int submit_read_block(uint32_t id, char *buf);
+  void complete_block(int tag);
+  void complete_blocks();
 };
 
-// inode layer -----------------------------------------
+// The disk as it was when a snapshot was taken. Writes, which only
+// a read-only mount's access times make, are dropped.
+class snapshot_disk : public disk {
+ private:
+  block_manager *bm;
+  uint32_t sid;
 
-#define INODE_NUM  1024
+ public:
+  snapshot_disk(block_manager *bm, uint32_t sid)
+    : disk(bm->sb.block_size, bm->sb.nblocks), bm(bm), sid(sid) {}
+  void read_block(blockid_t id, char *buf) { bm->read_snapshot_block(sid, id, buf); }
+  void write_block(blockid_t id, const char *buf) {}
+};
 
-// Inodes per block.
-#define IPB           1
-//(BLOCK_SIZE / sizeof(struct inode))
+// inode layer -----------------------------------------
 
-// Block containing inode i
-#define IBLOCK(i, nblocks)     ((nblocks)/BPB + (i)/IPB + 1)            //modified
+// Inodes are packed 1 << INODE_SHIFT bytes apart, so a block holds a
+// power of two of them and finding one is a shift and a mask.
+#define INODE_SHIFT 7
 
-// Bitmap bits per block
-#define BPB           (BLOCK_SIZE*8)
+// Inodes per block.
+#define IPB(sb)           (1U << ((sb).block_shift - INODE_SHIFT))
 
-// Block containing bit for block b
-#define BBLOCK(b) ((b)/BPB + 2)
+// Block containing inode i, and its slot in that block
+#define IBLOCK(i, sb)     ((sb).inode_start + ((i) >> ((sb).block_shift - INODE_SHIFT)))
+#define IOFF(i, sb)       ((i) & (IPB(sb) - 1))
 
-#define NDIRECT 100
-#define NINDIRECT (BLOCK_SIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+// The block map: NDIRECT direct block addresses, then a single, a
+// double and a triple indirect block. A mapping block holds
+// NINDIRECT(sb) addresses, so a tree of depth d covers
+// MAPSPAN(d, sb) data blocks and a lookup reads at most three
+// mapping blocks, all through the block cache. An address of 0, at
+// any level, is a hole: no block is allocated for it, and it reads
+// as zeros. Addresses past the end of the file are always 0.
+#define NDIRECT 23
+#define NMAPTREES 3
+#define NINDIRECT(sb) ((sb).block_size / sizeof(blockid_t))
+#define NINDIRECT_SHIFT(sb) ((sb).block_shift - 2)
+#define MAPSPAN(d, sb) ((uint64_t)1 << ((d) * NINDIRECT_SHIFT(sb)))
+#define MAXFILE(sb) \
+  (NDIRECT + MAPSPAN(1, sb) + MAPSPAN(2, sb) + MAPSPAN(3, sb))
 
+// Exactly 1 << INODE_SHIFT bytes with no padding: the fields getattr
+// reads come first, in the same cache line as the first block
+// addresses.
 typedef struct inode {
-  short type;
-  unsigned int size;
-  unsigned int atime;
-  unsigned int mtime;
-  unsigned int ctime;
-  blockid_t blocks[NDIRECT+1];   // Data block addresses
+  uint16_t type;
+  uint16_t flags;
+  uint32_t mtime;
+  uint64_t size;
+  uint32_t atime;
+  uint32_t ctime;
+  blockid_t blocks[NDIRECT+NMAPTREES];   // Block map or extent tree
 } inode_t;
 
+// Inode flags. With INODE_EXTENTS, blocks holds the root of an
+// extent tree instead of the block map. With INODE_INLINE it holds the
+// contents themselves, which fit in INLINE_MAX bytes: a small file,
+// directory or symlink takes no data block, and reading it takes the
+// inode's block alone. Inodes start out inline and get a map of the
+// format new inodes get when they outgrow it.
+#define INODE_EXTENTS 1
+#define INODE_INLINE  2
+#define INLINE_MAX    (sizeof(((inode_t *)0)->blocks))
+
+// Extent tree. Each node, the root in the inode and the others a block
+// each, is a header and then entries sorted by logical block. A leaf
+// entry maps len blocks from lblk to as many consecutive blocks from
+// pblk; an index entry points at the child node (pblk) whose entries
+// start at lblk. Every leaf is at the same depth, and a file laid out
+// in a few contiguous runs needs a few entries, so mapping any range
+// of it is a descent of depth levels. Blocks no extent covers are
+// holes. New blocks go into the leaf over them, joining the extent
+// before or after where they continue it; a full node splits, the root
+// by moving its entries down into a new node, so a write changes the
+// nodes on one path and the ones it splits, however large the tree.
+// Truncation lays the tree out anew, packed.
+#define EXT_MAGIC 0xf30a
+#define EXT_MAX_DEPTH 5
+
+struct ext_header {
+  uint16_t magic;
+  uint16_t entries;
+  uint16_t max;
+  uint16_t depth;       // 0 in a leaf
+};
+
+struct ext_entry {
+  uint32_t lblk;
+  uint32_t pblk;        // first block, or the child node
+  uint32_t len;         // 0 in an index entry
+};
+
+#define EXT_ROOT_MAX \
+  ((sizeof(((inode_t *)0)->blocks) - sizeof(struct ext_header)) \
+   / sizeof(struct ext_entry))
+#define EXT_NODE_MAX(sb) \
+  (((sb).block_size - sizeof(struct ext_header)) / sizeof(struct ext_entry))
+
+// Consistency checks (fsck). The inode table is scanned by several
+// threads at once, FSCK_BATCH inode blocks to a read; the blocks each
+// inode holds and the entries of each directory are checked against
+// each other, then against the bitmaps. FSCK_REPAIR makes the bitmaps
+// match the blocks and inodes in use. FSCK_ONLINE scrubs a live filesystem at
+// low CPU and I/O priority: inodes that look wrong are read again and
+// reported only if unchanged, and the checks that need a quiescent
+// filesystem (directory contents, shared blocks, orphans, leaks) are
+// left out.
+#define FSCK_REPAIR 1
+#define FSCK_ONLINE 2
+#define FSCK_BATCH 64
+#define SCRUB_NICE 19
+
+struct fsck_report {
+  uint32_t inodes;        // in use
+  uint32_t dirs;
+  uint64_t blocks;        // data and indirect blocks they hold
+  uint32_t bad_inodes;    // bad type or size, or a bad block pointer
+  uint32_t dup_blocks;    // held twice, or also owned by a snapshot
+  uint32_t bad_entries;   // naming a free or out of range inode
+  uint32_t orphans;       // inodes in use that no directory names
+  uint32_t lost_blocks;   // held by an inode but free in the bitmap
+  uint32_t leaked_blocks; // in use in the bitmap but held by nothing
+  uint32_t imap_errors;   // inode bitmap bits that disagree with the table
+  uint32_t repaired;      // bitmap bits fixed
+
+  uint32_t problems() const {
+    return bad_inodes + dup_blocks + bad_entries + orphans
+      + lost_blocks + leaked_blocks + imap_errors;
+  }
+};
+
 class inode_manager {
  private:
+  struct fsck_state;
+  struct fsck_map;
+  struct fsck_node;
   block_manager *bm;
+  bool readonly;
+  bool extents;         // new inodes get an extent tree
+
+  // Inode cache: a copy of each inode in use that was read or written
+  // lately, so get_inode and getattr on a hot inode never reach the
+  // block layer. A change made inside an operation goes to the
+  // inode's block as well, so the journal keeps it atomic with the
+  // rest of the operation; only access times are left dirty here,
+  // and are written back a block at a time by sync_inodes. Clean
+  // entries are recycled in CLOCK order; if all are dirty the cache
+  // grows until the next sync.
+  struct icache_entry {
+    uint32_t inum;
+    struct inode ino;
+    bool dirty;         // access time newer than the block's
+    bool referenced;    // CLOCK bit, set on every hit
+  };
+  std::vector<struct icache_entry> icache;
+  std::map<uint32_t, uint32_t> icached;   // inum -> entry
+  uint32_t icache_size;
+  uint32_t ihand;
+  uint64_t ichanges;    // puts and drops, to spot a racing fill
+  pthread_mutex_t icache_lock;
+
+  // Inode allocation. The inode bitmap on disk has a bit per inode,
+  // set while it is in use, and is copied in memory at mount. The
+  // words of the copy with a clear bit are kept on a stack, lowest on
+  // top at first, so allocating and freeing an inode is O(1) and never
+  // reads the inode table. Inode 0 and the bits past ninodes are set.
+  std::vector<uint64_t> iused;
+  std::vector<uint32_t> ifree;      // words of iused with a clear bit
+  pthread_mutex_t ialloc_lock;
+
+  void load_imap();
+  void set_imap(uint32_t inum, bool inuse);
+
+  // Inode locks. An operation holds the lock of the inode it works on
+  // from start to end: shared if it only reads the inode, exclusive if
+  // it changes it. Operations on different inodes so run in parallel
+  // on the RPC dispatch threads, and those on one inode one writer at
+  // a time. A lock exists only while someone holds or waits for it.
+  //
+  // Lock order, outermost first:
+  //   1. one inode lock, never two: no operation spans two inodes;
+  //   2. the block layer's operation (bm->begin_op);
+  //   3. ialloc_lock or icache_lock, never both;
+  //   4. the block layer's own: log_lock, snap_lock, an allocation
+  //      group's lock, pending_lock, cache_lock;
+  //   5. the disk's own lock, if the backend has one. The block layer
+  //      calls the disk under any of its locks (the cache under
+  //      cache_lock, a commit under log_lock, a snapshot copy under
+  //      snap_lock), so the disk takes no other lock while holding it.
+  // An inode lock is never waited for inside an operation: a commit
+  // waits for the running operations to end, so an operation waiting
+  // for an inode held by a thread that waits in begin_op would
+  // deadlock. The allocators (ialloc_lock, the group locks) are taken
+  // for the pick alone, and never wait for an inode.
+  struct ilock {
+    pthread_rwlock_t rw;
+    uint32_t refs;      // holders and waiters
+  };
+  std::map<uint32_t, ilock *> ilocks;
+  pthread_mutex_t ilocks_lock;
+
+  // Delayed allocation. Data written to a hole of a regular file is
+  // held here, a block at a time, instead of getting a block at once;
+  // blocks already allocated are written in place. The write-back,
+  // before each periodic write-back of the block cache, on flush and
+  // snapshot, or once more than delay_max blocks are held, allocates
+  // each run of a file's delayed blocks in one request: a file written
+  // in full in between is laid out whole and contiguous, and one
+  // removed or truncated first never reaches the bitmap. Writers
+  // reserve in the block layer the blocks their delayed data will
+  // take and the mapping blocks it may need at worst, so no other
+  // allocation can take them and the write-back does not run out; a
+  // write-back that does all the same leaves the data delayed and
+  // fails the next flush. A delayed block is a hole on disk, and its
+  // bytes past the end of the file are zero. A file's blocks are
+  // guarded by its inode lock, the table and counts by delay_lock,
+  // which comes with ialloc_lock and icache_lock in the lock order
+  // and is never held with them.
+  struct delayed_file {
+    std::map<uint64_t, std::vector<char> > blocks;
+    uint64_t resv;          // reserved for them and their map
+  };
+  std::map<uint32_t, delayed_file> delayed;
+  uint64_t ndelayed;        // blocks held, over all files
+  uint64_t delay_max;
+  bool wb_failed;           // a write-back failed since the last flush
+  pthread_mutex_t delay_lock;
+
+  delayed_file *delayed_of(uint32_t inum);
+  uint64_t delay_need(uint32_t inum, uint64_t first,
+                      const std::vector<blockid_t> &ids);
+  bool delay_reserve(uint32_t inum, struct inode *ino, uint64_t n,
+                     uint64_t first, uint64_t count);
+  bool delay_over();
+  void store_blocks(uint32_t inum, uint64_t first,
+                    const std::vector<blockid_t> &ids, const char *data,
+                    uint64_t len);
+  void trim_delayed(uint32_t inum, uint64_t size, bool refill = false);
+  void read_file_blocks(uint32_t inum, uint64_t first, const blockid_t *ids,
+                        uint64_t n, char *buf);
+  bool write_back_locked(uint32_t inum);
+  bool write_back();
+
+  void lock_inode(uint32_t inum, bool excl);
+  void unlock_inode(uint32_t inum);
+  // Holds the lock of an inode for a scope, as ScopedLock does a mutex.
+  struct inode_lock {
+    inode_manager *im;
+    uint32_t inum;
+    inode_lock(inode_manager *im, uint32_t inum, bool excl)
+      : im(im), inum(inum) { im->lock_inode(inum, excl); }
+    ~inode_lock() { im->unlock_inode(inum); }
+  };
+
+  void setup();
+  static void writeback_hook(void *arg);
+  void sync_inodes();
+  uint32_t ivictim();
+  bool icache_get(uint32_t inum, struct inode *ino);
+  void icache_fill(uint32_t inum, const struct inode *ino, uint64_t seen);
+  void icache_put(uint32_t inum, const struct inode *ino);
+  void icache_drop(uint32_t inum);
+  void touch_inode(uint32_t inum, uint32_t atime);
+  bool read_inode(uint32_t inum, struct inode *ino);
   struct inode* get_inode(uint32_t inum);
   void put_inode(uint32_t inum, struct inode *ino);
+  uint32_t block_ids(const struct inode *ino, std::vector<blockid_t> &ids,
+                     std::vector<blockid_t> *meta = NULL);
+  uint32_t block_range(const struct inode *ino, uint64_t first, uint64_t n,
+                       std::vector<blockid_t> &ids,
+                       std::vector<blockid_t> *meta = NULL);
+  void map_read(blockid_t bnum, int depth, uint64_t first, uint64_t n,
+                std::vector<blockid_t> &ids, std::vector<blockid_t> *meta);
+  void map_range(struct inode *ino, uint64_t first, uint64_t n,
+                 const blockid_t *ids, const std::vector<blockid_t> &pool,
+                 size_t &used);
+  blockid_t map_set(blockid_t bnum, int depth, uint64_t first, uint64_t n,
+                    const blockid_t *ids, const std::vector<blockid_t> &pool,
+                    size_t &used);
+  void map_trim(blockid_t bnum, int depth, uint64_t keep, uint64_t n,
+                std::vector<blockid_t> &freed);
+  uint32_t fill_log(const struct inode *ino, uint64_t first,
+                    const std::vector<blockid_t> &ids);
+  bool fill_blocks(struct inode *ino, uint64_t first,
+                   std::vector<blockid_t> &ids, uint64_t *resv = NULL);
+  uint32_t trim_log(const struct inode *ino, uint64_t old_num,
+                    uint64_t new_num);
+  void trim_blocks(struct inode *ino, uint64_t old_num, uint64_t new_num);
+  void uninline(struct inode *ino);
+  void zero_tail(const struct inode *ino);
+  void read_data(const blockid_t *ids, uint64_t n, char *buf);
+  int truncate_locked(uint32_t inum, uint64_t size);
+  void ext_read(const struct ext_header *node, uint64_t first, uint64_t n,
+                std::vector<ext_entry> &ext, std::vector<blockid_t> *meta);
+  // An extent tree being changed in memory: the nodes read so far and
+  // the ones splits made, by block, the root (in the inode) as 0. New
+  // nodes are numbered from sb.nblocks on until they get blocks.
+  struct ext_change {
+    std::map<blockid_t, std::vector<char> > nodes;
+    std::set<blockid_t> dirty;
+    blockid_t next;       // number of the next new node
+  };
+  struct ext_header *ext_node(ext_change &c, blockid_t b);
+  blockid_t ext_new(ext_change &c, int depth);
+  void ext_insert(ext_change &c, const ext_entry &e);
+  void ext_put(ext_change &c, std::vector<blockid_t> &path,
+               std::vector<uint32_t> &at, size_t l, uint32_t pos,
+               const ext_entry &e);
+  void ext_fix_key(ext_change &c, const std::vector<blockid_t> &path,
+                   const std::vector<uint32_t> &at, size_t l);
+  void ext_commit(struct inode *ino, ext_change &c,
+                  const std::vector<blockid_t> &pool);
+  void ext_touch(const struct ext_header *node, uint64_t first, uint64_t n,
+                 std::vector<uint64_t> &touched);
+  uint64_t ext_new_nodes(const struct inode *ino, uint64_t first, uint64_t n,
+                         uint64_t k, uint64_t *touched);
+  void ext_write(struct inode *ino, const std::vector<ext_entry> &ext,
+                 const std::vector<blockid_t> &pool);
+  blockid_t ext_build(int depth, const ext_entry *ext, uint64_t n,
+                      const std::vector<blockid_t> &pool, size_t &used);
+  static void *check_thread(void *arg);
+  void check_batch(fsck_state *st, blockid_t first, uint32_t n);
+  void check_inodes(fsck_state *st, std::vector<fsck_map> &maps,
+                    bool confirm);
+  bool check_inode(fsck_state *st, fsck_map &m, bool confirm);
+  void check_extents(fsck_state *st, fsck_map &m, uint32_t owner,
+                     const struct ext_header *node, int depth,
+                     std::vector<fsck_node> &next, bool confirm);
+  bool check_block(fsck_state *st, uint32_t inum, const struct inode *ino,
+                   blockid_t b, bool confirm);
+  bool flagged(fsck_state *st, uint32_t inum, const struct inode *ino,
+               bool confirm);
+  void check_dir(fsck_state *st, uint32_t inum, const char *data,
+                 uint32_t size);
+  void check_bitmap(fsck_state *st);
+  void check_imap(fsck_state *st);
+  void recheck(fsck_state *st);
 
  public:
   inode_manager();
+  // Read-only view of the filesystem as snapshot sid froze it. Only a
+  // view may be deleted: a live inode_manager's write-back thread
+  // never stops.
+  inode_manager(inode_manager *live, uint32_t sid);
+  ~inode_manager();
+  // Write everything back. Returns 0, or -1 if delayed file data
+  // could not be given blocks, now or since the last flush; it stays
+  // in memory, readable, and is tried again at the next write-back.
+  int flush();
+  // Returns the new snapshot's id, or -1 if it could not be taken,
+  // delayed data that could not be written back included.
+  int snapshot();
+  // Free the blocks of snapshot sid; false if there is none. Its views
+  // must be gone.
+  bool delete_snapshot(uint32_t sid);
+  bool has_snapshot(uint32_t sid);
+  // Every call below locks the inode it is given (see inode_lock), so
+  // they may be made from several threads at once.
   uint32_t alloc_inode(uint32_t type);
+  // Called with the inode's lock held exclusively, by remove_file.
   void free_inode(uint32_t inum);
   void read_file(uint32_t inum, char **buf, int *size);
   void write_file(uint32_t inum, const char *buf, int size);
+  // Read up to len bytes from off into buf; returns the bytes read, 0
+  // at or past the end of the file, -1 if there is no such inode.
+  int read_range(uint32_t inum, uint64_t off, uint32_t len, char *buf);
+  // Write len bytes from buf at off, growing the file if it ends
+  // before off+len; a gap between its old end and off is left a hole.
+  // Returns len, or -1 on error, and the size the file had before in
+  // *prev_size if given. Only the blocks in the range are read or
+  // written.
+  int write_range(uint32_t inum, uint64_t off, uint32_t len, const char *buf,
+                  uint64_t *prev_size = NULL);
+  // Set the size of a file. Shrinking frees the blocks past the new
+  // end without reading them, so the cost is in the blocks freed;
+  // growing leaves a hole. Returns 0, or -1 on error.
+  int truncate(uint32_t inum, uint64_t size);
+  // Make sure the blocks of off to off+len are allocated, zeroed where
+  // they were holes, growing the file to off+len if it is shorter.
+  // Delayed blocks of the file are written back first. Returns 0, or
+  // -1 on error.
+  int fallocate(uint32_t inum, uint64_t off, uint64_t len);
   void remove_file(uint32_t inum);
   void getattr(uint32_t inum, extent_protocol::attr &a);
+  // Check the filesystem with nthreads threads, under FSCK_* flags.
+  // Each problem is printed as it is found and counted in r.
+  void check(int nthreads, int flags, fsck_report &r);
 };
 
 #endif
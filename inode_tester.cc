@@ -0,0 +1,1599 @@
+/* inode layer tester.
+ * Each test runs in a child process of its own, on a fresh disk image,
+ * so that it can mount the image again (or be killed) as a real
+ * server would. The image geometry and inode format are taken from
+ * the environment as usual (YFS_INODE_FORMAT=blocks tests the block
+ * map). Usage: ./inode_tester [test ...], all tests by default.
+ */
+
+#include "extent_client.h"
+#include <map>
+#include <iterator>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define iprint(msg) \
+    printf("[TEST_ERROR]: %s\n", msg);
+
+static char image[256];
+
+// Run fn in a child process; returns its exit code, or -1 if it was
+// killed.
+static int run_child(int (*fn)())
+{
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        int r = fn();
+        fflush(stdout);
+        _exit(r);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status))
+        return -1;
+    return WEXITSTATUS(status);
+}
+
+// A file's contents, made up from its number and a seed.
+static std::string pattern(extent_protocol::extentid_t id, int seed,
+                           size_t len)
+{
+    std::string s(len, 0);
+    for (size_t i = 0; i < len; i++)
+        s[i] = 'a' + (id * 7 + seed * 13 + i / 61) % 26;
+    return s;
+}
+
+// Check the image offline; fails on any problem but orphans, as the
+// files made through extent_client are in no directory.
+static int check_image()
+{
+    inode_manager *im = new inode_manager();
+    fsck_report r;
+    im->check(1, 0, r);
+    return r.problems() > r.orphans ? 1 : 0;
+}
+
+static bool read_superblock(int fd, superblock_t &sb)
+{
+    return pread(fd, &sb, sizeof(sb), 0) == (ssize_t)sizeof(sb);
+}
+
+/* Journal replay: files written and committed by the periodic
+ * write-back must survive the server being killed before their
+ * blocks are checkpointed home. */
+#define JOURNAL_FILES 20
+
+static int journal_write()
+{
+    extent_client *ec = new extent_client();
+    extent_protocol::extentid_t id;
+
+    for (int i = 0; i < JOURNAL_FILES; i++) {
+        ec->create(extent_protocol::T_FILE, id);
+        if (ec->put(id, pattern(id, 1, 700 * (i + 1))) != extent_protocol::OK)
+            return 1;
+    }
+    // let the write-back thread commit, then die without a flush
+    sleep(WRITEBACK_INTERVAL + 2);
+    kill(getpid(), SIGKILL);
+    return 2;
+}
+
+static int journal_read()
+{
+    extent_client *ec = new extent_client();
+    std::string buf;
+
+    for (int i = 0; i < JOURNAL_FILES; i++) {
+        extent_protocol::extentid_t id = i + 2;
+        if (ec->get(id, buf) != extent_protocol::OK
+            || buf != pattern(id, 1, 700 * (i + 1))) {
+            iprint("file lost or changed after replay");
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int test_journal()
+{
+    if (run_child(journal_write) != -1) {
+        iprint("writer was not killed");
+        return 1;
+    }
+    if (run_child(journal_read) != 0)
+        return 2;
+    return run_child(check_image) == 0 ? 0 : 3;
+}
+
+/* Snapshots: a snapshot keeps reading the files as they were when it
+ * was taken while they are rewritten, written in part, truncated and
+ * removed, and again after the image is mounted anew. */
+#define SNAP_FILES 12
+
+static int snap_sid;
+
+static size_t snap_len(int i)
+{
+    return 900 * i + 37;
+}
+
+static int snap_check(extent_client *ec)
+{
+    std::string buf;
+    extent_protocol::attr a;
+
+    for (int i = 0; i < SNAP_FILES; i++) {
+        extent_protocol::extentid_t id = i + 2;
+        if (ec->snap_get(snap_sid, id, buf) != extent_protocol::OK
+            || buf != pattern(id, 1, snap_len(i))) {
+            iprint("snapshot file changed with the live one");
+            return 1;
+        }
+        if (ec->snap_getattr(snap_sid, id, a) != extent_protocol::OK
+            || a.size != snap_len(i) || a.type != extent_protocol::T_FILE) {
+            iprint("snapshot attributes changed with the live ones");
+            return 2;
+        }
+    }
+    return 0;
+}
+
+static int snap_change()
+{
+    extent_client *ec = new extent_client();
+    extent_protocol::extentid_t id;
+    std::string buf;
+
+    for (int i = 0; i < SNAP_FILES; i++) {
+        ec->create(extent_protocol::T_FILE, id);
+        ec->put(id, pattern(id, 1, snap_len(i)));
+    }
+    if (ec->snapshot(snap_sid) != extent_protocol::OK) {
+        iprint("error taking a snapshot");
+        return 1;
+    }
+    for (int i = 0; i < SNAP_FILES; i++) {
+        id = i + 2;
+        switch (i % 4) {
+        case 0:
+            ec->put(id, pattern(id, 2, snap_len(i) + 5000));
+            break;
+        case 1:
+            ec->write_range(id, snap_len(i) / 2, "changed");
+            break;
+        case 2:
+            ec->truncate(id, 0);
+            break;
+        default:
+            ec->remove(id);
+        }
+    }
+    ec->create(extent_protocol::T_FILE, id);
+    ec->put(id, pattern(id, 3, 20000));
+    if (ec->get(2, buf) != extent_protocol::OK
+        || buf != pattern(2, 2, snap_len(0) + 5000)) {
+        iprint("live file not changed");
+        return 2;
+    }
+    if (snap_check(ec) != 0)
+        return 3;
+    // the snapshot is read from disk once the cache is written back
+    ec->sync();
+    if (snap_check(ec) != 0)
+        return 4;
+    FILE *fp = fopen((std::string(image) + ".sid").c_str(), "w");
+    fprintf(fp, "%d\n", snap_sid);
+    fclose(fp);
+    return 0;
+}
+
+static int snap_remount()
+{
+    std::string sidfile = std::string(image) + ".sid";
+    FILE *fp = fopen(sidfile.c_str(), "r");
+    if (fp == NULL || fscanf(fp, "%d", &snap_sid) != 1)
+        return 1;
+    fclose(fp);
+    unlink(sidfile.c_str());
+    extent_client *ec = new extent_client();
+    return snap_check(ec) == 0 ? 0 : 2;
+}
+
+int test_snapshot()
+{
+    if (run_child(snap_change) != 0)
+        return 1;
+    if (run_child(snap_remount) != 0)
+        return 2;
+    return run_child(check_image) == 0 ? 0 : 3;
+}
+
+/* Snapshot deletion: a file is rewritten in whole or in part between
+ * snapshots, far more of them than fit at once and on a disk too
+ * small to keep every copy, the oldest or one in the middle being
+ * deleted to make room. Each snapshot left reads as the file was when
+ * it was taken, before and after a remount. */
+#define SNAPDEL_DISK "4M"
+#define SNAPDEL_ROUNDS 60
+#define SNAPDEL_KEEP 5
+#define SNAPDEL_SIZE (600 * 1024)
+
+static std::map<int, std::string> snapdel_model;
+
+static int snapdel_check(extent_client *ec)
+{
+    std::map<int, std::string>::iterator it;
+    std::string buf;
+
+    for (it = snapdel_model.begin(); it != snapdel_model.end(); ++it) {
+        if (ec->snap_get(it->first, 2, buf) != extent_protocol::OK
+            || buf != it->second) {
+            printf("snapshot %d\n", it->first);
+            iprint("snapshot changed after another was deleted");
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int snapdel_run()
+{
+    extent_client *ec;
+    extent_protocol::extentid_t id;
+    std::string data;
+    int sid;
+
+    setenv(DISK_SIZE_ENV, SNAPDEL_DISK, 1);
+    ec = new extent_client();
+    ec->create(extent_protocol::T_FILE, id);
+    for (int r = 0; r < SNAPDEL_ROUNDS; r++) {
+        if (r % 3 == 0) {
+            data = pattern(id, r, SNAPDEL_SIZE);
+            ec->put(id, data);
+        } else {
+            std::string part = pattern(id, r, SNAPDEL_SIZE / 4);
+            size_t off = (r * 7919) % (SNAPDEL_SIZE - part.size());
+            ec->write_range(id, off, part);
+            data.replace(off, part.size(), part);
+        }
+        if (ec->snapshot(sid) != extent_protocol::OK) {
+            printf("round %d\n", r);
+            iprint("error taking a snapshot");
+            return 1;
+        }
+        if (snapdel_model.count(sid)) {
+            iprint("snapshot id reused");
+            return 2;
+        }
+        snapdel_model[sid] = data;
+        if (snapdel_model.size() == SNAPDEL_KEEP) {
+            // the oldest, or one in the middle every other round
+            std::map<int, std::string>::iterator it = snapdel_model.begin();
+            if (r % 2 == 0)
+                std::advance(it, SNAPDEL_KEEP / 2);
+            if (ec->snap_delete(it->first) != extent_protocol::OK) {
+                iprint("error deleting a snapshot");
+                return 3;
+            }
+            snapdel_model.erase(it);
+        }
+        if (snapdel_check(ec) != 0)
+            return 4;
+    }
+    if (ec->snap_delete(999) != extent_protocol::NOENT) {
+        iprint("deleted a snapshot that does not exist");
+        return 5;
+    }
+    if (ec->sync() != extent_protocol::OK)
+        return 6;
+    FILE *fp = fopen((std::string(image) + ".model").c_str(), "w");
+    std::map<int, std::string>::iterator it;
+    for (it = snapdel_model.begin(); it != snapdel_model.end(); ++it) {
+        fprintf(fp, "%d %zu\n", it->first, it->second.size());
+        fwrite(it->second.data(), 1, it->second.size(), fp);
+    }
+    fclose(fp);
+    return 0;
+}
+
+static int snapdel_remount()
+{
+    std::string path = std::string(image) + ".model";
+    FILE *fp = fopen(path.c_str(), "r");
+    size_t len;
+    int sid;
+
+    if (fp == NULL)
+        return 1;
+    while (fscanf(fp, "%d %zu\n", &sid, &len) == 2) {
+        std::string data(len, 0);
+        if (len > 0 && fread(&data[0], 1, len, fp) != len)
+            return 2;
+        snapdel_model[sid] = data;
+    }
+    fclose(fp);
+    unlink(path.c_str());
+    extent_client *ec = new extent_client();
+    return snapdel_check(ec) == 0 ? 0 : 3;
+}
+
+int test_snapdelete()
+{
+    if (run_child(snapdel_run) != 0)
+        return 1;
+    if (run_child(snapdel_remount) != 0)
+        return 2;
+    return run_child(check_image) == 0 ? 0 : 3;
+}
+
+/* fsck: bitmap bits flipped behind the filesystem's back are found as
+ * lost and leaked blocks and inode bitmap errors, and repaired
+ * without losing a file. */
+#define FSCK_FILES 10
+
+static int fsck_write()
+{
+    extent_client *ec = new extent_client();
+    extent_protocol::extentid_t id;
+
+    for (int i = 0; i < FSCK_FILES; i++) {
+        ec->create(extent_protocol::T_FILE, id);
+        ec->put(id, pattern(id, 1, 3000 * (i + 1)));
+    }
+    return ec->sync() == extent_protocol::OK ? 0 : 1;
+}
+
+// Flip bit b of the bitmap starting at block start of the image.
+static bool flip_bit(int fd, const superblock_t &sb, blockid_t start,
+                     uint64_t b, bool set)
+{
+    off_t off = (off_t)start * sb.block_size + b / 8;
+    unsigned char c;
+    if (pread(fd, &c, 1, off) != 1)
+        return false;
+    if (set)
+        c |= 1 << (b % 8);
+    else
+        c &= ~(1 << (b % 8));
+    return pwrite(fd, &c, 1, off) == 1;
+}
+
+static int fsck_corrupt()
+{
+    int fd = open(image, O_RDWR);
+    superblock_t sb;
+    if (fd < 0 || !read_superblock(fd, sb))
+        return 1;
+    // the first data block in use loses its bit, the last block (free
+    // on a disk this empty) gains one, and so does a free inode
+    blockid_t b;
+    for (b = sb.data_start; b < sb.nblocks; b++) {
+        unsigned char c;
+        pread(fd, &c, 1, (off_t)sb.bmap_start * sb.block_size + b / 8);
+        if (c & (1 << (b % 8)))
+            break;
+    }
+    bool ok = b < sb.nblocks
+        && flip_bit(fd, sb, sb.bmap_start, b, false)
+        && flip_bit(fd, sb, sb.bmap_start, sb.nblocks - 1, true)
+        && flip_bit(fd, sb, sb.imap_start, sb.ninodes - 1, true);
+    close(fd);
+    return ok ? 0 : 2;
+}
+
+static int fsck_find()
+{
+    inode_manager *im = new inode_manager();
+    fsck_report r;
+    im->check(4, 0, r);
+    if (r.lost_blocks < 1 || r.leaked_blocks < 1 || r.imap_errors < 1) {
+        printf("lost %u leaked %u imap errors %u\n", r.lost_blocks,
+               r.leaked_blocks, r.imap_errors);
+        iprint("fsck missed a corrupted bitmap bit");
+        return 1;
+    }
+    im->check(4, FSCK_REPAIR, r);
+    im->flush();
+    return 0;
+}
+
+static int fsck_read()
+{
+    extent_client *ec = new extent_client();
+    std::string buf;
+
+    for (int i = 0; i < FSCK_FILES; i++) {
+        extent_protocol::extentid_t id = i + 2;
+        if (ec->get(id, buf) != extent_protocol::OK
+            || buf != pattern(id, 1, 3000 * (i + 1))) {
+            iprint("file changed by the repair");
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int test_fsck()
+{
+    if (run_child(fsck_write) != 0)
+        return 1;
+    if (run_child(check_image) != 0) {
+        iprint("fsck found problems on a clean image");
+        return 2;
+    }
+    if (fsck_corrupt() != 0)
+        return 3;
+    if (run_child(fsck_find) != 0)
+        return 4;
+    if (run_child(check_image) != 0) {
+        iprint("fsck left problems after a repair");
+        return 5;
+    }
+    return run_child(fsck_read) == 0 ? 0 : 6;
+}
+
+/* Range I/O: random writes, reads and truncates of parts of a file,
+ * past its end and back, against a copy kept in memory; the gaps
+ * left are holes that read as zeros and take no blocks. */
+#define RANGE_OPS 600
+#define RANGE_MAX (320 * 1024)
+#define SPARSE_OFF (8 * 1024 * 1024)
+
+static std::string range_model;
+
+static int range_check(extent_client *ec, extent_protocol::extentid_t id)
+{
+    extent_protocol::attr a;
+    std::string buf;
+
+    if (ec->getattr(id, a) != extent_protocol::OK
+        || a.size != range_model.size()) {
+        iprint("file size differs from the model");
+        return 1;
+    }
+    if (ec->get(id, buf) != extent_protocol::OK || buf != range_model) {
+        iprint("file contents differ from the model");
+        return 2;
+    }
+    return 0;
+}
+
+static int range_io()
+{
+    extent_client *ec = new extent_client();
+    extent_protocol::extentid_t id, sparse;
+    std::string buf;
+
+    srand(1);
+    ec->create(extent_protocol::T_FILE, id);
+    for (int i = 0; i < RANGE_OPS; i++) {
+        unsigned long long off = rand() % RANGE_MAX;
+        unsigned int len = rand() % 9000;
+        switch (rand() % 4) {
+        case 0:
+        case 1:
+            buf = pattern(id, i, len);
+            if (ec->write_range(id, off, buf) != extent_protocol::OK) {
+                iprint("error write_range, return not OK");
+                return 1;
+            }
+            if (range_model.size() < off + len)
+                range_model.resize(off + len, 0);
+            range_model.replace(off, len, buf);
+            break;
+        case 2:
+            if (ec->read_range(id, off, len, buf) != extent_protocol::OK) {
+                iprint("error read_range, return not OK");
+                return 2;
+            }
+            if (buf != (off < range_model.size()
+                        ? range_model.substr(off, len) : std::string())) {
+                iprint("read_range differs from the model");
+                return 3;
+            }
+            break;
+        default:
+            // shrink more often than grow, so the file keeps holes
+            off = rand() % 3 == 0 ? off : off / 4;
+            if (ec->truncate(id, off) != extent_protocol::OK) {
+                iprint("error truncate, return not OK");
+                return 4;
+            }
+            range_model.resize(off, 0);
+        }
+    }
+    if (range_check(ec, id) != 0)
+        return 5;
+    ec->create(extent_protocol::T_FILE, sparse);
+    ec->write_range(sparse, SPARSE_OFF, "end");
+    if (ec->read_range(sparse, SPARSE_OFF - 3, 6, buf) != extent_protocol::OK
+        || buf != std::string(3, 0) + "end") {
+        iprint("hole does not read as zeros");
+        return 6;
+    }
+    if (ec->sync() != extent_protocol::OK)
+        return 7;
+    // write the model next to the image, for the next mount to compare
+    FILE *fp = fopen((std::string(image) + ".model").c_str(), "w");
+    fwrite(range_model.data(), 1, range_model.size(), fp);
+    fclose(fp);
+    return 0;
+}
+
+static int range_remount()
+{
+    std::string path = std::string(image) + ".model";
+    FILE *fp = fopen(path.c_str(), "r");
+    char buf[4096];
+    size_t n;
+
+    if (fp == NULL)
+        return 1;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+        range_model.append(buf, n);
+    fclose(fp);
+    unlink(path.c_str());
+    extent_client *ec = new extent_client();
+    return range_check(ec, 2) == 0 ? 0 : 2;
+}
+
+// The whole image holds no more blocks than the data written.
+static int range_blocks()
+{
+    int fd = open(image, O_RDONLY);
+    superblock_t sb;
+    if (fd < 0 || !read_superblock(fd, sb))
+        return 2;
+    close(fd);
+    inode_manager *im = new inode_manager();
+    fsck_report r;
+    im->check(1, 0, r);
+    if (r.blocks > 2 * NBLOCKS(RANGE_MAX, sb) + 64) {
+        iprint("holes were given blocks");
+        return 1;
+    }
+    return 0;
+}
+
+int test_range()
+{
+    if (run_child(range_io) != 0)
+        return 1;
+    if (run_child(range_remount) != 0)
+        return 2;
+    if (run_child(range_blocks) != 0)
+        return 3;
+    return run_child(check_image) == 0 ? 0 : 4;
+}
+
+/* Threads: several threads rewrite and read back files of their own
+ * on the asynchronous backend while another scrubs, so operations on
+ * different inodes run in parallel down to the device. */
+#define MT_THREADS 8
+#define MT_FILES 6
+#define MT_ROUNDS 40
+
+static extent_client *mt_ec;
+static extent_protocol::extentid_t mt_ids[MT_THREADS][MT_FILES];
+static std::string mt_data[MT_THREADS][MT_FILES];
+static int mt_errors;
+static int mt_done;
+
+static void *mt_worker(void *arg)
+{
+    long t = (long)arg;
+    unsigned seed = t + 1;
+    std::string buf;
+
+    for (int r = 0; r < MT_ROUNDS; r++) {
+        int f = rand_r(&seed) % MT_FILES;
+        extent_protocol::extentid_t id = mt_ids[t][f];
+        std::string &model = mt_data[t][f];
+        if (rand_r(&seed) % 2 == 0) {
+            model = pattern(id, r, rand_r(&seed) % 40000);
+            mt_ec->put(id, model);
+        } else {
+            unsigned long long off = rand_r(&seed) % 40000;
+            buf = pattern(id, r + 100, rand_r(&seed) % 6000);
+            mt_ec->write_range(id, off, buf);
+            if (model.size() < off + buf.size())
+                model.resize(off + buf.size(), 0);
+            model.replace(off, buf.size(), buf);
+        }
+        if (mt_ec->get(id, buf) != extent_protocol::OK || buf != model)
+            __sync_fetch_and_add(&mt_errors, 1);
+    }
+    return NULL;
+}
+
+static void *mt_scrubber(void *arg)
+{
+    int problems;
+
+    while (!__atomic_load_n(&mt_done, __ATOMIC_ACQUIRE)) {
+        mt_ec->scrub(problems);
+        if (problems > 0)
+            __sync_fetch_and_add(&mt_errors, 1);
+    }
+    return NULL;
+}
+
+static int mt_run()
+{
+    pthread_t th[MT_THREADS], scrubber;
+
+    setenv(DISK_BACKEND_ENV, "aio", 1);
+    mt_ec = new extent_client();
+    for (int t = 0; t < MT_THREADS; t++) {
+        for (int f = 0; f < MT_FILES; f++)
+            mt_ec->create(extent_protocol::T_FILE, mt_ids[t][f]);
+    }
+    pthread_create(&scrubber, NULL, mt_scrubber, NULL);
+    for (long t = 0; t < MT_THREADS; t++)
+        pthread_create(&th[t], NULL, mt_worker, (void *)t);
+    for (int t = 0; t < MT_THREADS; t++)
+        pthread_join(th[t], NULL);
+    __atomic_store_n(&mt_done, 1, __ATOMIC_RELEASE);
+    pthread_join(scrubber, NULL);
+    if (__atomic_load_n(&mt_errors, __ATOMIC_ACQUIRE) > 0) {
+        iprint("file differs from what its thread wrote");
+        return 1;
+    }
+    if (mt_ec->sync() != extent_protocol::OK)
+        return 2;
+    // the next mount reads the files as each thread left them
+    FILE *fp = fopen((std::string(image) + ".model").c_str(), "w");
+    for (int t = 0; t < MT_THREADS; t++) {
+        for (int f = 0; f < MT_FILES; f++) {
+            fprintf(fp, "%llu %zu\n", mt_ids[t][f], mt_data[t][f].size());
+            fwrite(mt_data[t][f].data(), 1, mt_data[t][f].size(), fp);
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+static int mt_remount()
+{
+    std::string path = std::string(image) + ".model";
+    FILE *fp = fopen(path.c_str(), "r");
+    unsigned long long id;
+    size_t len;
+    std::string buf;
+
+    if (fp == NULL)
+        return 1;
+    setenv(DISK_BACKEND_ENV, "aio", 1);
+    extent_client *ec = new extent_client();
+    while (fscanf(fp, "%llu %zu\n", &id, &len) == 2) {
+        std::string model(len, 0);
+        if (len > 0 && fread(&model[0], 1, len, fp) != len)
+            return 2;
+        if (ec->get(id, buf) != extent_protocol::OK || buf != model) {
+            iprint("file differs after a remount");
+            return 3;
+        }
+    }
+    fclose(fp);
+    unlink(path.c_str());
+    return 0;
+}
+
+int test_threads()
+{
+    if (run_child(mt_run) != 0)
+        return 1;
+    if (run_child(mt_remount) != 0)
+        return 2;
+    return run_child(check_image) == 0 ? 0 : 3;
+}
+
+/* ENOSPC under delayed allocation: a small disk is filled by a file
+ * whose blocks are all delayed, then a directory write, which takes
+ * its blocks at once, must fail rather than take blocks promised to
+ * the file. Every byte written that was accepted then reaches the
+ * disk. */
+#define ENOSPC_DISK "2M"
+#define ENOSPC_CHUNK 4096
+
+static int enospc_fill()
+{
+    extent_client *ec;
+    extent_protocol::extentid_t id, dir;
+    unsigned long long off = 0;
+
+    setenv(DISK_SIZE_ENV, ENOSPC_DISK, 1);
+    ec = new extent_client();
+    ec->create(extent_protocol::T_FILE, id);
+    while (ec->write_range(id, off, pattern(id, off / ENOSPC_CHUNK, ENOSPC_CHUNK))
+           == extent_protocol::OK)
+        off += ENOSPC_CHUNK;
+    if (off == 0) {
+        iprint("nothing could be written");
+        return 1;
+    }
+    ec->create(extent_protocol::T_DIR, dir);
+    ec->put(dir, std::string(10240, 'd'));
+    if (ec->sync() != extent_protocol::OK) {
+        iprint("delayed data could not be written back");
+        return 2;
+    }
+    FILE *fp = fopen((std::string(image) + ".len").c_str(), "w");
+    fprintf(fp, "%llu\n", off);
+    fclose(fp);
+    return 0;
+}
+
+static int enospc_read()
+{
+    std::string path = std::string(image) + ".len";
+    FILE *fp = fopen(path.c_str(), "r");
+    unsigned long long len;
+    extent_protocol::attr a;
+    std::string buf;
+
+    if (fp == NULL || fscanf(fp, "%llu", &len) != 1)
+        return 1;
+    fclose(fp);
+    unlink(path.c_str());
+    extent_client *ec = new extent_client();
+    if (ec->getattr(2, a) != extent_protocol::OK || a.size != len) {
+        iprint("file size differs from the bytes written");
+        return 2;
+    }
+    for (unsigned long long off = 0; off < len; off += ENOSPC_CHUNK) {
+        if (ec->read_range(2, off, ENOSPC_CHUNK, buf) != extent_protocol::OK
+            || buf != pattern(2, off / ENOSPC_CHUNK, ENOSPC_CHUNK)) {
+            iprint("data written before the disk filled was lost");
+            return 3;
+        }
+    }
+    return 0;
+}
+
+int test_enospc()
+{
+    if (run_child(enospc_fill) != 0)
+        return 1;
+    if (run_child(enospc_read) != 0)
+        return 2;
+    return run_child(check_image) == 0 ? 0 : 3;
+}
+
+/* Extent tree: a file written a block in two, then its gaps filled
+ * in random order, each write taking its blocks at once, grows a tree
+ * of several levels whose nodes split as the blocks go in. A fill
+ * changes the nodes over its blocks and the ones it splits, so even
+ * in a tree this large it fits a small log; the contents and the tree
+ * stay right across a remount. */
+#define EXTTREE_DISK "64M"
+#define EXTTREE_LOG "64"
+#define EXTTREE_BLOCKS 6000
+
+static unsigned exttree_bs;
+
+static int exttree_check(extent_client *ec, extent_protocol::extentid_t id)
+{
+    std::string buf;
+
+    for (unsigned b = 0; b < EXTTREE_BLOCKS; b++) {
+        if (ec->read_range(id, (unsigned long long)b * exttree_bs, exttree_bs,
+                           buf) != extent_protocol::OK
+            || buf != pattern(id, b, exttree_bs)) {
+            iprint("block differs from what was written");
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int exttree_block_size()
+{
+    int fd = open(image, O_RDONLY);
+    superblock_t sb;
+
+    if (fd < 0 || !read_superblock(fd, sb))
+        return 1;
+    close(fd);
+    exttree_bs = sb.block_size;
+    return 0;
+}
+
+static int exttree_fill()
+{
+    extent_client *ec;
+    extent_protocol::extentid_t id;
+    std::vector<unsigned> gaps;
+
+    // the server reports a transaction that outgrew the log on stdout
+    if (freopen((std::string(image) + ".out").c_str(), "w", stdout) == NULL)
+        return 1;
+    setenv(DISK_SIZE_ENV, EXTTREE_DISK, 1);
+    setenv(LOG_BLOCKS_ENV, EXTTREE_LOG, 1);
+    setenv(DELAY_BLOCKS_ENV, "0", 1);
+    ec = new extent_client();
+    ec->create(extent_protocol::T_FILE, id);
+    if (ec->sync() != extent_protocol::OK || exttree_block_size() != 0)
+        return 2;
+    for (unsigned b = 0; b < EXTTREE_BLOCKS; b += 2) {
+        if (ec->write_range(id, (unsigned long long)b * exttree_bs,
+                            pattern(id, b, exttree_bs)) != extent_protocol::OK)
+            return 3;
+        gaps.push_back(b + 1);
+    }
+    srand(1);
+    for (size_t i = gaps.size(); i > 1; i--)
+        std::swap(gaps[i - 1], gaps[rand() % i]);
+    for (size_t i = 0; i < gaps.size(); i++) {
+        if (ec->write_range(id, (unsigned long long)gaps[i] * exttree_bs,
+                            pattern(id, gaps[i], exttree_bs)) != extent_protocol::OK)
+            return 4;
+    }
+    if (exttree_check(ec, id) != 0)
+        return 5;
+    return ec->sync() == extent_protocol::OK ? 0 : 6;
+}
+
+static int exttree_remount()
+{
+    if (exttree_block_size() != 0)
+        return 1;
+    extent_client *ec = new extent_client();
+    return exttree_check(ec, 2) == 0 ? 0 : 2;
+}
+
+int test_exttree()
+{
+    std::string path = std::string(image) + ".out";
+    char line[256];
+    bool overflow = false;
+
+    int r = run_child(exttree_fill);
+    FILE *fp = fopen(path.c_str(), "r");
+    while (fp != NULL && fgets(line, sizeof(line), fp) != NULL) {
+        fputs(line, stdout);
+        overflow = overflow || strstr(line, "overflows the log") != NULL;
+    }
+    if (fp != NULL)
+        fclose(fp);
+    unlink(path.c_str());
+    if (r != 0)
+        return 1;
+    if (overflow) {
+        iprint("a write overflowed the log");
+        return 2;
+    }
+    if (run_child(exttree_remount) != 0)
+        return 3;
+    return run_child(check_image) == 0 ? 0 : 4;
+}
+
+/* Indirect blocks: with a block map of 4K blocks, a file with a block
+ * mapped directly, through the single, the double and the triple
+ * indirect tree reaches past 4 GB; every block reads back across a
+ * remount, the holes between as zeros, and a truncate into the double
+ * tree frees the triple one. */
+#define BIG_BS 4096
+#define BIG_NIND (BIG_BS / sizeof(blockid_t))
+
+static const unsigned long long big_blocks[] = {
+    3, NDIRECT + 10, NDIRECT + BIG_NIND + 10,
+    NDIRECT + BIG_NIND + BIG_NIND * BIG_NIND + 10,
+};
+#define BIG_NBLOCKS (sizeof(big_blocks) / sizeof(big_blocks[0]))
+
+static int big_check(extent_client *ec, extent_protocol::extentid_t id,
+                     size_t n, unsigned long long size)
+{
+    extent_protocol::attr a;
+    std::string buf;
+
+    if (ec->getattr(id, a) != extent_protocol::OK || a.size != size) {
+        iprint("size of the file is wrong");
+        return 1;
+    }
+    for (size_t i = 0; i < n; i++) {
+        unsigned long long off = big_blocks[i] * BIG_BS;
+        if (ec->read_range(id, off, BIG_BS, buf) != extent_protocol::OK
+            || buf != pattern(id, i, BIG_BS).substr(0, std::min<unsigned long long>(BIG_BS, size - off))) {
+            iprint("block differs from what was written");
+            return 2;
+        }
+        if (ec->read_range(id, off - BIG_BS, BIG_BS, buf) != extent_protocol::OK
+            || buf != std::string(BIG_BS, 0)) {
+            iprint("hole does not read as zeros");
+            return 3;
+        }
+    }
+    return 0;
+}
+
+static int big_write()
+{
+    extent_client *ec;
+    extent_protocol::extentid_t id;
+    unsigned long long size = (big_blocks[BIG_NBLOCKS - 1] + 1) * BIG_BS;
+
+    setenv(BLOCK_SIZE_ENV, "4096", 1);
+    setenv(INODE_FORMAT_ENV, "blocks", 1);
+    ec = new extent_client();
+    ec->create(extent_protocol::T_FILE, id);
+    for (size_t i = 0; i < BIG_NBLOCKS; i++) {
+        if (ec->write_range(id, big_blocks[i] * BIG_BS, pattern(id, i, BIG_BS))
+            != extent_protocol::OK) {
+            iprint("error write_range, return not OK");
+            return 1;
+        }
+    }
+    if (size <= (1ULL << 32)) {
+        iprint("the file does not reach past 4 GB");
+        return 2;
+    }
+    if (big_check(ec, id, BIG_NBLOCKS, size) != 0)
+        return 3;
+    return ec->sync() == extent_protocol::OK ? 0 : 4;
+}
+
+static int big_truncate()
+{
+    extent_client *ec = new extent_client();
+    unsigned long long size = big_blocks[BIG_NBLOCKS - 2] * BIG_BS + 100;
+
+    if (big_check(ec, 2, BIG_NBLOCKS, (big_blocks[BIG_NBLOCKS - 1] + 1) * BIG_BS) != 0)
+        return 1;
+    if (ec->truncate(2, size) != extent_protocol::OK) {
+        iprint("error truncate, return not OK");
+        return 2;
+    }
+    if (big_check(ec, 2, BIG_NBLOCKS - 1, size) != 0)
+        return 3;
+    return ec->sync() == extent_protocol::OK ? 0 : 4;
+}
+
+int test_bigfile()
+{
+    if (run_child(big_write) != 0)
+        return 1;
+    if (run_child(big_truncate) != 0)
+        return 2;
+    return run_child(check_image) == 0 ? 0 : 3;
+}
+
+/* Inline data: a file moves between contents held in its inode and
+ * blocks, both ways, through put, write_range and truncate. After each
+ * step, on a fresh mount, it reads as a copy kept in memory, and it
+ * holds blocks exactly when it is larger than the inode can hold. */
+enum { INL_PUT, INL_WRITE, INL_TRUNCATE };
+
+static const struct {
+    int op;
+    unsigned off, len;
+} inline_steps[] = {
+    { INL_PUT, 0, 50 },                 // inline
+    { INL_WRITE, 80, 60 },              // grows out into a block
+    { INL_TRUNCATE, 30, 0 },            // back inline, keeping its head
+    { INL_TRUNCATE, 3000, 0 },          // head to a block, then a hole
+    { INL_PUT, 0, 100 },                // inline again
+    { INL_WRITE, 10, 20 },              // changed in place
+    { INL_PUT, 0, 5000 },               // blocks
+    { INL_WRITE, 0, 10 },
+    { INL_TRUNCATE, INLINE_MAX, 0 },    // as much as fits inline
+    { INL_WRITE, INLINE_MAX, 1 },       // a byte too many
+    { INL_PUT, 0, 0 },
+};
+#define INLINE_STEPS (sizeof(inline_steps) / sizeof(inline_steps[0]))
+
+static size_t inline_step;
+static std::string inline_model;
+
+// Apply step inline_step to the model, and to the file if ec is set.
+static int inline_apply(extent_client *ec, extent_protocol::extentid_t id)
+{
+    unsigned off = inline_steps[inline_step].off;
+    std::string buf = pattern(id, inline_step, inline_steps[inline_step].len);
+    int r = extent_protocol::OK;
+
+    switch (inline_steps[inline_step].op) {
+    case INL_PUT:
+        inline_model = buf;
+        if (ec != NULL)
+            r = ec->put(id, buf);
+        break;
+    case INL_WRITE:
+        if (inline_model.size() < off + buf.size())
+            inline_model.resize(off + buf.size(), 0);
+        inline_model.replace(off, buf.size(), buf);
+        if (ec != NULL)
+            r = ec->write_range(id, off, buf);
+        break;
+    default:
+        inline_model.resize(off, 0);
+        if (ec != NULL)
+            r = ec->truncate(id, off);
+    }
+    return r == extent_protocol::OK ? 0 : 1;
+}
+
+static int inline_run()
+{
+    extent_client *ec = new extent_client();
+    extent_protocol::extentid_t id = 2;
+    std::string buf;
+
+    if (inline_step == 0)
+        ec->create(extent_protocol::T_FILE, id);
+    if (inline_apply(ec, id) != 0) {
+        iprint("error changing the file, return not OK");
+        return 1;
+    }
+    if (ec->get(id, buf) != extent_protocol::OK || buf != inline_model) {
+        iprint("file contents differ from the model");
+        return 2;
+    }
+    return ec->sync() == extent_protocol::OK ? 0 : 3;
+}
+
+static int inline_blocks()
+{
+    inode_manager *im = new inode_manager();
+    fsck_report r;
+
+    im->check(1, 0, r);
+    if (r.problems() > r.orphans)
+        return 1;
+    if ((r.blocks > 0) != (inline_model.size() > INLINE_MAX)) {
+        iprint(r.blocks > 0 ? "inline contents hold blocks"
+               : "contents too large for the inode hold no block");
+        return 2;
+    }
+    return 0;
+}
+
+static int inline_remount()
+{
+    extent_client *ec = new extent_client();
+    std::string buf;
+
+    if (ec->get(2, buf) != extent_protocol::OK || buf != inline_model) {
+        iprint("file contents differ from the model after a remount");
+        return 1;
+    }
+    return 0;
+}
+
+int test_inline()
+{
+    for (inline_step = 0; inline_step < INLINE_STEPS; inline_step++) {
+        if (inline_step > 0 && run_child(inline_remount) != 0)
+            return 1;
+        if (run_child(inline_run) != 0)
+            return 2;
+        inline_apply(NULL, 2);
+        if (run_child(inline_blocks) != 0)
+            return 3;
+    }
+    return 0;
+}
+
+/* Inode bitmap: freeing an inode in a word of the bitmap that filled
+ * up makes the word allocatable again, at once and after a remount,
+ * and the inode comes back empty. Inodes are taken lowest first, so
+ * 2 to IMAP_FILES+1 fill the first words. */
+#define IMAP_FILES 199
+
+static int imap_create(extent_client *ec, extent_protocol::extentid_t want)
+{
+    extent_protocol::extentid_t id;
+    std::string buf;
+
+    if (ec->create(extent_protocol::T_FILE, id) != extent_protocol::OK
+        || id != want) {
+        iprint("a freed inode was not reused");
+        return 1;
+    }
+    if (ec->get(id, buf) != extent_protocol::OK || !buf.empty()) {
+        iprint("a reused inode is not empty");
+        return 2;
+    }
+    return ec->put(id, pattern(id, 2, 300)) == extent_protocol::OK ? 0 : 3;
+}
+
+static int imap_run()
+{
+    extent_client *ec = new extent_client();
+    extent_protocol::extentid_t id;
+
+    for (int i = 0; i < IMAP_FILES; i++) {
+        ec->create(extent_protocol::T_FILE, id);
+        if (id != (extent_protocol::extentid_t)i + 2) {
+            iprint("inodes are not taken lowest first");
+            return 1;
+        }
+        ec->put(id, pattern(id, 1, 300));
+    }
+    // 70 is in the second word, full until now
+    ec->remove(70);
+    if (imap_create(ec, 70) != 0)
+        return 2;
+    // a freed word goes on top of the words with room
+    ec->remove(3);
+    ec->remove(150);
+    if (imap_create(ec, 150) != 0 || imap_create(ec, 3) != 0)
+        return 3;
+    ec->remove(100);
+    return ec->sync() == extent_protocol::OK ? 0 : 4;
+}
+
+static int imap_remount()
+{
+    extent_client *ec = new extent_client();
+    std::string buf;
+
+    if (imap_create(ec, 100) != 0)
+        return 1;
+    for (extent_protocol::extentid_t id = 2; id < IMAP_FILES + 2; id++) {
+        bool again = id == 3 || id == 70 || id == 100 || id == 150;
+        if (ec->get(id, buf) != extent_protocol::OK
+            || buf != pattern(id, again ? 2 : 1, 300)) {
+            iprint("file lost or changed");
+            return 2;
+        }
+    }
+    return 0;
+}
+
+int test_imap()
+{
+    if (run_child(imap_run) != 0)
+        return 1;
+    if (run_child(imap_remount) != 0)
+        return 2;
+    return run_child(check_image) == 0 ? 0 : 3;
+}
+
+/* Inode cache: a freed inode leaves the cache with it. Reading it
+ * then finds it free, and the file made on it next starts empty with
+ * its own type, with the cache as large as the files or smaller. */
+#define ICACHE_FILES 12
+#define ICACHE_SMALL "4"
+
+static int icache_expect(extent_client *ec, extent_protocol::extentid_t id,
+                         uint32_t type, const std::string &data)
+{
+    extent_protocol::attr a;
+    std::string buf;
+
+    if (ec->getattr(id, a) != extent_protocol::OK || a.type != type
+        || a.size != data.size()) {
+        iprint(type == 0 ? "a freed inode still reads as in use"
+               : "an inode reads with a stale type or size");
+        return 1;
+    }
+    if (ec->get(id, buf) != extent_protocol::OK || buf != data) {
+        iprint("an inode reads with stale contents");
+        return 2;
+    }
+    return 0;
+}
+
+static int icache_run()
+{
+    extent_client *ec = new extent_client();
+    extent_protocol::extentid_t id;
+
+    for (int i = 0; i < ICACHE_FILES; i++) {
+        ec->create(extent_protocol::T_FILE, id);
+        ec->put(id, pattern(id, 1, 300));
+        if (icache_expect(ec, id, extent_protocol::T_FILE, pattern(id, 1, 300)) != 0)
+            return 1;
+    }
+    // free every other file while cached, then take the inodes again
+    for (id = 2; id < ICACHE_FILES + 2; id += 2) {
+        ec->remove(id);
+        if (icache_expect(ec, id, 0, "") != 0)
+            return 2;
+    }
+    for (int i = 0; i < ICACHE_FILES / 2; i++) {
+        ec->create(extent_protocol::T_DIR, id);
+        if (icache_expect(ec, id, extent_protocol::T_DIR, "") != 0)
+            return 3;
+    }
+    for (id = 2; id < ICACHE_FILES + 2; id++) {
+        if (id % 2 == 0 ? icache_expect(ec, id, extent_protocol::T_DIR, "")
+            : icache_expect(ec, id, extent_protocol::T_FILE, pattern(id, 1, 300)))
+            return 4;
+    }
+    return ec->sync() == extent_protocol::OK ? 0 : 5;
+}
+
+static int icache_small()
+{
+    setenv(ICACHE_INODES_ENV, ICACHE_SMALL, 1);
+    return icache_run();
+}
+
+int test_icache()
+{
+    if (run_child(icache_run) != 0)
+        return 1;
+    unlink(image);
+    if (run_child(icache_small) != 0)
+        return 2;
+    return run_child(check_image) == 0 ? 0 : 3;
+}
+
+/* Persistence: files written to an image file are all there, byte for
+ * byte, after the server stops and starts again, twice over, changes
+ * made in between included. A restart takes the image as it is: the
+ * geometry asked for in the environment does not reformat it. The
+ * image file is grown sparsely, holding little more than the data.
+ * The server exits with 0 on an image it cannot mount, so a child
+ * that got through leaves a mark for the test to find. */
+#define PERSIST_FILES 30
+
+static superblock_t persist_sb;
+
+static size_t persist_len(extent_protocol::extentid_t id, int round)
+{
+    return (id * 977 + round * 131) % (id % 3 == 0 ? 100 : 40000);
+}
+
+static int persist_check(extent_client *ec, int round)
+{
+    extent_protocol::attr a;
+    std::string buf;
+
+    if (ec->getattr(1, a) != extent_protocol::OK
+        || a.type != extent_protocol::T_DIR) {
+        iprint("the root directory is gone");
+        return 1;
+    }
+    for (extent_protocol::extentid_t id = 2; id < PERSIST_FILES + 2; id++) {
+        // the files changed in the round before
+        int r = round > 0 && id % 5 == 0 ? round : 0;
+        if (ec->get(id, buf) != extent_protocol::OK
+            || buf != pattern(id, r, persist_len(id, r))) {
+            iprint("file lost or changed across a restart");
+            return 2;
+        }
+    }
+    return 0;
+}
+
+static int persist_done()
+{
+    FILE *fp = fopen((std::string(image) + ".ok").c_str(), "w");
+    if (fp == NULL)
+        return 1;
+    fclose(fp);
+    return 0;
+}
+
+static int persist_write()
+{
+    extent_client *ec = new extent_client();
+    extent_protocol::extentid_t id;
+
+    for (int i = 0; i < PERSIST_FILES; i++) {
+        ec->create(extent_protocol::T_FILE, id);
+        if (ec->put(id, pattern(id, 0, persist_len(id, 0))) != extent_protocol::OK)
+            return 1;
+    }
+    return ec->sync() == extent_protocol::OK ? 0 : 2;
+}
+
+static int persist_restart()
+{
+    int fd = open(image, O_RDONLY);
+    superblock_t sb;
+
+    if (fd < 0 || !read_superblock(fd, persist_sb))
+        return 1;
+    close(fd);
+    setenv(DISK_SIZE_ENV, "32M", 1);
+    setenv(BLOCK_SIZE_ENV, persist_sb.block_size == 512 ? "4096" : "512", 1);
+    extent_client *ec = new extent_client();
+    if (persist_check(ec, 0) != 0)
+        return 2;
+    for (extent_protocol::extentid_t id = 5; id < PERSIST_FILES + 2; id += 5)
+        ec->put(id, pattern(id, 1, persist_len(id, 1)));
+    if (ec->sync() != extent_protocol::OK)
+        return 3;
+    fd = open(image, O_RDONLY);
+    if (fd < 0 || !read_superblock(fd, sb))
+        return 4;
+    close(fd);
+    if (memcmp(&sb, &persist_sb, sizeof(sb)) != 0) {
+        iprint("a restart reformatted the image");
+        return 5;
+    }
+    return persist_done();
+}
+
+static int persist_read()
+{
+    extent_client *ec = new extent_client();
+    return persist_check(ec, 1) == 0 ? persist_done() : 1;
+}
+
+// Run fn, a child that leaves a mark when it gets through.
+static int persist_run(int (*fn)())
+{
+    std::string path = std::string(image) + ".ok";
+    int r = run_child(fn);
+
+    if (r == 0 && unlink(path.c_str()) != 0) {
+        iprint("the server could not mount the image");
+        return 1;
+    }
+    return r;
+}
+
+int test_persist()
+{
+    struct stat st;
+
+    if (run_child(persist_write) != 0)
+        return 1;
+    if (stat(image, &st) != 0 || (uint64_t)st.st_blocks * 512 > (uint64_t)st.st_size / 2) {
+        iprint("the image file is not sparse");
+        return 2;
+    }
+    if (persist_run(persist_restart) != 0)
+        return 3;
+    if (persist_run(persist_read) != 0)
+        return 4;
+    return run_child(check_image) == 0 ? 0 : 5;
+}
+
+/* Geometry: a 6 GB disk of 4K blocks formats with that geometry and
+ * works. The allocation groups go to threads round robin, so files
+ * written by enough threads at once land across the disk, past 4 GB
+ * into the image too, and read back after a remount. */
+#define GEO_DISK "6G"
+#define GEO_THREADS 48
+#define GEO_LEN (200 * 1024)
+
+static extent_client *geo_ec;
+static extent_protocol::extentid_t geo_ids[GEO_THREADS];
+static int geo_errors;
+
+static void *geo_writer(void *arg)
+{
+    long t = (long)arg;
+
+    if (geo_ec->create(extent_protocol::T_FILE, geo_ids[t]) != extent_protocol::OK
+        || geo_ec->put(geo_ids[t], pattern(geo_ids[t], t, GEO_LEN))
+           != extent_protocol::OK)
+        __sync_fetch_and_add(&geo_errors, 1);
+    return NULL;
+}
+
+static int geo_write()
+{
+    pthread_t th[GEO_THREADS];
+    superblock_t sb;
+    int fd;
+
+    setenv(DISK_SIZE_ENV, GEO_DISK, 1);
+    setenv(BLOCK_SIZE_ENV, "4096", 1);
+    // each writer allocates its blocks itself, in its own group
+    setenv(DELAY_BLOCKS_ENV, "0", 1);
+    geo_ec = new extent_client();
+    for (long t = 0; t < GEO_THREADS; t++)
+        pthread_create(&th[t], NULL, geo_writer, (void *)t);
+    for (int t = 0; t < GEO_THREADS; t++)
+        pthread_join(th[t], NULL);
+    if (geo_errors > 0 || geo_ec->sync() != extent_protocol::OK) {
+        iprint("error writing the files");
+        return 1;
+    }
+    fd = open(image, O_RDONLY);
+    if (fd < 0 || !read_superblock(fd, sb))
+        return 2;
+    if (sb.block_size != 4096 || (uint64_t)sb.nblocks * 4096 != 6ULL << 30) {
+        iprint("the disk was not formatted with the geometry asked for");
+        return 3;
+    }
+    if (lseek(fd, 4ULL << 30, SEEK_DATA) < 0) {
+        iprint("nothing was written past 4 GB");
+        return 4;
+    }
+    close(fd);
+    FILE *fp = fopen((std::string(image) + ".ids").c_str(), "w");
+    for (int t = 0; t < GEO_THREADS; t++)
+        fprintf(fp, "%llu\n", geo_ids[t]);
+    fclose(fp);
+    return 0;
+}
+
+static int geo_read()
+{
+    std::string path = std::string(image) + ".ids";
+    FILE *fp = fopen(path.c_str(), "r");
+    unsigned long long id;
+    std::string buf;
+
+    if (fp == NULL)
+        return 1;
+    extent_client *ec = new extent_client();
+    for (int t = 0; t < GEO_THREADS; t++) {
+        if (fscanf(fp, "%llu", &id) != 1 || ec->get(id, buf) != extent_protocol::OK
+            || buf != pattern(id, t, GEO_LEN)) {
+            iprint("file lost or changed");
+            return 2;
+        }
+    }
+    fclose(fp);
+    unlink(path.c_str());
+    return persist_done();
+}
+
+int test_geometry()
+{
+    if (run_child(geo_write) != 0)
+        return 1;
+    if (persist_run(geo_read) != 0)
+        return 2;
+    return run_child(check_image) == 0 ? 0 : 3;
+}
+
+/* Sparse backend: a 64 GB in-memory disk takes memory for what is
+ * written to it, not for its size: the server mounts in a few MB, and
+ * grows by not much more than the data, written in files and at
+ * offsets scattered over a large sparse file. */
+#define SPARSE_DISK "64G"
+#define SPARSE_FILES 16
+#define SPARSE_LEN (256 * 1024)
+#define SPARSE_HOPS 64
+#define SPARSE_MOUNT_KB (24 * 1024)
+
+// Resident memory of this process, in KB.
+static long vm_rss()
+{
+    FILE *fp = fopen("/proc/self/status", "r");
+    char line[256];
+    long kb = -1;
+
+    while (fp != NULL && fgets(line, sizeof(line), fp) != NULL) {
+        if (sscanf(line, "VmRSS: %ld", &kb) == 1)
+            break;
+    }
+    if (fp != NULL)
+        fclose(fp);
+    return kb;
+}
+
+static int sparse_run()
+{
+    extent_client *ec;
+    extent_protocol::extentid_t ids[SPARSE_FILES], big;
+    std::string buf;
+    long before, after;
+
+    setenv(DISK_BACKEND_ENV, "sparse", 1);
+    setenv(DISK_SIZE_ENV, SPARSE_DISK, 1);
+    setenv(BLOCK_SIZE_ENV, "4096", 1);
+    ec = new extent_client();
+    before = vm_rss();
+    if (before < 0 || before > SPARSE_MOUNT_KB) {
+        iprint("mounting the sparse disk took too much memory");
+        return 1;
+    }
+    for (int i = 0; i < SPARSE_FILES; i++) {
+        ec->create(extent_protocol::T_FILE, ids[i]);
+        if (ec->put(ids[i], pattern(ids[i], i, SPARSE_LEN)) != extent_protocol::OK)
+            return 2;
+    }
+    ec->create(extent_protocol::T_FILE, big);
+    for (int i = 0; i < SPARSE_HOPS; i++) {
+        if (ec->write_range(big, (unsigned long long)i << 30,
+                            pattern(big, i, 4096)) != extent_protocol::OK)
+            return 3;
+    }
+    if (ec->sync() != extent_protocol::OK)
+        return 4;
+    for (int i = 0; i < SPARSE_FILES; i++) {
+        if (ec->get(ids[i], buf) != extent_protocol::OK
+            || buf != pattern(ids[i], i, SPARSE_LEN)) {
+            iprint("file lost or changed");
+            return 5;
+        }
+    }
+    for (int i = 0; i < SPARSE_HOPS; i++) {
+        if (ec->read_range(big, (unsigned long long)i << 30, 8192, buf)
+            != extent_protocol::OK
+            || buf != (i + 1 < SPARSE_HOPS ? pattern(big, i, 4096)
+                       + std::string(4096, 0) : pattern(big, i, 4096))) {
+            iprint("sparse file differs from what was written");
+            return 6;
+        }
+    }
+    // the data, and as much again for the cache and the copies made
+    // on the way
+    after = vm_rss();
+    if (after - before > 2 * (SPARSE_FILES * SPARSE_LEN + SPARSE_HOPS * 4096) / 1024
+        + 8 * 1024) {
+        printf("\tresident %ld KB after mounting, %ld KB after writing\n",
+               before, after);
+        iprint("the sparse disk grew by much more than the data");
+        return 7;
+    }
+    return 0;
+}
+
+int test_sparse()
+{
+    return run_child(sparse_run);
+}
+
+struct test {
+    const char *name;
+    int (*fn)();
+};
+
+static struct test tests[] = {
+    { "journal", test_journal },
+    { "snapshot", test_snapshot },
+    { "snapdelete", test_snapdelete },
+    { "fsck", test_fsck },
+    { "range", test_range },
+    { "threads", test_threads },
+    { "enospc", test_enospc },
+    { "exttree", test_exttree },
+    { "bigfile", test_bigfile },
+    { "inline", test_inline },
+    { "imap", test_imap },
+    { "icache", test_icache },
+    { "persist", test_persist },
+    { "geometry", test_geometry },
+    { "sparse", test_sparse },
+};
+
+int main(int argc, char *argv[])
+{
+    int ntests = sizeof(tests) / sizeof(tests[0]);
+    int passed = 0, run = 0;
+    char dir[] = "/tmp/inode_tester.XXXXXX";
+
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+    for (int i = 0; i < ntests; i++) {
+        bool chosen = argc == 1;
+        for (int a = 1; a < argc; a++)
+            chosen = chosen || strcmp(argv[a], tests[i].name) == 0;
+        if (!chosen)
+            continue;
+        printf("========== begin test %s ==========\n", tests[i].name);
+        snprintf(image, sizeof(image), "%s/%s.img", dir, tests[i].name);
+        setenv(DISK_IMAGE_ENV, image, 1);
+        int r = tests[i].fn();
+        unlink(image);
+        run++;
+        if (r == 0) {
+            passed++;
+            printf("========== pass test %s ==========\n", tests[i].name);
+        } else {
+            printf("========== fail test %s (%d) ==========\n", tests[i].name, r);
+        }
+    }
+    rmdir(dir);
+    printf("---------------------------------\n");
+    printf("inode tests passed : %d/%d\n", passed, run);
+    return passed == run ? 0 : 1;
+}
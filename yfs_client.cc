@@ -276,16 +276,23 @@ yfs_client::setattr(inum ino, size_t size)
      * note: get the content of inode ino, and modify its content
      * according to the size (<, =, or >) content length.
      */
-    std::string data;
+    //The inode layer frees blocks at the end of the file, or grows it
+    //by a hole; the data that stays is not copied
     printf("\tyfs_client-setattr:%d\n",size);
-    r = ec->get(ino,data);
-    if(r != OK) return r;
-    if(data.size() >= size){
-        data = data.substr(0,size);
-    }else{
-        data += std::string(size-data.size(),'\0');
+    r = ec->truncate(ino,size);
+    return r;
+}
+
+int
+yfs_client::fallocate(inum ino, off_t off, off_t len)
+{
+    int r = OK;
+
+    printf("\tyfs_client-fallocate:%lld %lld\n",(long long)off,(long long)len);
+    if(off < 0 || len <= 0){
+        return IOERR;
     }
-    ec->put(ino,data);
+    r = ec->fallocate(ino,off,len);
     return r;
 }
 
@@ -429,13 +436,12 @@ yfs_client::read(inum ino, size_t size, off_t off, std::string &data)
      * note: read using ec->get().
      */
     printf("\tyfs_client::read(%d,%d,%d)",ino,size,off);
-    std::string file_content;
-    r = ec->get(ino,file_content);
-    if(r != OK || file_content.size() < off){
+    //Only the blocks of the range are read
+    data = "";
+    if(off < 0){
         return r;
-    }else{
-        data = file_content.substr(off,size);
     }
+    r = ec->read_range(ino,off,size,data);
     return r;
 }
 
@@ -450,31 +456,21 @@ yfs_client::write(inum ino, size_t size, off_t off, const char *data,
      * note: write using ec->put().
      * when off > length of original file, fill the holes with '\0'.
      */
-    std::string origin_data;
-    r = ec->get(ino,origin_data);
-    if(r != OK){
-        bytes_written = 0;
+    //Only the blocks of the range are written; a gap before off is
+    //left a hole, which reads as zeros, and counted as written. The
+    //size it is counted from comes back from the write itself, so a
+    //concurrent extend cannot change it in between
+    unsigned long long old_size = 0;
+    bytes_written = 0;
+    if(off < 0){
         return r;
     }
-    std::string new_data(data,size);
-    std::string front_data = origin_data.substr(0,off);
-    std::string hole(off-front_data.size(),'\0');
-    std::string back_data;
-    std::string final_data;
-    if(origin_data.size() > (new_data.size()+off)){
-        back_data = origin_data.substr(new_data.size()+off);
-        final_data = (front_data + new_data + back_data);
-        bytes_written = new_data.size();//What's the meaning of byte_written?
-    }else{
-        final_data = (front_data + hole + new_data);
-        bytes_written = new_data.size() + hole.size();//What's the meaning of byte_written?
-    }
-    r = ec->put(ino,final_data);
-    ec->get(ino,origin_data);
+    r = ec->write_range(ino,off,std::string(data,size),&old_size);
     if(r != OK){
-        bytes_written = 0;
         return r;
     }
+    size_t hole = (unsigned long long)off > old_size ? off - old_size : 0;
+    bytes_written = size + hole;
     return r;
 }
 
@@ -46,6 +46,7 @@ class yfs_client {
   int getdir(inum, dirinfo &);
 
   int setattr(inum, size_t);
+  int fallocate(inum, off_t, off_t);
   int lookup(inum, const char *, bool &, inum &);
   int create(inum, const char *, mode_t, inum &);
   int readdir(inum, std::list<dirent> &);
@@ -0,0 +1,77 @@
+// Offline consistency checker for the disk image named by YFS_DISK_IMAGE.
+// A live filesystem is scrubbed through extent_server::scrub instead.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "inode_manager.h"
+
+// Exits 0 if the filesystem is clean (or was repaired), 1 if problems
+// are left, 2 if it could not be checked at all.
+int
+main(int argc, char *argv[])
+{
+  int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  int flags = 0;
+  int ch;
+
+  while ((ch = getopt(argc, argv, "rj:")) != -1) {
+    switch (ch) {
+    case 'r':
+      flags |= FSCK_REPAIR;
+      break;
+    case 'j':
+      nthreads = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-r] [-j threads]\n", argv[0]);
+      exit(2);
+    }
+  }
+  if (nthreads < 1)
+    nthreads = 1;
+
+  // The superblock is checked before mounting, which would only refuse
+  // an image it does not recognize.
+  const char *image = getenv(DISK_IMAGE_ENV);
+  superblock_t sb;
+  struct stat st;
+  int fd;
+  if (image == NULL || image[0] == '\0') {
+    fprintf(stderr, "%s: set %s to the image to check\n", argv[0], DISK_IMAGE_ENV);
+    exit(2);
+  }
+  if ((fd = open(image, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+    perror(image);
+    exit(2);
+  }
+  if (pread(fd, &sb, sizeof(sb), 0) != (ssize_t)sizeof(sb)
+      || !check_superblock(sb)) {
+    printf("fsck: %s holds no filesystem\n", image);
+    exit(2);
+  }
+  close(fd);
+  if ((uint64_t)st.st_size < sb.size) {
+    printf("fsck: %s is %llu bytes, the filesystem %llu\n", image,
+           (unsigned long long)st.st_size, (unsigned long long)sb.size);
+    exit(2);
+  }
+
+  inode_manager *im = new inode_manager();
+  fsck_report r;
+  im->check(nthreads, flags, r);
+  if (flags & FSCK_REPAIR)
+    im->flush();
+
+  printf("fsck: %u inodes (%u directories), %llu blocks\n",
+         r.inodes, r.dirs, (unsigned long long)r.blocks);
+  printf("fsck: %u bad inodes, %u shared blocks, %u bad entries, %u orphans\n",
+         r.bad_inodes, r.dup_blocks, r.bad_entries, r.orphans);
+  printf("fsck: %u lost blocks, %u leaked blocks, %u inode bitmap errors\n",
+         r.lost_blocks, r.leaked_blocks, r.imap_errors);
+  printf("fsck: %u bitmap bits repaired\n", r.repaired);
+  return r.problems() > r.repaired ? 1 : 0;
+}